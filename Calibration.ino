@@ -0,0 +1,169 @@
+/*
+   --------- Channel calibration
+
+   Real transmitters don't output exactly PPM_PULSE_CENTER +/- PPM_PULSE_DELTA: a channel that
+   is off by a few microseconds has a center offset, and doesn't reach (or overshoots) the
+   axis ends. With CHANNEL_CALIBRATION, every channel is converted according to its own
+   endpoints & center, plus the CHANNEL_DEADBAND and its CHANNEL_EXPO.
+
+   The calibration pass is controlled from the Serial Monitor, by the Arduino loop():
+
+    - 'c' starts the calibration pass: the endpoints of every channel are tracked while all
+      the sticks, sliders & switches are moved to their endpoints
+    - 'c' again, with the sticks centered, ends the calibration pass (see ChannelCalibrator
+      in GamepadCore.h), and stores the calibration in the non-volatile storage (NVS)
+    - 'r' resets the calibration to the nominal pulse range
+
+   The conversion of every calibrated channel is precomputed into a table (see AxisCurve in
+   GamepadCore.h), which the GamepadRefresh task rebuilds whenever the calibration changes.
+   The loop() changes the calibration within the calibrationMux critical section, and the
+   GamepadRefresh task builds the tables from a copy taken within it.
+   Channels with the nominal pulse range, no deadband and no expo keep the exact AxisScale
+   conversion, as the interpolated table may differ from it by a couple of LSBs.
+*/
+
+#define CALIBRATION_NAMESPACE "jrcalib"
+#define CALIBRATION_VERSION   1
+
+// Channels moving by less than this during the calibration pass (in microseconds) keep their
+// calibration
+#define CALIBRATION_MIN_RANGE 200
+
+// The calibration is stored in RMT ticks: a calibration stored with a different tick rate
+// (see RMT_HIGH_RESOLUTION) is ignored
+
+static Preferences _calibrationStore;
+static ChannelCalibration _calibration[PPM_MAX_CHANNELS];
+static portMUX_TYPE calibrationMux = portMUX_INITIALIZER_UNLOCKED;
+static ChannelCalibrator _calibrator;
+static bool _calibrating = false;
+
+static const uint8_t _channelExpo[GAMEPAD_MAX_AXES] = CHANNEL_EXPO;
+
+// per-channel conversion tables (built by the GamepadRefresh task), and whether they are used
+static AxisCurve axisCurves[GAMEPAD_MAX_AXES];
+static bool axisCurved[GAMEPAD_MAX_AXES];
+
+// set when the calibration has changed, and the tables have to be rebuilt
+static volatile bool calibrationChanged = true;
+
+
+void _setCalibration (const ChannelCalibration calibration[]) {
+  portENTER_CRITICAL (&calibrationMux);
+  memcpy (_calibration, calibration, sizeof (_calibration));
+  portEXIT_CRITICAL (&calibrationMux);
+}
+
+
+void _resetCalibration() {
+  ChannelCalibration nominal[PPM_MAX_CHANNELS];
+  for (int i = 0; i < PPM_MAX_CHANNELS; i++) {
+    nominal[i].minimum = (PPM_PULSE_CENTER - PPM_PULSE_DELTA) * RMT_TICK_US;
+    nominal[i].center  = PPM_PULSE_CENTER * RMT_TICK_US;
+    nominal[i].maximum = (PPM_PULSE_CENTER + PPM_PULSE_DELTA) * RMT_TICK_US;
+  }
+  _setCalibration (nominal);
+}
+
+
+// Load the calibration from the non-volatile storage, or the nominal calibration if none is found
+
+void loadCalibration() {
+  if (! CHANNEL_CALIBRATION)
+    return;
+
+  _resetCalibration();
+
+  // opened for writing, as the read-only open of a namespace that doesn't exist yet (on the
+  // first boot) fails with an error message. Nothing is written when it exists.
+  if (! _calibrationStore.begin (CALIBRATION_NAMESPACE, false))
+    return;
+
+  ChannelCalibration stored[PPM_MAX_CHANNELS];
+  if (_calibrationStore.getUInt ("version", 0) == CALIBRATION_VERSION
+      && _calibrationStore.getUInt ("ticks", 0) == RMT_TICK_US
+      && _calibrationStore.getBytes ("channels", stored, sizeof (stored)) == sizeof (stored)) {
+    _setCalibration (stored);
+    DEBUG_PRINTLN ("   Channel calibration loaded");
+  }
+  _calibrationStore.end();
+}
+
+
+void _saveCalibration() {
+  if (! _calibrationStore.begin (CALIBRATION_NAMESPACE, false))
+    return;
+
+  _calibrationStore.putUInt ("version", CALIBRATION_VERSION);
+  _calibrationStore.putUInt ("ticks", RMT_TICK_US);
+  _calibrationStore.putBytes ("channels", _calibration, sizeof (_calibration));
+  _calibrationStore.end();
+}
+
+
+// Rebuild the conversion tables of the axes (called by the GamepadRefresh task)
+
+void buildAxisCurves() {
+  ChannelCalibration calibration[PPM_MAX_CHANNELS];
+  portENTER_CRITICAL (&calibrationMux);
+  memcpy (calibration, _calibration, sizeof (calibration));
+  portEXIT_CRITICAL (&calibrationMux);
+
+  for (int i = 0; i < axisCount; i++) {
+    axisCurved[i] = CHANNEL_DEADBAND || _channelExpo[i]
+                 || calibration[i].minimum != (PPM_PULSE_CENTER - PPM_PULSE_DELTA) * RMT_TICK_US
+                 || calibration[i].center  != PPM_PULSE_CENTER * RMT_TICK_US
+                 || calibration[i].maximum != (PPM_PULSE_CENTER + PPM_PULSE_DELTA) * RMT_TICK_US;
+    if (axisCurved[i])
+      axisCurves[i].begin (&calibration[i], CHANNEL_DEADBAND * RMT_TICK_US, _channelExpo[i], UNITY_BUG_WORKAROUND);
+  }
+}
+
+
+// Handle the serial commands, and track the channel endpoints during the calibration pass
+// (called by the Arduino loop). Returns true during the calibration pass.
+
+bool pollCalibration() {
+  if (! CHANNEL_CALIBRATION || ! channelsAvailable)
+    return false;
+
+  uint32_t channels[FRAME_VALUES];
+  uint32_t frame[PPM_MAX_CHANNELS];
+  uint32_t frameChannels;
+  readFrame (channels, &frameChannels, NULL);
+  frameAxes (channels, frame);
+  if (_calibrating)
+    _calibrator.sample (frame);
+
+  while (Serial.available() > 0) {
+    int command = Serial.read();
+
+    if (command == 'c' && ! _calibrating) {
+      _calibrator.begin (axisCount);
+      _calibrating = true;
+      Serial.println ("Calibration: move all sticks, sliders & switches to their endpoints, center the sticks, then send 'c'");
+    }
+    else if (command == 'c') {
+      _calibrating = false;
+      // the loop() is the only writer: _calibration can be read outside the critical section
+      ChannelCalibration calibration[PPM_MAX_CHANNELS];
+      memcpy (calibration, _calibration, sizeof (calibration));
+      uint32_t calibrated = _calibrator.finish (frame, CALIBRATION_MIN_RANGE * RMT_TICK_US, calibration);
+      _setCalibration (calibration);
+      Serial.printf ("Calibration: %u of %u channels calibrated\n", calibrated, axisCount);
+      for (int i = 0; i < axisCount; i++)
+        Serial.printf ("  channel %2d: %4u .. %4u .. %4u us\n", i + 1, calibration[i].minimum / RMT_TICK_US,
+                       calibration[i].center / RMT_TICK_US, calibration[i].maximum / RMT_TICK_US);
+      _saveCalibration();
+      calibrationChanged = true;
+    }
+    else if (command == 'r') {
+      _calibrating = false;
+      _resetCalibration();
+      _saveCalibration();
+      calibrationChanged = true;
+      Serial.println ("Calibration: reset");
+    }
+  }
+  return _calibrating;
+}
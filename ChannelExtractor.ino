@@ -2,84 +2,639 @@
    --------- ChannelExtractor task
   
    Initializes the ESP32 RMT module, then enters an endless loop that continuously
-   extracts the PPM signal frames.
+   extracts the PPM signal frames. (With INPUT_SBUS or INPUT_CRSF, a serial variant of
+   the task decodes SBUS or CRSF frames instead, see the end of this file)
   
    When a PPM signal is detected for the first time, the ChannelExtractor task will:
 
     - set axisCount to the number of channels
     - start the GamepadRefresh task & begin BLE Gamepad advertising
     - start the NoiseEstimator task for computing the channel noise threshold
+
+   Every decoded frame is published to frameStore under a seqlock: the ChannelExtractor
+   never waits for its readers, who use readFrame() to obtain a copy in which all the
+   channel values stem from the same PPM frame.
+
+   With PPM_AUX_INPUTS, every additional PPM input is decoded by its own auxExtractorTask (see
+   the end of this file), which publishes its frames as they arrive, in their own slots behind
+   the primary input's channels (from PPM_MAX_CHANNELS on), so the primary frame stays intact
+   for the refresh rate channel, and the additional inputs' axes keep moving when the primary
+   signal is lost. frameAxes() maps the additional inputs' channels to the axes that follow the
+   primary input's axes.
 */
 
-void channelExtractorTask (void *pvParameter) {
-  DEBUG_PRINTLN ("");
-  DEBUG_PRINTLN ("1. ChannelExtractor: waiting for PPM signal...");
-  
-  // Configure the ESP32 RMT module for performing continuous decoding of the PPM signal
+
+#if PPM_AUX_INPUTS
+
+// State of an additional PPM input
+struct AuxInput {
+  gpio_num_t     pin;
+  rmt_channel_t  channel;
+  FrameValidator validator;
+  uint32_t       receivedFrames;            // received frames since the input was detected (up to AUX_LOCK_FRAMES)
+  uint32_t       missingFrames;             // missing frames since the last received frame
+};
+
+static AuxInput auxInputs[PPM_AUX_INPUTS];
+
+// number of axes of the primary input, followed by the additional inputs' axes (set by _lockChannels)
+static uint32_t primaryAxes = 0;
+
+#endif
+
+
+// Publish a decoded PPM frame to frameStore
+
+void _publishFrame (uint32_t values[], uint32_t count, uint32_t timestamp) {
+  portENTER_CRITICAL (&frameMux);
+  frameStore.publish (values, count, timestamp);
+  channelCount = count;
+  portEXIT_CRITICAL (&frameMux);
+}
+
+
+// Copy the most recent PPM frame to values[] (sized for FRAME_VALUES), its channel count
+// to *count and its reception time (microseconds, that of the newest frame of any input)
+// to *timestamp, unless timestamp is NULL.
+// Returns the frame number, which allows skipping already processed frames.
+//
+// values[] holds the primary input's channels, followed by the additional inputs' channels
+// from PPM_MAX_CHANNELS on: use frameAxes() to obtain the channel values in axis order.
+
+uint32_t readFrame (uint32_t values[], uint32_t *count, uint32_t *timestamp) {
+  uint32_t number;
+  while (! frameStore.read (values, FRAME_VALUES, count, timestamp, &number))
+    taskYIELD();                    // a ChannelExtractor is publishing a frame, let it finish
+  return number;
+}
+
+
+// Copy the channel values of a frame read by readFrame() to axes[] (sized for PPM_MAX_CHANNELS)
+// in axis order: the primary input's axes, followed by the additional inputs' axes
+
+void frameAxes (const uint32_t values[], uint32_t axes[]) {
+#if PPM_AUX_INPUTS
+  for (int i = 0; i < axisCount; i++)
+    axes[i] = i < primaryAxes ? values[i] : values[PPM_MAX_CHANNELS + i - primaryAxes];
+#else
+  for (int i = 0; i < axisCount; i++)
+    axes[i] = values[i];
+#endif
+}
+
+
+// Wake up the consumers of a published frame
+
+void _notifyFrame() {
+  // wake up the GamepadRefresh task, which is waiting for a new frame (in power save mode, only
+  // with a Bluetooth connection: the connection wakes it up as well)
+  if (REFRESH_ON_FRAME && gamepadRefreshTaskHandle && (! POWER_SAVE || gamepad.connected)) {
+    pipelineStats.taskNotify (TASK_GAMEPAD_REFRESH);
+    xTaskNotifyGive (gamepadRefreshTaskHandle);
+  }
+
+  // in power save mode, the NoiseEstimator waits for the frames as well
+  if (POWER_SAVE && noiseEstimated && noiseEstimatorTaskHandle) {
+    pipelineStats.taskNotify (TASK_NOISE_ESTIMATOR);
+    xTaskNotifyGive (noiseEstimatorTaskHandle);
+  }
+}
+
+
+// Hand a decoded frame over to the consumers
+
+void _frameDecoded (uint32_t frame[], uint32_t frameChannels, uint32_t timestamp, uint32_t receiveCycles) {
+  _publishFrame (frame, frameChannels, timestamp);
+  missingFrames = 0;
+  receivedFrames++;
+  pipelineStats.framesReceived++;
+  pipelineStats.addCycles (STAGE_RECEIVE, PipelineStats::cycles() - receiveCycles);
+  _notifyFrame();
+}
+
+
+void _frameMissing() {
+  missingFrames++;
+  pipelineStats.framesMissed++;
+}
+
+
+// Lock the number of axes once the signal has been detected, and start the NoiseEstimator
+
+void _lockChannels() {
+  // skip the first couple of frames, because things tend to be "glitchy" on startup!
+  // (...fewer of them with a startup profile, whose channel count is checked anyway)
+  if (receivedFrames < (profileAxisCount ? 3 : 10))
+    return;
+
+  if (channelsAvailable == false) {   // is this the first iteration ?
+    // The initial axisCount plays a crucial role for the GamepadRefresh task, as it
+    // impacts how it will advertise itself via Bluetooth!
+    uint32_t count = FORCE_CHANNEL_COUNT ? FORCE_CHANNEL_COUNT : channelCount;
+    if (count > GAMEPAD_MAX_AXES - PPM_AUX_AXES)    // the remaining channels can't be mapped to gamepad axes
+      count = GAMEPAD_MAX_AXES - PPM_AUX_AXES;
+#if PPM_AUX_INPUTS
+    primaryAxes = count;
+    count += PPM_AUX_AXES;
+#endif
+
+    // Bluetooth has already been started with the startup profile's axisCount
+    if (profileAxisCount && count != profileAxisCount)
+      discardProfile();
+
+    axisCount = count;
+    channelsAvailable = true;
+
+    // compute the channel noise threshold
+    noiseEstimatorTaskHandle = xTaskCreateStaticPinnedToCore (noiseEstimatorTask, "noiseEstimatorTask", NOISE_ESTIMATOR_STACK,
+                                                              NULL, NOISE_ESTIMATOR_PRIORITY, noiseEstimatorStack,
+                                                              &noiseEstimatorTcb, NOISE_ESTIMATOR_CORE);
+  }
+}
+
+
+// RMT memory block size (items), and size of a complete PPM frame in the ring buffer (bytes)
+#define RMT_BLOCK_ITEMS  64
+#define RMT_FRAME_BYTES  ((PPM_MAX_CHANNELS + 1) * 4)
+
+static_assert (PPM_MAX_CHANNELS == CORE_MAX_CHANNELS, "PPM_MAX_CHANNELS must match GamepadCore.h");
+static_assert (FRAME_VALUES <= CORE_FRAME_VALUES, "Too many PPM_AUX_CHANNELS for GamepadCore.h");
+
+// The RMT clock must have a whole number of ticks per microsecond, and a channel pulse must
+// neither overflow an RMT pulse duration nor be mistaken for the sync pulse
+static_assert (80 % RMT_CLK_DIV == 0, "RMT_CLK_DIV must divide 80 MHz into whole ticks per microsecond");
+static_assert ((PPM_PULSE_MAX - PPM_SEPARATOR_MIN) * RMT_TICK_US < RMT_IDLE_THRESHOLD,
+               "PPM channel pulses overflow the RMT pulse durations: increase RMT_CLK_DIV");
+
+
+// Configure an RMT channel for performing continuous decoding of the PPM signal on pin,
+// returns its ring buffer
+
+RingbufHandle_t _startRmt (rmt_channel_t channel, gpio_num_t pin) {
   rmt_config_t rmt_rx;
-  rmt_rx.channel                          = RMT_RX_CHANNEL;
-  rmt_rx.gpio_num                         = PPM_PIN;
+  rmt_rx.channel                          = channel;
+  rmt_rx.gpio_num                         = pin;
   rmt_rx.clk_div                          = RMT_CLK_DIV;
-  rmt_rx.mem_block_num                    = 1;
+  rmt_rx.mem_block_num                    = RMT_MEM_BLOCKS;
   rmt_rx.rmt_mode                         = RMT_MODE_RX;
   rmt_rx.rx_config.filter_en              = true;                               // filter too short pulses / high frequency noise
   rmt_rx.rx_config.filter_ticks_thresh    = 100;                                
-  rmt_rx.rx_config.idle_threshold         = PPM_SYNC_MINIMUM * RMT_TICK_US;     // use min sync pulse length as idle threshold
+  rmt_rx.rx_config.idle_threshold         = RMT_IDLE_THRESHOLD;                 // use min sync pulse length as idle threshold
     
   rmt_config (&rmt_rx);
-  rmt_driver_install (RMT_RX_CHANNEL, 128, 0);   // channel, ring buffer size, default flags
+  rmt_driver_install (channel, RMT_RINGBUF_SIZE, 0);          // channel, ring buffer size, default flags
 
   RingbufHandle_t rb = NULL;
-  rmt_channel_t channel = RMT_RX_CHANNEL;
   rmt_get_ringbuf_handle (channel, &rb);
   rmt_rx_start (channel, true);
+  return rb;
+}
+
+
+// PPM frame validation (see GamepadCore.h)
+
+void _beginValidator (FrameValidator *validator) {
+  validator->begin (PPM_PULSE_MIN * RMT_TICK_US, PPM_PULSE_MAX * RMT_TICK_US,
+                    (PPM_MAX_FRAMESIZE - PPM_SYNC_MINIMUM) * RMT_TICK_US,
+                    PPM_MAX_SLEW * RMT_TICK_US, PPM_BRIDGE_FRAMES);
+}
+
+
+#if INPUT_PROTOCOL == INPUT_PPM
+
+static FrameValidator frameValidator;
+
+
+#if POWER_SAVE
+
+// Power save mode: as the RMT clock stops during light sleep, the ChannelExtractor holds a power
+// management lock while the RMT receiver runs. Once the PPM signal has been absent for a
+// while, the RMT receiver is shut down, and the ChannelExtractor waits for the next edge on
+// PPM_PIN, which also wakes the ESP32 up from light sleep.
+//
+// Between the PPM frames, the receiver is stopped until shortly before the predicted start of
+// the next frame (see FrameTiming in GamepadCore.h). The additional PPM inputs' frames aren't
+// aligned with the primary input's, so they keep the receivers running.
+
+#define PPM_LIGHT_SLEEP (CONFIG_PM_ENABLE && ! PPM_AUX_INPUTS)
+
+// frame periods that must agree, and their tolerated jitter (us), before predicting the next frame
+#define SLEEP_LOCK_FRAMES       4
+#define SLEEP_PERIOD_TOLERANCE  250
+
+static TaskHandle_t _edgeTask = NULL;
+
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t _rmtLock = NULL;
+#endif
+
+// Keep the ESP32 out of light sleep while the RMT receiver runs
+
+void _holdAwake (bool awake) {
+#if CONFIG_PM_ENABLE
+  if (! _rmtLock)
+    esp_pm_lock_create (ESP_PM_NO_LIGHT_SLEEP, 0, "rmt", &_rmtLock);
+  if (awake)
+    esp_pm_lock_acquire (_rmtLock);
+  else
+    esp_pm_lock_release (_rmtLock);
+#endif
+}
+
+void IRAM_ATTR _ppmEdge() {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR (_edgeTask, &woken);
+  if (woken)
+    portYIELD_FROM_ISR();
+}
+
+RingbufHandle_t _waitForSignal (rmt_channel_t channel, gpio_num_t pin) {
+  DEBUG_PRINTLN ("   PPM signal absent: RMT receiver shut down");
+  rmt_rx_stop (channel);
+  rmt_driver_uninstall (channel);
+  _holdAwake (false);
+
+  _edgeTask = xTaskGetCurrentTaskHandle();
+  pinMode (pin, INPUT_PULLUP);
+#if CONFIG_PM_ENABLE
+  // light sleep only wakes up on GPIO levels: wait for the opposite of the idle level
+  gpio_wakeup_enable (pin, digitalRead (pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+#endif
+  attachInterrupt (pin, _ppmEdge, CHANGE);
+
+  pipelineStats.taskSleep (TASK_CHANNEL_EXTRACTOR);
+  ulTaskNotifyTake (pdTRUE, portMAX_DELAY);
+  pipelineStats.taskWake (TASK_CHANNEL_EXTRACTOR);
+
+  detachInterrupt (pin);
+#if CONFIG_PM_ENABLE
+  gpio_wakeup_disable (pin);
+#endif
+  DEBUG_PRINTLN ("   PPM signal edge: RMT receiver restarted");
+  _holdAwake (true);
+  return _startRmt (channel, pin);
+}
+
+
+#if PPM_LIGHT_SLEEP
+
+static FrameTiming frameTiming;
+
+// Stop the receiver, and let the ESP32 light-sleep until shortly before the next PPM frame
+
+void _sleepUntilFrame (rmt_channel_t channel) {
+  uint32_t sleepMillis = frameTiming.sleepMicros (micros(), POWER_SAVE_SLEEP_GUARD_MICROS) / 1000;
+  if (sleepMillis < 2)                // ...not worth a light sleep
+    return;
+
+  rmt_rx_stop (channel);
+  _holdAwake (false);
+  pipelineStats.taskDelay (TASK_CHANNEL_EXTRACTOR, sleepMillis);
+  _holdAwake (true);
+  rmt_rx_start (channel, true);
+}
+
+#endif // PPM_LIGHT_SLEEP
+
+#endif // POWER_SAVE
+
+
+// Write a ring buffer item (or a frame timeout, if item is NULL) to the Serial port in the
+// RmtCapture format
+
+#if CAPTURE_RMT_FRAMES && (defined(DEBUG) || DIAGNOSTICS)
+ #error "CAPTURE_RMT_FRAMES requires DEBUG and DIAGNOSTICS to be disabled"
+#endif
+
+void _captureFrame (rmt_item32_t *item, size_t rx_size, uint32_t flags) {
+  static uint8_t record[RMT_CAPTURE_MAX_RECORD];
+  size_t size = rmtCaptureEncode (record, (uint32_t*) item, item ? rx_size / 4 : 0, flags, micros());
+  Serial.write (record, size);
+}
+
+
+void channelExtractorTask (void *pvParameter) {
+  DEBUG_PRINTLN ("");
+  DEBUG_PRINTLN ("1. ChannelExtractor: waiting for PPM signal...");
+  
+  // Configure the ESP32 RMT module for performing continuous decoding of the PPM signal
+#if POWER_SAVE
+  _holdAwake (true);
+#endif
+  RingbufHandle_t rb = _startRmt (RMT_RX_CHANNEL, PPM_PIN);
+  _beginValidator (&frameValidator);
+#if PPM_LIGHT_SLEEP
+  frameTiming.begin (PPM_SYNC_MINIMUM, PPM_MAX_FRAMESIZE, SLEEP_PERIOD_TOLERANCE, SLEEP_LOCK_FRAMES);
+#endif
+
+  // channel values of the PPM frame being decoded, and channel count of the last published frame
+  uint32_t frame[PPM_MAX_CHANNELS];
+  uint32_t frameChannels = 0;
+  uint32_t publishedChannels = 0;
+
+  // time without any RMT item (ms)
+  uint32_t silentMillis = 0;
 
   // endless loop
   while (rb) {
     size_t rx_size = 0;
 
+#if POWER_SAVE
+    if (silentMillis >= POWER_SAVE_IDLE_MILLIS) {
+      rb = _waitForSignal (RMT_RX_CHANNEL, PPM_PIN);
+      silentMillis = 0;
+      if (! rb)
+        break;
+    }
+#endif
+
     // Read the next item containing the current PPM frame from the Ringbuffer.
     // The xRingbufferReceive call blocks for a maximum of PPM_MAX_FRAMESIZE microseconds until the
     // next PPM frame is available.
+    pipelineStats.taskSleep (TASK_CHANNEL_EXTRACTOR);
     rmt_item32_t* item = (rmt_item32_t*) xRingbufferReceive (rb, &rx_size, PPM_MAX_FRAMESIZE / 1000);
-    if (item) {
-      
-       channelCount = rx_size / 4 - 1;
-      if (channelCount > PPM_MAX_CHANNELS)    // prevent overflows on glitchy PPM signals
-        channelCount = PPM_MAX_CHANNELS;
-       
-      for (int i = 0; i < channelCount && i < PPM_MAX_CHANNELS; i++) {
-        //Serial.print ((item+i)->duration1); Serial.print("+"); Serial.print((item+i)->duration0); Serial.print(" ");
-        channelValues[i] = (item+i)->duration1 + (item+i)->duration0;
-      }
-      //Serial.println();
-      
+    pipelineStats.taskWake (TASK_CHANNEL_EXTRACTOR);
+    silentMillis = item ? 0 : silentMillis + PPM_MAX_FRAMESIZE / 1000;
+
+    // A nearly full ring buffer means that frames may have been dropped by the RMT driver
+    uint32_t captureFlags = 0;
+    if (item && xRingbufferGetCurFreeSize (rb) < RMT_FRAME_BYTES) {
+      pipelineStats.framesOverrun++;
+      captureFlags = RMT_CAPTURE_OVERRUN;
+    }
+
+    // Drain the frames that have piled up in the ring buffer (when the CPU was kept busy by the
+    // Bluetooth stack), keeping only the newest one
+    while (item) {
+      size_t next_size = 0;
+      rmt_item32_t* next = (rmt_item32_t*) xRingbufferReceive (rb, &next_size, 0);
+      if (! next)
+        break;
+      if (CAPTURE_RMT_FRAMES)
+        _captureFrame (item, rx_size, captureFlags | RMT_CAPTURE_DROPPED);
+      vRingbufferReturnItem (rb, (void*) item);
+      item = next;
+      rx_size = next_size;
+      pipelineStats.framesDropped++;
+#if PPM_LIGHT_SLEEP
+      frameTiming.miss();
+#endif
+    }
+
+    if (CAPTURE_RMT_FRAMES)
+      _captureFrame (item, rx_size, captureFlags);
+
+    // A frame filling up the RMT memory has been truncated
+    if (item && rx_size >= RMT_MEM_BLOCKS * RMT_BLOCK_ITEMS * 4) {
       vRingbufferReturnItem (rb, (void*) item);
       item = NULL;
-      missingFrames = 0;
-      receivedFrames++;
+      pipelineStats.framesOverrun++;
     }
-    else
-      missingFrames++;
 
-    if (receivedFrames < 10)            // skip the first couple of PPM frames
-      continue;                         // ...because things tend to be "glitchy" on startup!
+    if (item) {
+      uint32_t receiveCycles = PipelineStats::cycles();
+      uint32_t timestamp = micros();
       
-    if (channelsAvailable == false) {   // is this the first iteration ? 
-      channelsAvailable = true;
-   
-      // The initial axisCount plays a crucial role for the GamepadRefresh task, as it
-      // impacts how it will advertise itself via Bluetooth!
-      axisCount = FORCE_CHANNEL_COUNT ? FORCE_CHANNEL_COUNT : channelCount;
-  
-      // compute the channel noise threshold
-      xTaskCreate (noiseEstimatorTask, "noiseEstimatorTask", 1024, NULL, 1, NULL);
+      uint32_t rawChannels = rx_size / 4 - 1;
+      frameChannels = coreDecodeFrame ((uint32_t*) item, rx_size / 4, frame);
+#if PPM_LIGHT_SLEEP
+      // the frame started before its items, and the idle threshold that ended it
+      uint32_t frameStart = timestamp - (coreFrameTicks ((uint32_t*) item, rx_size / 4) + RMT_IDLE_THRESHOLD) / RMT_TICK_US;
+#endif
+      vRingbufferReturnItem (rb, (void*) item);
+      item = NULL;
+
+      // once the signal is locked, the channel count must not change
+      if (channelsAvailable && ! frameValidator.lockedChannels)
+        frameValidator.lockedChannels = publishedChannels;
+
+      bool valid = true;
+      uint32_t glitches = 0;
+      if (PPM_VALIDATION && ! frameValidator.validate (frame, frameChannels, rawChannels, &glitches)) {
+        pipelineStats.framesRejected++;
+#if PPM_LIGHT_SLEEP
+        frameTiming.miss();
+#endif
+        valid = frameValidator.bridge (frame, &frameChannels);
+        if (valid)
+          pipelineStats.framesBridged++;
+      }
+#if PPM_LIGHT_SLEEP
+      // predict the next frame once the signal is locked, from the frames received as is
+      else if (frameValidator.lockedChannels && ! glitches)
+        frameTiming.frame (frameStart);
+      else
+        frameTiming.miss();
+#endif
+      pipelineStats.glitchesHeld += glitches;
 
-      // initialize gamepad
-      //xTaskCreate (gamepadRefreshTask, "gamepadRefreshTask", 65536, NULL, 1, NULL);
+      if (valid) {
+        frameValidator.accept (frame, frameChannels);
+        _frameDecoded (frame, frameChannels, timestamp, receiveCycles);
+        publishedChannels = frameChannels;
+      }
+      else
+        _frameMissing();
+    }
+    else {
+      _frameMissing();
+#if PPM_LIGHT_SLEEP
+      frameTiming.miss();
+#endif
     }
+
+    _lockChannels();
+
+#if PPM_LIGHT_SLEEP
+    _sleepUntilFrame (RMT_RX_CHANNEL);
+#endif
   }
 
   Serial.println ("channelExtractorTask exiting : No Ringbuffer returned by RMT !");
   vTaskDelete (NULL);
 }
+
+#else // INPUT_PROTOCOL is INPUT_SBUS or INPUT_CRSF
+
+// Serial variant of the ChannelExtractor task: the SBUS or CRSF signal is received on PPM_PIN
+// by UART 2, and decoded byte by byte. The HardwareSerial class does not offer blocking reads,
+// so the UART is polled every millisecond.
+//
+// The 11-bit channel values are converted to RMT ticks, so that the rest of the pipeline
+// doesn't need to know about the input protocol.
+
+void channelExtractorTask (void *pvParameter) {
+  DEBUG_PRINTLN ("");
+  DEBUG_PRINTLN (INPUT_PROTOCOL == INPUT_SBUS ? "1. ChannelExtractor: waiting for SBUS signal..."
+                                              : "1. ChannelExtractor: waiting for CRSF signal...");
+
+#if INPUT_PROTOCOL == INPUT_SBUS
+  SbusDecoder decoder;
+  Serial2.begin (SBUS_BAUDRATE, SERIAL_8E2, PPM_PIN, -1, true);     // inverted signal
+#else
+  CrsfDecoder decoder;
+  Serial2.begin (CRSF_BAUDRATE, SERIAL_8N1, PPM_PIN, -1, false);
+#endif
+
+  uint32_t frame[PPM_MAX_CHANNELS];
+  uint32_t lastFrame = millis();
+
+  // endless loop
+  while (true) {
+    uint32_t decoded = 0;
+    uint32_t receiveCycles = PipelineStats::cycles();
+
+    while (Serial2.available() > 0) {
+      if (! decoder.feed (Serial2.read()))
+        continue;
+
+#if INPUT_PROTOCOL == INPUT_SBUS
+      if (decoder.failsafe)           // the receiver lost the transmitter's signal
+        continue;
+#endif
+      // 172 .. 992 .. 1811 maps to 988 .. 1500 .. 2012 us
+      for (int i = 0; i < RC_SERIAL_CHANNELS && i < PPM_MAX_CHANNELS; i++)
+        frame[i] = (PPM_PULSE_CENTER * 8 + ((int32_t) decoder.channels[i] - 992) * 5) * RMT_TICK_US / 8;
+      decoded++;
+    }
+
+    if (decoded) {
+      pipelineStats.framesDropped += decoded - 1;   // only the newest of the frames read at once is used
+      _frameDecoded (frame, RC_SERIAL_CHANNELS, micros(), receiveCycles);
+      lastFrame = millis();
+      _lockChannels();
+    }
+    else if (millis() - lastFrame > PPM_MAX_FRAMESIZE / 1000) {
+      _frameMissing();
+      lastFrame = millis();
+    }
+
+    pipelineStats.taskDelay (TASK_CHANNEL_EXTRACTOR, 1);
+  }
+}
+
+#endif // INPUT_PROTOCOL
+
+
+#if PPM_AUX_INPUTS
+
+// ----- Additional PPM inputs
+//
+// Every additional PPM input is decoded by an auxExtractorTask on its own RMT channel. Each
+// channel takes RMT_MEM_BLOCKS memory blocks away from the following ones, so the additional
+// inputs use every RMT_MEM_BLOCKS-th channel after RMT_RX_CHANNEL.
+//
+// An input is detected after AUX_LOCK_FRAMES valid frames, which lock its channel count, and
+// lost after AUX_LOSS_FRAMES missing frames (50 ms timeouts or rejected frames), which center
+// its axes until the input is detected again.
+
+#define AUX_LOCK_FRAMES 10
+#define AUX_LOSS_FRAMES 3
+
+static const gpio_num_t auxInputPins[] = PPM_AUX_PINS;
+
+static_assert (sizeof (auxInputPins) / sizeof (auxInputPins[0]) >= PPM_AUX_INPUTS, "PPM_AUX_PINS lacks pins for PPM_AUX_INPUTS");
+static_assert (RMT_RX_CHANNEL + (PPM_AUX_INPUTS + 1) * RMT_MEM_BLOCKS <= RMT_CHANNEL_MAX,
+               "Not enough RMT channels for PPM_AUX_INPUTS: reduce RMT_MEM_BLOCKS");
+static_assert (PPM_AUX_AXES <= GAMEPAD_MAX_AXES - PPM_MIN_CHANNELS, "Too many PPM_AUX_CHANNELS");
+
+
+// Publish the newest frame of additional input i (or centered axes, if frame is NULL) to its
+// own slots, and wake up the consumers, as the primary input does
+
+void _auxFrameDecoded (int i, const uint32_t frame[], uint32_t frameChannels) {
+  uint32_t values[PPM_AUX_CHANNELS];
+  for (int c = 0; c < PPM_AUX_CHANNELS; c++)
+    values[c] = frame && c < frameChannels ? frame[c] : PPM_PULSE_CENTER * RMT_TICK_US;
+  uint32_t timestamp = micros();
+
+  portENTER_CRITICAL (&frameMux);
+  frameStore.publishAux (PPM_MAX_CHANNELS + i * PPM_AUX_CHANNELS, values, PPM_AUX_CHANNELS, timestamp);
+  portEXIT_CRITICAL (&frameMux);
+  _notifyFrame();
+}
+
+
+void auxExtractorTask (void *pvParameter) {
+  int index = (intptr_t) pvParameter;
+  AuxInput *input = &auxInputs[index];
+
+  RingbufHandle_t rb = _startRmt (input->channel, input->pin);
+  _beginValidator (&input->validator);
+
+  uint32_t frame[PPM_MAX_CHANNELS];
+  uint32_t frameChannels = 0;
+
+  // endless loop
+  while (rb) {
+    size_t rx_size = 0;
+    rmt_item32_t* item = (rmt_item32_t*) xRingbufferReceive (rb, &rx_size, PPM_MAX_FRAMESIZE / 1000);
+
+    // keep only the newest of the frames that have piled up in the ring buffer
+    while (item) {
+      size_t next_size = 0;
+      rmt_item32_t* next = (rmt_item32_t*) xRingbufferReceive (rb, &next_size, 0);
+      if (! next)
+        break;
+      vRingbufferReturnItem (rb, (void*) item);
+      item = next;
+      rx_size = next_size;
+    }
+
+    // decode & validate the frame, unless it has been truncated
+    bool valid = false;
+    if (item) {
+      if (rx_size < RMT_MEM_BLOCKS * RMT_BLOCK_ITEMS * 4) {
+        uint32_t rawChannels = rx_size / 4 - 1;
+        uint32_t glitches = 0;
+        frameChannels = coreDecodeFrame ((uint32_t*) item, rx_size / 4, frame);
+        valid = ! PPM_VALIDATION || input->validator.validate (frame, frameChannels, rawChannels, &glitches)
+                || input->validator.bridge (frame, &frameChannels);
+      }
+      vRingbufferReturnItem (rb, (void*) item);
+    }
+
+    if (valid) {
+      input->validator.accept (frame, frameChannels);
+      input->missingFrames = 0;
+      if (input->receivedFrames < AUX_LOCK_FRAMES && ++input->receivedFrames == AUX_LOCK_FRAMES) {
+        input->validator.lockedChannels = frameChannels;
+        DEBUG_PRINT ("   Additional PPM input detected, channels: "); DEBUG_PRINTLN (frameChannels);
+      }
+      if (input->receivedFrames == AUX_LOCK_FRAMES)
+        _auxFrameDecoded (index, frame, frameChannels);
+    }
+    else if (++input->missingFrames == AUX_LOSS_FRAMES && input->receivedFrames) {
+      // the input is lost: center its axes, and detect it again from scratch
+      if (input->receivedFrames == AUX_LOCK_FRAMES) {
+        _auxFrameDecoded (index, NULL, 0);
+        DEBUG_PRINTLN ("   Additional PPM input lost");
+      }
+      input->receivedFrames = 0;
+      _beginValidator (&input->validator);
+    }
+  }
+
+  Serial.println ("auxExtractorTask exiting : No Ringbuffer returned by RMT !");
+  vTaskDelete (NULL);
+}
+
+
+// Start an auxExtractorTask for every additional PPM input (called by setup)
+
+void startAuxExtractorTasks() {
+  for (int i = 0; i < PPM_AUX_INPUTS; i++) {
+    AuxInput *input = &auxInputs[i];
+    input->pin = auxInputPins[i];
+    input->channel = (rmt_channel_t) (RMT_RX_CHANNEL + (i + 1) * RMT_MEM_BLOCKS);
+    _auxFrameDecoded (i, NULL, 0);                  // centered until the input is detected
+    pinMode (input->pin, INPUT_PULLUP);
+
+    auxExtractorTaskHandle[i] = xTaskCreateStaticPinnedToCore (auxExtractorTask, "auxExtractorTask", AUX_EXTRACTOR_STACK,
+                                                               (void*) (intptr_t) i, CHANNEL_EXTRACTOR_PRIORITY, auxExtractorStack[i],
+                                                               &auxExtractorTcb[i], CHANNEL_EXTRACTOR_CORE);
+  }
+}
+
+#endif // PPM_AUX_INPUTS
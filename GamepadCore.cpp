@@ -0,0 +1,797 @@
+#include "GamepadCore.h"
+#include <math.h>
+
+
+// ----- PPM frame decoding
+//
+// An RMT item holds two pulses (15-bit duration & 1-bit level each): the channel's
+// separator pulse and the channel pulse proper, whose sum is the channel value.
+
+uint32_t coreDecodeFrame (const uint32_t items[], uint32_t count, uint32_t frame[])
+{
+  uint32_t channels = count ? count - 1 : 0;        // the last item holds the sync pulse
+  if (channels > CORE_MAX_CHANNELS)                 // prevent overflows on glitchy PPM signals
+    channels = CORE_MAX_CHANNELS;
+
+  for (uint32_t i = 0; i < channels; i++)
+    frame[i] = (items[i] & 0x7FFF) + ((items[i] >> 16) & 0x7FFF);
+  return channels;
+}
+
+
+uint32_t coreFrameTicks (const uint32_t items[], uint32_t count)
+{
+  uint32_t ticks = 0;
+  for (uint32_t i = 0; i < count; i++)
+    ticks += (items[i] & 0x7FFF) + ((items[i] >> 16) & 0x7FFF);
+  return ticks;
+}
+
+
+// ----- PPM frame validation
+
+FrameValidator::FrameValidator () : history(0), bridged(0), pulseMin(0), pulseMax(0xFFFFFFFF),
+  frameMax(0xFFFFFFFF), maxSlew(0), bridgeFrames(0), lockedChannels(0)
+{
+}
+
+void FrameValidator::begin (uint32_t pulseMin, uint32_t pulseMax, uint32_t frameMax, uint32_t maxSlew, uint32_t bridgeFrames)
+{
+  this->pulseMin = pulseMin;
+  this->pulseMax = pulseMax;
+  this->frameMax = frameMax;
+  this->maxSlew = maxSlew;
+  this->bridgeFrames = bridgeFrames;
+  this->history = this->bridged = this->lockedChannels = 0;
+}
+
+bool FrameValidator::validate (uint32_t frame[], uint32_t frameChannels, uint32_t rawChannels, uint32_t *glitches)
+{
+  uint32_t frameTicks = 0;
+
+  // once the signal is locked, the channel count must not change
+  if (rawChannels > CORE_MAX_CHANNELS || frameChannels < 2 ||
+      (this->lockedChannels && frameChannels != this->lockedChannels))
+    return false;
+
+  for (uint32_t i = 0; i < frameChannels; i++) {
+    if (frame[i] < this->pulseMin || frame[i] > this->pulseMax)
+      return false;
+    frameTicks += frame[i];
+  }
+  if (frameTicks > this->frameMax)
+    return false;
+
+  // a channel jumping by more than maxSlew keeps its previous value, unless the jump is
+  // confirmed by the previous frame
+  if (this->maxSlew && this->history) {
+    for (uint32_t i = 0; i < frameChannels; i++) {
+      uint32_t previous = this->valid[0][i];
+      uint32_t jump = frame[i] > previous ? frame[i] - previous : previous - frame[i];
+      uint32_t confirmation = frame[i] > this->jump[i] ? frame[i] - this->jump[i] : this->jump[i] - frame[i];
+
+      this->jump[i] = frame[i];
+      if (jump > this->maxSlew && confirmation > this->maxSlew) {
+        frame[i] = previous;
+        (*glitches)++;
+      }
+    }
+  }
+
+  this->bridged = 0;
+  return true;
+}
+
+bool FrameValidator::bridge (uint32_t frame[], uint32_t *frameChannels)
+{
+  if (this->bridged >= this->bridgeFrames || this->history < 2 || this->lockedChannels == 0)
+    return false;
+  this->bridged++;
+
+  *frameChannels = this->lockedChannels;
+  for (uint32_t i = 0; i < this->lockedChannels; i++) {
+    int32_t value = 2 * (int32_t) this->valid[0][i] - (int32_t) this->valid[1][i];
+    if (value < (int32_t) this->pulseMin)
+      value = this->pulseMin;
+    else if (value > (int32_t) this->pulseMax)
+      value = this->pulseMax;
+    frame[i] = value;
+  }
+  return true;
+}
+
+void FrameValidator::accept (const uint32_t frame[], uint32_t frameChannels)
+{
+  for (uint32_t i = 0; i < frameChannels; i++) {
+    this->valid[1][i] = this->valid[0][i];
+    this->valid[0][i] = frame[i];
+  }
+  if (this->history < 2)
+    this->history++;
+}
+
+
+// ----- PPM frame timing
+
+void FrameTiming::begin (uint32_t minPeriod, uint32_t maxPeriod, uint32_t tolerance, uint32_t lockFrames)
+{
+  this->minPeriod = minPeriod;
+  this->maxPeriod = maxPeriod;
+  this->tolerance = tolerance;
+  this->lockFrames = lockFrames;
+  this->lastStart = this->period = this->matches = 0;
+  this->started = false;
+}
+
+
+void FrameTiming::frame (uint32_t startMicros)
+{
+  uint32_t period = startMicros - this->lastStart;
+
+  if (! this->started || period < this->minPeriod || period > this->maxPeriod)
+    this->matches = 0;                      // first frame, or frames missed in between
+  else if (this->period && (period > this->period ? period - this->period : this->period - period) <= this->tolerance) {
+    this->period = (this->period * 3 + period) / 4;     // follow the transmitter's clock
+    this->matches++;
+  }
+  else {
+    this->period = period;
+    this->matches = 1;
+  }
+
+  this->lastStart = startMicros;
+  this->started = true;
+}
+
+
+void FrameTiming::miss (void)
+{
+  this->matches = 0;
+}
+
+
+uint32_t FrameTiming::sleepMicros (uint32_t nowMicros, uint32_t guardMicros)
+{
+  if (this->matches < this->lockFrames)
+    return 0;
+
+  int32_t remaining = (int32_t) (this->lastStart + this->period - guardMicros - nowMicros);
+  return remaining > 0 ? remaining : 0;
+}
+
+
+// ----- Frame handoff
+
+FrameStore::FrameStore () : sequence(0), count(0), timestamp(0)
+{
+  for (uint32_t i = 0; i < CORE_FRAME_VALUES; i++)
+    this->values[i] = 0;
+}
+
+
+void FrameStore::publish (const uint32_t frame[], uint32_t count, uint32_t timestamp)
+{
+  this->sequence++;                         // odd sequence number: update in progress
+  __sync_synchronize();
+
+  for (uint32_t i = 0; i < count; i++)
+    this->values[i] = frame[i];
+  this->count = count;
+  this->timestamp = timestamp;
+
+  __sync_synchronize();
+  this->sequence++;                         // even sequence number: update completed
+}
+
+
+void FrameStore::publishAux (uint32_t first, const uint32_t values[], uint32_t count, uint32_t timestamp)
+{
+  this->sequence++;
+  __sync_synchronize();
+
+  for (uint32_t i = 0; i < count && first + i < CORE_FRAME_VALUES; i++)
+    this->values[first + i] = values[i];
+  this->timestamp = timestamp;
+
+  __sync_synchronize();
+  this->sequence++;
+}
+
+
+bool FrameStore::read (uint32_t values[], uint32_t valueCount, uint32_t *count, uint32_t *timestamp, uint32_t *number)
+{
+  uint32_t sequence = this->sequence;
+  if (sequence & 1)                         // a writer is publishing a frame
+    return false;
+  __sync_synchronize();
+
+  for (uint32_t i = 0; i < valueCount && i < CORE_FRAME_VALUES; i++)
+    values[i] = this->values[i];
+  *count = this->count;
+  if (timestamp)
+    *timestamp = this->timestamp;
+
+  __sync_synchronize();
+  *number = sequence >> 1;
+  return sequence == this->sequence;        // no update meanwhile ? then the copy is consistent
+}
+
+
+// ----- Channel noise estimation & change detection
+//
+// The lowest and highest value of every channel are sampled during the first second after
+// PPM signal detection: their difference, scaled by noiseScale, is the channel's initial
+// noise threshold.
+//
+// Afterwards, an exponentially weighted moving average and variance of every channel are
+// updated with every new PPM frame, and the channel's noise threshold follows the standard
+// deviation. The variance is only updated while the channel is at rest, so that stick
+// movements are not mistaken for noise. update() tells movements apart by itself, with the
+// same threshold, hysteresis and hold time as changeDetected(), so that it doesn't depend on
+// the change detection running (which it only does with a Bluetooth connection).
+//
+// A hysteresis prevents small stick movements from being swallowed: once a channel has
+// moved, it is compared against its noise threshold divided by the hysteresis, until it
+// has been at rest for holdMillis milliseconds.
+
+// Noise threshold = NOISE_SIGMAS standard deviations, scaled by noiseScale (the difference
+// between two noisy samples rarely exceeds 3 standard deviations times sqrt(2))
+#define NOISE_SIGMAS 4
+
+// Minimum noise threshold, in RMT ticks
+#define NOISE_THRESHOLD_MIN 1
+
+// Fixed point representation of the moving average: 4 fractional bits
+#define NOISE_FRACTION_BITS 4
+
+// EWMA weights of the moving average (1/8) and variance (1/64), as bit shifts
+#define NOISE_MEAN_SHIFT 3
+#define NOISE_VAR_SHIFT  6
+
+// Deviations from the moving average beyond this many noise thresholds are stick
+// movements: the moving average is re-centered instead of being updated
+#define NOISE_MOVEMENT_FACTOR 4
+
+
+// Integer square root
+
+uint32_t coreIsqrt (uint32_t value)
+{
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+
+  while (bit > value)
+    bit >>= 2;
+
+  while (bit) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+      root >>= 1;
+    bit >>= 2;
+  }
+  return root;
+}
+
+
+void NoiseEstimator::begin (uint32_t channels, uint32_t pulseMin, uint32_t pulseMax,
+                            float noiseScale, uint32_t hysteresis, uint32_t holdMillis)
+{
+  this->channels = channels > CORE_MAX_CHANNELS ? CORE_MAX_CHANNELS : channels;
+  this->noiseScale = noiseScale;
+  this->hysteresis = hysteresis;
+  this->holdMillis = holdMillis;
+
+  for (uint32_t i = 0; i < this->channels; i++) {
+    this->minimum[i] = pulseMax;
+    this->maximum[i] = pulseMin;
+    this->ref[i] = 0;
+    this->moving[i] = false;
+    this->lastMovement[i] = 0;
+    this->settling[i] = false;
+    this->lastExcursion[i] = 0;
+  }
+}
+
+
+void NoiseEstimator::sample (const uint32_t frame[])
+{
+  // remember the minimum and maximum value of every channel
+  for (uint32_t i = 0; i < this->channels; i++) {
+    if (frame[i] < this->minimum[i])
+      this->minimum[i] = frame[i];
+    if (frame[i] > this->maximum[i])
+      this->maximum[i] = frame[i];
+  }
+}
+
+
+void NoiseEstimator::finishSampling (void)
+{
+  for (uint32_t i = 0; i < this->channels; i++) {
+    uint32_t diff = this->maximum[i] - this->minimum[i];
+    this->threshold[i] = diff * this->noiseScale;
+    if (this->threshold[i] < NOISE_THRESHOLD_MIN)
+      this->threshold[i] = NOISE_THRESHOLD_MIN;
+
+    // seed the moving average and variance: the peak-to-peak amplitude of 100 noisy
+    // samples is about 5 standard deviations
+    this->mean[i] = ((this->minimum[i] + this->maximum[i]) / 2) << NOISE_FRACTION_BITS;
+    uint32_t deviation = (diff << NOISE_FRACTION_BITS) / 5;
+    if (deviation > 0xFFFF)
+      deviation = 0xFFFF;
+    this->var[i] = deviation * deviation;
+  }
+}
+
+
+void NoiseEstimator::restore (const uint32_t thresholds[])
+{
+  for (uint32_t i = 0; i < this->channels; i++) {
+    this->threshold[i] = thresholds[i] < NOISE_THRESHOLD_MIN ? NOISE_THRESHOLD_MIN : thresholds[i];
+
+    // seed the variance from the threshold, and let the first update() re-center the moving average
+    uint32_t deviation = (this->threshold[i] << (NOISE_FRACTION_BITS + 4)) / (uint32_t) (NOISE_SIGMAS * this->noiseScale * 16);
+    if (deviation > 0xFFFF)
+      deviation = 0xFFFF;
+    this->var[i] = deviation * deviation;
+    this->mean[i] = 0;
+  }
+}
+
+
+void NoiseEstimator::update (const uint32_t frame[], uint32_t nowMillis)
+{
+  for (uint32_t i = 0; i < this->channels; i++) {
+    int32_t value = frame[i] << NOISE_FRACTION_BITS;
+    int32_t deviation = value - this->mean[i];
+    uint32_t magnitude = deviation < 0 ? -deviation : deviation;
+
+    // a settling channel is compared against a lower threshold, as in changeDetected()
+    uint32_t movement = this->settling[i]
+      ? this->threshold[i] / this->hysteresis
+      : this->threshold[i];
+    if (magnitude > movement << NOISE_FRACTION_BITS) {
+      this->settling[i] = true;
+      this->lastExcursion[i] = nowMillis;
+    }
+    else if (this->settling[i] && nowMillis - this->lastExcursion[i] > this->holdMillis)
+      this->settling[i] = false;
+
+    if (magnitude > (this->threshold[i] * NOISE_MOVEMENT_FACTOR) << NOISE_FRACTION_BITS) {
+      this->mean[i] = value;        // stick movement: re-center
+      continue;
+    }
+    this->mean[i] += deviation >> NOISE_MEAN_SHIFT;
+
+    if (this->settling[i])          // don't mistake stick movements for noise
+      continue;
+
+    if (magnitude > 0xFFFF)         // prevent overflows on very noisy channels
+      magnitude = 0xFFFF;
+    uint32_t square = magnitude * magnitude;
+    this->var[i] = square > this->var[i]
+                 ? this->var[i] + ((square - this->var[i]) >> NOISE_VAR_SHIFT)
+                 : this->var[i] - ((this->var[i] - square) >> NOISE_VAR_SHIFT);
+
+    // the standard deviation has NOISE_FRACTION_BITS fractional bits
+    uint32_t threshold = (coreIsqrt (this->var[i]) * (uint32_t) (NOISE_SIGMAS * this->noiseScale * 16)) >> (NOISE_FRACTION_BITS + 4);
+    this->threshold[i] = threshold < NOISE_THRESHOLD_MIN ? NOISE_THRESHOLD_MIN : threshold;
+  }
+}
+
+
+// Detect if channel value changes have resulted from user input by comparing the
+// difference of the given frame's channel values with the last reference values,
+// against the channel noise thresholds.
+
+bool NoiseEstimator::changeDetected (const uint32_t frame[], uint32_t nowMillis)
+{
+  bool changed = false;
+
+  // check each channel value against its noise threshold
+  for (uint32_t i = 0; i < this->channels; i++) {
+    uint32_t difference = frame[i] > this->ref[i]
+      ? frame[i] - this->ref[i]
+      : this->ref[i] - frame[i];
+
+    // a moving channel is compared against a lower threshold (hysteresis)
+    uint32_t threshold = this->moving[i]
+      ? this->threshold[i] / this->hysteresis
+      : this->threshold[i];
+
+    if (difference > threshold) {
+      changed = true;
+      this->moving[i] = true;
+      this->lastMovement[i] = nowMillis;
+    }
+    else if (this->moving[i] && nowMillis - this->lastMovement[i] > this->holdMillis)
+      this->moving[i] = false;
+  }
+
+  // set the current channel values as the new reference values
+  if (changed)
+    for (uint32_t i = 0; i < this->channels; i++)
+      this->ref[i] = frame[i];
+
+  return changed;
+}
+
+
+// ----- Input filter
+
+void InputFilter::begin (uint32_t channels, uint32_t tickRate, float minCutoff, float beta, float speedCutoff, uint32_t predictMillis)
+{
+  this->channels = channels > CORE_MAX_CHANNELS ? CORE_MAX_CHANNELS : channels;
+  this->tickRate = tickRate;
+  this->minCutoff = minCutoff;
+  this->beta = beta;
+  this->speedCutoff = speedCutoff;
+  this->predictMillis = predictMillis;
+  this->started = false;
+}
+
+
+// Smoothing factor of an exponential filter with the given cutoff frequency (Hz) and
+// sampling period (s)
+
+static float _filterAlpha (float cutoff, float period)
+{
+  float tau = 1.0f / (6.2831853f * cutoff);
+  return 1.0f / (1.0f + tau / period);
+}
+
+
+void InputFilter::update (const uint32_t frame[], uint32_t frameMicros)
+{
+  if (! this->started) {
+    for (uint32_t i = 0; i < this->channels; i++) {
+      this->value[i] = (float) frame[i] / this->tickRate;
+      this->speed[i] = 0;
+    }
+    this->timestamp = frameMicros;
+    this->started = true;
+    return;
+  }
+
+  float period = (frameMicros - this->timestamp) / 1000000.0f;
+  if (period <= 0)
+    return;
+  this->timestamp = frameMicros;
+
+  float speedAlpha = _filterAlpha (this->speedCutoff, period);
+
+  for (uint32_t i = 0; i < this->channels; i++) {
+    float value = (float) frame[i] / this->tickRate;
+
+    // filter the speed, then the value with a speed-dependent cutoff frequency
+    this->speed[i] += speedAlpha * ((value - this->value[i]) / period - this->speed[i]);
+    float cutoff = this->minCutoff + this->beta * fabsf (this->speed[i]);
+    this->value[i] += _filterAlpha (cutoff, period) * (value - this->value[i]);
+  }
+}
+
+
+void InputFilter::predict (uint32_t frame[], uint32_t nowMicros)
+{
+  if (! this->started)
+    return;
+
+  float lead = this->predictMillis
+             ? (nowMicros - this->timestamp) / 1000000.0f + this->predictMillis / 1000.0f
+             : 0;
+
+  for (uint32_t i = 0; i < this->channels; i++) {
+    float value = this->value[i] + this->speed[i] * lead;
+    frame[i] = value > 0 ? (uint32_t) (value * this->tickRate + 0.5f) : 0;
+  }
+}
+
+
+// ----- Channel calibration & expo curves
+
+void AxisCurve::begin (const ChannelCalibration *calibration, uint32_t deadband, uint32_t expo, bool unityBugWorkaround)
+{
+  uint32_t minimum = calibration->minimum, maximum = calibration->maximum;
+  uint32_t center = calibration->center;
+
+  // at least one tick per table point on either side of the deadband
+  if (center < minimum + deadband + CORE_CURVE_HALF || center + deadband + CORE_CURVE_HALF > maximum) {
+    deadband = 0;
+    if (maximum < minimum + 2 * CORE_CURVE_HALF)
+      maximum = minimum + 2 * CORE_CURVE_HALF;
+    if (center < minimum + CORE_CURVE_HALF || center > maximum - CORE_CURVE_HALF)
+      center = (minimum + maximum) / 2;
+  }
+
+  this->ticksMin = minimum;
+  this->ticksMax = maximum;
+  this->deadLow = center - deadband;
+  this->deadHigh = center + deadband;
+  this->scaleLow = (CORE_CURVE_HALF << 20) / (this->deadLow - minimum);
+  this->scaleHigh = (CORE_CURVE_HALF << 20) / (maximum - this->deadHigh);
+
+  float e = (expo > 100 ? 100 : expo) / 100.0f;
+  for (uint32_t k = 0; k < CORE_CURVE_POINTS; k++) {
+    float x = ((float) k - CORE_CURVE_HALF) / CORE_CURVE_HALF;   // -1 .. 1
+    float y = x * (1 - e) + x * x * x * e;
+
+    // the axis range of AxisScale: 0 .. 32767 with the Unity bug workaround, otherwise -32767 .. 32767
+    int32_t axis = unityBugWorkaround ? (int32_t) ((y + 1) * 16384 + 0.5f) : (int32_t) (y * 32768 + (y < 0 ? -0.5f : 0.5f));
+    int32_t floor = unityBugWorkaround ? 0 : -32767;
+    this->table[k] = axis < floor ? floor : axis > 32767 ? 32767 : axis;
+  }
+}
+
+
+void ChannelCalibrator::begin (uint32_t channels)
+{
+  this->channels = channels > CORE_MAX_CHANNELS ? CORE_MAX_CHANNELS : channels;
+  for (uint32_t i = 0; i < CORE_MAX_CHANNELS; i++) {
+    this->minimum[i] = 0xFFFFFFFF;
+    this->maximum[i] = 0;
+  }
+}
+
+
+void ChannelCalibrator::sample (const uint32_t frame[])
+{
+  for (uint32_t i = 0; i < this->channels; i++) {
+    if (frame[i] < this->minimum[i])
+      this->minimum[i] = frame[i];
+    if (frame[i] > this->maximum[i])
+      this->maximum[i] = frame[i];
+  }
+}
+
+
+uint32_t ChannelCalibrator::finish (const uint32_t frame[], uint32_t minRange, ChannelCalibration calibration[])
+{
+  uint32_t calibrated = 0;
+
+  for (uint32_t i = 0; i < this->channels; i++) {
+    uint32_t minimum = this->minimum[i], maximum = this->maximum[i];
+    if (maximum < minimum || maximum - minimum < minRange)
+      continue;
+
+    uint32_t third = (maximum - minimum) / 3;
+    calibration[i].minimum = minimum;
+    calibration[i].maximum = maximum;
+    calibration[i].center = frame[i] > minimum + third && frame[i] < maximum - third
+                          ? frame[i] : (minimum + maximum) / 2;
+    calibrated++;
+  }
+  return calibrated;
+}
+
+
+// ----- Adaptive refresh rate
+
+// Stick speed decay per frame, as a bit shift (1/8)
+#define REFRESH_SPEED_DECAY_SHIFT 3
+
+void RefreshController::begin (uint32_t channels, uint32_t minRate, uint32_t fullSpeed, uint32_t recoveryRate)
+{
+  this->channels = channels > CORE_MAX_CHANNELS ? CORE_MAX_CHANNELS : channels;
+  this->minRate = minRate ? minRate : 1;
+  this->fullSpeed = fullSpeed ? fullSpeed : 1;
+  this->recoveryRate = recoveryRate;
+  this->previousMicros = this->speed = this->backoff = this->lastMillis = 0;
+  this->lastRate = this->minRate;
+  this->started = false;
+}
+
+
+void RefreshController::update (const uint32_t frame[], uint32_t frameMicros, const uint32_t thresholds[])
+{
+  uint32_t elapsed = frameMicros - this->previousMicros;
+  uint32_t movement = 0;
+
+  // fastest channel movement beyond its noise threshold
+  for (uint32_t i = 0; i < this->channels; i++) {
+    uint32_t difference = frame[i] > this->previous[i] ? frame[i] - this->previous[i] : this->previous[i] - frame[i];
+    if (difference > thresholds[i] && difference - thresholds[i] > movement)
+      movement = difference - thresholds[i];
+    this->previous[i] = frame[i];
+  }
+  this->previousMicros = frameMicros;
+
+  if (! this->started || ! elapsed) {
+    this->started = true;
+    return;
+  }
+
+  // fast attack, slow decay
+  uint32_t speed = (uint64_t) movement * 1000000 / elapsed;
+  if (speed >= this->speed)
+    this->speed = speed;
+  else
+    this->speed -= (this->speed - speed) >> REFRESH_SPEED_DECAY_SHIFT;
+}
+
+
+void RefreshController::congestion (uint32_t nowMillis)
+{
+  uint32_t current = this->backoff ? this->backoff : this->lastRate << 8;
+
+  this->backoff = current / 2 > (this->minRate << 8) ? current / 2 : this->minRate << 8;
+  this->lastMillis = nowMillis;
+}
+
+
+uint32_t RefreshController::rate (uint32_t maxRate, uint32_t nowMillis)
+{
+  // let the backpressure ceiling recover
+  if (this->backoff) {
+    uint32_t elapsed = nowMillis - this->lastMillis < 1000 ? nowMillis - this->lastMillis : 1000;
+    this->backoff += (this->recoveryRate * elapsed << 8) / 1000;
+    if (this->backoff >= maxRate << 8)
+      this->backoff = 0;
+  }
+  this->lastMillis = nowMillis;
+
+  uint32_t speed = this->speed < this->fullSpeed ? this->speed : this->fullSpeed;
+  uint32_t rate = maxRate > this->minRate
+                ? this->minRate + (uint64_t) (maxRate - this->minRate) * speed / this->fullSpeed
+                : maxRate;
+
+  if (this->backoff && rate > this->backoff >> 8)
+    rate = this->backoff >> 8;
+  this->lastRate = rate ? rate : 1;
+  return this->lastRate;
+}
+
+
+// ----- Notify pacing
+
+uint32_t coreMicrosToConnectionEvent (uint32_t nowMicros, uint32_t anchorMicros, uint32_t interval)
+{
+  if (! interval)
+    return 0;
+
+  return interval - (nowMicros - anchorMicros) % interval;
+}
+
+
+uint32_t corePacingDelay (uint32_t waitMicros, uint32_t guardMicros)
+{
+  // the task delay has a 1 ms resolution: only wait if that still leaves the guard time
+  return waitMicros > guardMicros + 1000 ? (waitMicros - guardMicros) / 1000 : 0;
+}
+
+
+// ----- HID report map & report encoding
+
+// HID report descriptor items (short items with a 1-byte or 2-byte value)
+#define HID_USAGE_PAGE      0x04
+#define HID_USAGE           0x08
+#define HID_COLLECTION      0xA0
+#define HID_END_COLLECTION  0xC0
+#define HID_INPUT           0x80
+#define HID_LOGICAL_MINIMUM 0x14
+#define HID_LOGICAL_MAXIMUM 0x24
+#define HID_REPORT_SIZE     0x74
+#define HID_REPORT_ID       0x84
+#define HID_REPORT_COUNT    0x94
+#define HID_USAGE_MINIMUM   0x18
+#define HID_USAGE_MAXIMUM   0x28
+
+#define HID_DATA_VARIABLE_ABSOLUTE 0x02
+#define HID_CONSTANT               0x03
+
+static const uint8_t _axisUsages[] = {
+  0x30, 0x31, 0x32, 0x33, 0x34, 0x35,   // X, Y, Z, rX, rY, rZ
+  0x36, 0x37, 0x38, 0x40, 0x41, 0x42    // Slider, Dial, Wheel, vX, vY, vZ
+};
+
+static uint8_t* _item (uint8_t *p, uint8_t item, uint8_t value)
+{
+  *p++ = item | 1;
+  *p++ = value;
+  return p;
+}
+
+static uint8_t* _item16 (uint8_t *p, uint8_t item, uint16_t value)
+{
+  *p++ = item | 2;
+  *p++ = value;
+  *p++ = value >> 8;
+  return p;
+}
+
+size_t coreBuildReportMap (uint8_t map[], const HidLayout *layout)
+{
+  uint8_t *p = map;
+  int32_t maximum = (1 << (layout->bits - 1)) - 1;
+  int32_t minimum = layout->positive ? 0 : -maximum;
+  uint32_t padding = coreReportLength (layout) * 8 - layout->buttons - layout->axes * layout->bits;
+
+  p = _item (p, HID_USAGE_PAGE, 0x01);                // Generic Desktop
+  for (uint32_t g = 0; g < layout->gamepads; g++) {
+    p = _item (p, HID_USAGE, 0x05);                   // Gamepad
+    p = _item (p, HID_COLLECTION, 0x01);              // Application
+    p = _item (p, HID_REPORT_ID, g + 1);
+
+    // buttons (at least 8: some drivers don't recognize gamepads without buttons)
+    p = _item (p, HID_USAGE_PAGE, 0x09);              // Button
+    p = _item (p, HID_USAGE_MINIMUM, 1);
+    p = _item (p, HID_USAGE_MAXIMUM, layout->buttons);
+    p = _item (p, HID_LOGICAL_MINIMUM, 0);
+    p = _item (p, HID_LOGICAL_MAXIMUM, 1);
+    p = _item (p, HID_REPORT_SIZE, 1);
+    p = _item (p, HID_REPORT_COUNT, layout->buttons);
+    p = _item (p, HID_INPUT, HID_DATA_VARIABLE_ABSOLUTE);
+
+    // axes
+    p = _item (p, HID_USAGE_PAGE, 0x01);              // Generic Desktop
+    for (uint32_t a = 0; a < layout->axes; a++)
+      p = _item (p, HID_USAGE, _axisUsages[a]);
+    if (layout->bits > 8) {
+      p = _item16 (p, HID_LOGICAL_MINIMUM, minimum);
+      p = _item16 (p, HID_LOGICAL_MAXIMUM, maximum);
+    }
+    else {
+      p = _item (p, HID_LOGICAL_MINIMUM, minimum);
+      p = _item (p, HID_LOGICAL_MAXIMUM, maximum);
+    }
+    p = _item (p, HID_REPORT_SIZE, layout->bits);
+    p = _item (p, HID_REPORT_COUNT, layout->axes);
+    p = _item (p, HID_INPUT, HID_DATA_VARIABLE_ABSOLUTE);
+
+    // padding to a whole byte
+    if (padding) {
+      p = _item (p, HID_REPORT_SIZE, padding);
+      p = _item (p, HID_REPORT_COUNT, 1);
+      p = _item (p, HID_INPUT, HID_CONSTANT);
+    }
+    *p++ = HID_END_COLLECTION;
+  }
+  return p - map;
+}
+
+
+size_t coreReportLength (const HidLayout *layout)
+{
+  return (layout->buttons + layout->axes * layout->bits + 7) / 8;
+}
+
+
+// Fields are packed least significant bit first, as HID reports are little-endian
+
+static inline void _pack (uint8_t report[], uint32_t *position, uint32_t value, uint32_t bits)
+{
+  while (bits) {
+    uint32_t offset = *position & 7;
+    uint32_t chunk = 8 - offset < bits ? 8 - offset : bits;
+
+    report[*position >> 3] |= (value & ((1 << chunk) - 1)) << offset;
+    value >>= chunk;
+    bits -= chunk;
+    *position += chunk;
+  }
+}
+
+size_t coreEncodeReport (uint8_t report[], const int16_t axes[], uint32_t buttons, const HidLayout *layout)
+{
+  size_t length = coreReportLength (layout);
+  uint32_t position = 0;
+  int32_t maximum = (1 << (layout->bits - 1)) - 1;
+  int32_t minimum = layout->positive ? 0 : -maximum;
+
+  for (size_t i = 0; i < length; i++)
+    report[i] = 0;
+
+  _pack (report, &position, buttons, layout->buttons);
+  for (uint32_t a = 0; a < layout->axes; a++) {
+    // keep the most significant bits, within the logical range
+    int32_t value = axes[a] >> (16 - layout->bits);
+    if (value < minimum)
+      value = minimum;
+    else if (value > maximum)
+      value = maximum;
+    _pack (report, &position, (uint32_t) value, layout->bits);
+  }
+  return length;
+}
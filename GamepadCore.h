@@ -0,0 +1,413 @@
+// Portable core of the PPM-to-HID pipeline: PPM frame decoding & validation, channel noise
+// estimation & change detection, axis value conversion and HID report encoding.
+//
+// The core has no Arduino, FreeRTOS or BLE dependencies, and takes its parameters from its
+// callers instead of the sketch's configuration defines, so that it can be built & profiled
+// on the computer (see the extras folder). The sketch's tasks merely feed it with frames
+// and timestamps.
+
+#ifndef GAMEPADCORE_H
+#define GAMEPADCORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Maximum number of channels in a PPM frame (must match the sketch's PPM_MAX_CHANNELS)
+#define CORE_MAX_CHANNELS 16
+
+
+// ----- PPM frame decoding
+
+// Decode the RMT items of a PPM frame (one item per channel, followed by the sync pulse) into
+// channel values in RMT ticks. Returns the number of channels, at most CORE_MAX_CHANNELS.
+uint32_t coreDecodeFrame (const uint32_t items[], uint32_t count, uint32_t frame[]);
+
+// Length of a PPM frame's RMT items, from its first to its last edge (ticks)
+uint32_t coreFrameTicks (const uint32_t items[], uint32_t count);
+
+
+// ----- PPM frame validation
+
+class FrameValidator {
+
+  private:
+    uint32_t valid[2][CORE_MAX_CHANNELS];   // the last two accepted frames
+    uint32_t jump[CORE_MAX_CHANNELS];       // channel values of unconfirmed jumps
+    uint32_t history;                       // number of accepted frames (up to 2)
+    uint32_t bridged;                       // number of consecutive bridged frames
+
+  public:
+    uint32_t pulseMin, pulseMax;            // channel pulse bounds (ticks)
+    uint32_t frameMax;                      // maximum total length of the channel pulses (ticks)
+    uint32_t maxSlew;                       // maximum channel jump without confirmation (ticks), 0 to disable
+    uint32_t bridgeFrames;                  // maximum number of consecutive bridged frames
+    uint32_t lockedChannels;                // expected number of channels, 0 until the signal is locked
+
+    FrameValidator();
+    void begin (uint32_t pulseMin, uint32_t pulseMax, uint32_t frameMax, uint32_t maxSlew, uint32_t bridgeFrames);
+
+    // Check a frame, and hold the channels jumping by more than maxSlew (their number is added
+    // to *glitches). Returns false if the frame must be rejected.
+    bool validate (uint32_t frame[], uint32_t frameChannels, uint32_t rawChannels, uint32_t *glitches);
+
+    // Replace a rejected frame by a linear extrapolation of the last two accepted frames.
+    // Returns false if the gap can't be bridged.
+    bool bridge (uint32_t frame[], uint32_t *frameChannels);
+
+    // Remember a published frame
+    void accept (const uint32_t frame[], uint32_t frameChannels);
+};
+
+
+// ----- PPM frame timing
+//
+// Transmitters output their PPM frames at a fixed period. Once a number of consecutive frame
+// periods agree, the start of the next frame is predicted, so that the RMT receiver can be
+// stopped and the ESP32 light-slept until shortly before it (the RMT clock stops in light
+// sleep). A missing or rejected frame drops the prediction until the periods agree again, so
+// that a wrong prediction only costs a few frames.
+
+class FrameTiming {
+
+  private:
+    uint32_t lastStart;                     // start time of the last valid frame (us)
+    uint32_t period;                        // frame period (us), 0 if unknown
+    uint32_t matches;                       // consecutive frame periods agreeing with period
+    bool     started;
+
+  public:
+    uint32_t minPeriod, maxPeriod;          // plausible frame periods (us)
+    uint32_t tolerance;                     // frame period jitter tolerated (us)
+    uint32_t lockFrames;                    // agreeing frame periods needed for a prediction
+
+    void begin (uint32_t minPeriod, uint32_t maxPeriod, uint32_t tolerance, uint32_t lockFrames);
+    void frame (uint32_t startMicros);      // a valid frame started at startMicros
+    void miss (void);                       // a frame was missing, rejected or dropped
+
+    // Microseconds from nowMicros until guardMicros before the predicted start of the next
+    // frame, 0 if there is no prediction or the time has passed
+    uint32_t sleepMicros (uint32_t nowMicros, uint32_t guardMicros);
+};
+
+
+// ----- Frame handoff
+//
+// The newest frame is handed over from the tasks decoding the inputs to their readers under a
+// seqlock: the writers never wait for the readers, who retry until they obtain a copy in which
+// all the values stem from the same update. The primary input's frames fill the first slots,
+// and every additional input publishes its own frames to its own slots behind them, leaving
+// the primary input's slots unchanged. The writers must be serialized by the caller.
+
+// Maximum number of values in a frame: the primary input's channels, followed by those of the
+// additional inputs (at least the sketch's FRAME_VALUES)
+#define CORE_FRAME_VALUES 32
+
+class FrameStore {
+
+  private:
+    volatile uint32_t sequence;             // incremented before and after every update: odd while in progress
+    uint32_t values[CORE_FRAME_VALUES];
+    uint32_t count;                         // number of channels of the primary input's newest frame
+    uint32_t timestamp;                     // time of the newest update (us)
+
+  public:
+    FrameStore();
+
+    // Publish the primary input's frame to the first count slots
+    void publish (const uint32_t frame[], uint32_t count, uint32_t timestamp);
+
+    // Publish count values of an additional input to the slots from first on
+    void publishAux (uint32_t first, const uint32_t values[], uint32_t count, uint32_t timestamp);
+
+    // Copy the first valueCount values to values[], the primary input's number of channels to
+    // *count, and the time of the update to *timestamp, unless timestamp is NULL. Returns false
+    // if an update is in progress or was completed meanwhile: the caller then retries. Otherwise,
+    // *number is set to the update number, which allows skipping already processed updates.
+    bool read (uint32_t values[], uint32_t valueCount, uint32_t *count, uint32_t *timestamp, uint32_t *number);
+};
+
+
+// ----- Channel noise estimation & change detection
+
+class NoiseEstimator {
+
+  private:
+    uint32_t minimum[CORE_MAX_CHANNELS];    // lowest sampled channel values
+    uint32_t maximum[CORE_MAX_CHANNELS];    // highest sampled channel values
+    uint32_t ref[CORE_MAX_CHANNELS];        // reference channel values
+    int32_t  mean[CORE_MAX_CHANNELS];       // moving average of the channel values (fixed point)
+    uint32_t var[CORE_MAX_CHANNELS];        // moving variance of the channel values (fixed point)
+    bool     moving[CORE_MAX_CHANNELS];     // hysteresis state: true if the channel has recently moved
+    uint32_t lastMovement[CORE_MAX_CHANNELS];   // time of the channel's last movement (ms)
+    bool     settling[CORE_MAX_CHANNELS];   // true if update() has recently seen the channel move
+    uint32_t lastExcursion[CORE_MAX_CHANNELS];  // time of that movement (ms)
+
+    uint32_t channels;
+    float    noiseScale;
+    uint32_t hysteresis;
+    uint32_t holdMillis;
+
+  public:
+    uint32_t threshold[CORE_MAX_CHANNELS];  // the computed noise thresholds (ticks)
+
+    // Start sampling the channel noise: channels must be within pulseMin .. pulseMax
+    void begin (uint32_t channels, uint32_t pulseMin, uint32_t pulseMax,
+                float noiseScale, uint32_t hysteresis, uint32_t holdMillis);
+
+    void sample (const uint32_t frame[]);   // sample a frame for the initial noise thresholds
+    void finishSampling (void);             // compute the initial noise thresholds
+    void restore (const uint32_t thresholds[]);   // use previously computed noise thresholds instead
+    void update (const uint32_t frame[], uint32_t nowMillis);   // keep tracking the channel noise
+
+    // Returns true if a channel change exceeds its noise threshold, and then sets the frame
+    // as the new reference
+    bool changeDetected (const uint32_t frame[], uint32_t nowMillis);
+};
+
+uint32_t coreIsqrt (uint32_t value);
+
+
+// ----- Axis value conversion
+//
+// Integer arithmetic only, as this runs for every channel of every refresh. The conversion
+// constants are resolved at compile time when the AxisScale is a constant: with the Unity bug
+// workaround the pulse range maps onto 0..32767, otherwise onto -32767..32767.
+// The channel value is clamped to the pulse range first, so that the scaled value can
+// neither overflow nor roll over, as long as ticksRange * scale fits into 31 bits (up to
+// 16 ticks per microsecond with the default 1000 us pulse range).
+// The result is the exact conversion, truncated towards zero. The float conversion it replaced
+// differs from it by 1 LSB for a few channel values, where the float rounding error pushed the
+// product across an integer (see extras/axis_scale_test.cpp).
+
+struct AxisScale {
+  int32_t ticksMin, ticksMax, ticksRange, ticksZero;
+  int32_t scale, floor, ceiling;
+
+  constexpr AxisScale (uint32_t tickRate, uint32_t pulseCenter, uint32_t pulseDelta, bool unityBugWorkaround) :
+    ticksMin ((pulseCenter - pulseDelta) * tickRate),
+    ticksMax ((pulseCenter + pulseDelta) * tickRate),
+    ticksRange (2 * pulseDelta * tickRate),
+    ticksZero (unityBugWorkaround ? (pulseCenter - pulseDelta) * tickRate : pulseCenter * tickRate),
+    scale (unityBugWorkaround ? 32768 : 65536),
+    floor (unityBugWorkaround ? 0 : -32767),
+    ceiling (32767) { }
+
+  inline int16_t convert (uint32_t channelValue) const {
+    if (channelValue < (uint32_t) this->ticksMin)
+      channelValue = this->ticksMin;
+    else if (channelValue > (uint32_t) this->ticksMax)
+      channelValue = this->ticksMax;
+
+    int32_t axisValue = ((int32_t) channelValue - this->ticksZero) * this->scale / this->ticksRange;
+
+    // the pulse range ends map onto +/-32768, which are out of range
+    if (axisValue < this->floor)
+      axisValue = this->floor;
+    else if (axisValue > this->ceiling)
+      axisValue = this->ceiling;
+
+    return (int16_t) axisValue;
+  }
+};
+
+
+// ----- Input filter
+//
+// "One Euro" filter: a low-pass filter on every channel, whose cutoff frequency adapts to the
+// speed of the channel value. At rest the cutoff is low (minCutoff), removing jitter, and it
+// rises with the speed (beta), so that fast stick movements are not delayed. The speed is
+// itself low-pass filtered (speedCutoff), and allows extrapolating the filtered values by
+// predictMillis past the given time. The filter works on the channel values in microseconds.
+
+class InputFilter {
+
+  private:
+    float    value[CORE_MAX_CHANNELS];      // filtered channel values (us)
+    float    speed[CORE_MAX_CHANNELS];      // filtered channel speeds (us/s)
+    uint32_t timestamp;                     // reception time of the last filtered frame (us)
+    bool     started;
+
+  public:
+    uint32_t channels;
+    uint32_t tickRate;                      // channel value ticks per microsecond
+    float    minCutoff;                     // cutoff frequency at rest (Hz)
+    float    beta;                          // cutoff frequency increase per speed unit (Hz per us/s)
+    float    speedCutoff;                   // cutoff frequency of the speed estimate (Hz)
+    uint32_t predictMillis;                 // extrapolation past the given time (ms)
+
+    void begin (uint32_t channels, uint32_t tickRate, float minCutoff, float beta, float speedCutoff, uint32_t predictMillis);
+
+    // Update the filter with a new frame, received at the given time (us)
+    void update (const uint32_t frame[], uint32_t frameMicros);
+
+    // Replace the frame's channel values by the filtered values, extrapolated to the given
+    // time (us) plus predictMillis
+    void predict (uint32_t frame[], uint32_t nowMicros);
+};
+
+
+// ----- Channel calibration & expo curves
+//
+// The calibrated conversion of a channel value to an axis value is precomputed into a table
+// of CORE_CURVE_POINTS axis values, between which convert() interpolates linearly: two table
+// lookups and a multiplication per channel, whatever the calibration, deadband and expo.
+// The interpolation may differ from AxisScale by up to 2 LSBs, so uncalibrated channels should
+// keep using AxisScale.
+//
+// The calibrated endpoints map onto the axis ends and the calibrated center onto the axis
+// center. A deadband around the center maps onto the axis center, and the expo softens the
+// response around it: y = x * (1 - expo) + x^3 * expo, for x from -1 to 1.
+// The lower half of the table spans the range from the lower endpoint to the deadband, the
+// upper half the range from the deadband to the upper endpoint, so that the center and the
+// deadband are exact, whatever the channel's calibration.
+
+#define CORE_CURVE_POINTS 257
+#define CORE_CURVE_HALF   ((CORE_CURVE_POINTS - 1) / 2)
+
+struct ChannelCalibration {
+  uint32_t minimum, center, maximum;        // channel endpoints & center (ticks)
+};
+
+class AxisCurve {
+
+  private:
+    int16_t  table[CORE_CURVE_POINTS];      // axis values
+    uint32_t ticksMin, ticksMax;            // calibrated endpoints (ticks)
+    uint32_t deadLow, deadHigh;             // deadband around the center (ticks)
+    uint32_t scaleLow, scaleHigh;           // table points per tick below & above the deadband (20 fractional bits)
+
+  public:
+    // Build the table: deadband in ticks on either side of the center, expo in percent,
+    // axis range as with AxisScale
+    void begin (const ChannelCalibration *calibration, uint32_t deadband, uint32_t expo, bool unityBugWorkaround);
+
+    inline int16_t convert (uint32_t channelValue) const {
+      uint32_t position;
+
+      if (channelValue <= this->ticksMin)
+        return this->table[0];
+      if (channelValue >= this->ticksMax)
+        return this->table[CORE_CURVE_POINTS - 1];
+      if (channelValue < this->deadLow)
+        position = (channelValue - this->ticksMin) * this->scaleLow;
+      else if (channelValue <= this->deadHigh)
+        return this->table[CORE_CURVE_HALF];
+      else
+        position = (CORE_CURVE_HALF << 20) + (channelValue - this->deadHigh) * this->scaleHigh;
+
+      uint32_t index = position >> 20;
+      int32_t fraction = (position >> 8) & 0xFFF;
+      return this->table[index] + (((this->table[index + 1] - this->table[index]) * fraction) >> 12);
+    }
+};
+
+// Calibration pass: tracks the channel endpoints while the sticks, sliders and switches are
+// moved around, then derives the channel calibrations
+class ChannelCalibrator {
+
+  private:
+    uint32_t minimum[CORE_MAX_CHANNELS];
+    uint32_t maximum[CORE_MAX_CHANNELS];
+    uint32_t channels;
+
+  public:
+    void begin (uint32_t channels);
+    void sample (const uint32_t frame[]);
+
+    // Calibrate the channels that have moved by at least minRange, given their final values:
+    // a channel that ended up in the middle third of its range (a spring-centered stick) is
+    // centered there, the others (throttle, switches) in the middle of their range. The other
+    // channels keep their calibration. Returns the number of calibrated channels.
+    uint32_t finish (const uint32_t frame[], uint32_t minRange, ChannelCalibration calibration[]);
+};
+
+
+// ----- Adaptive refresh rate
+//
+// The refresh rate follows the stick speed: from minRate for slow movements up to the maximum
+// rate given by the caller (the manual or default refresh rate, which becomes a ceiling) at
+// fullSpeed. The stick speed is the fastest channel's movement beyond its noise threshold,
+// which rises immediately and decays over a few frames.
+//
+// Bluetooth congestion and failed notifications halve a backpressure ceiling (down to minRate),
+// which then recovers by recoveryRate Hz per second.
+
+class RefreshController {
+
+  private:
+    uint32_t previous[CORE_MAX_CHANNELS];   // channel values of the previous frame
+    uint32_t previousMicros;                // reception time of the previous frame (us)
+    uint32_t speed;                         // smoothed stick speed (ticks per second)
+    uint32_t backoff;                       // backpressure ceiling (Hz, 8 fractional bits), 0 if none
+    uint32_t lastRate;                      // refresh rate returned by the last rate() call (Hz)
+    uint32_t lastMillis;                    // time of the last rate() call (ms)
+    bool     started;
+
+  public:
+    uint32_t channels;
+    uint32_t minRate;                       // refresh rate of slow movements (Hz)
+    uint32_t fullSpeed;                     // stick speed selecting the maximum rate (ticks per second)
+    uint32_t recoveryRate;                  // backpressure ceiling recovery (Hz per second)
+
+    void begin (uint32_t channels, uint32_t minRate, uint32_t fullSpeed, uint32_t recoveryRate);
+
+    // Update the stick speed with a new frame, ignoring movements below the noise thresholds
+    void update (const uint32_t frame[], uint32_t frameMicros, const uint32_t thresholds[]);
+
+    // Notifications are queuing up or failing: back off
+    void congestion (uint32_t nowMillis);
+
+    // Returns the refresh rate to use, between minRate and maxRate
+    uint32_t rate (uint32_t maxRate, uint32_t nowMillis);
+};
+
+
+// ----- Notify pacing
+//
+// Notifications are only transmitted at the connection events, every connection interval. The
+// Bluetooth stacks don't report these events, so they are predicted from an anchor: the time
+// at which the connection, or its last parameter update, was reported. This is a heuristic:
+// the callback runs some time after the controller's connection event, and micros() drifts
+// against the controller's sleep clock (by up to a few hundred ppm), so that the predicted
+// events walk off the real ones. See extras/link_sim.cpp for the resulting latencies.
+
+// Microseconds from nowMicros until the next predicted connection event, 0 if the interval is unknown
+uint32_t coreMicrosToConnectionEvent (uint32_t nowMicros, uint32_t anchorMicros, uint32_t interval);
+
+// Milliseconds to hold a notification back, so that it is sent guardMicros before the next
+// predicted connection event (waitMicros away), 0 to send it right away
+uint32_t corePacingDelay (uint32_t waitMicros, uint32_t guardMicros);
+
+
+// ----- HID report map & report encoding
+//
+// The HID report map and the reports are generated from a description of the report layout:
+// every gamepad's report holds the button bits, followed by the axes packed with the given
+// bit width, and padded to a whole byte.
+//
+// The axes are mapped to the X, Y, Z, rX, rY and rZ usages, and in 12-axis reports to the
+// Slider, Dial, Wheel, vX, vY and vZ usages as well. Their logical range is symmetrical
+// (e.g. -127..127 for 8 bits), or positive only (0..127) with the Unity bug workaround.
+
+// Maximum HID report map size: 2 gamepads with 12 axes each
+#define CORE_MAX_REPORT_MAP 160
+
+struct HidLayout {
+  uint8_t gamepads;         // number of gamepads (report IDs 1 and 2)
+  uint8_t axes;             // axes per gamepad: up to 12
+  uint8_t bits;             // bits per axis: 2 to 16
+  uint8_t buttons;          // buttons per gamepad: up to 32
+  bool    positive;         // positive axis values only (Unity bug workaround)
+};
+
+// Build the HID report map, returns its length
+size_t coreBuildReportMap (uint8_t map[], const HidLayout *layout);
+
+// HID report length in bytes (without report ID)
+size_t coreReportLength (const HidLayout *layout);
+
+// Encode a gamepad HID report (without report ID): the button bits, followed by the axis
+// values (16-bit, see AxisScale) reduced to the layout's bit width. Returns the report length.
+size_t coreEncodeReport (uint8_t report[], const int16_t axes[], uint32_t buttons, const HidLayout *layout);
+
+#endif // GAMEPADCORE_H
@@ -3,36 +3,58 @@
 
    Performs BLE Gamepad HID initialization and sends gamepad refresh notifications
    when required, up to a user-defined refresh rate.
+
+   With REFRESH_ON_FRAME enabled, the task sleeps until the ChannelExtractor signals
+   the arrival of a new PPM frame, so that the notification is sent right away.
+   After each notification the task sleeps for one refresh period, which limits the
+   notification rate to the refresh rate.
 */
 
 
-// Convert channelValue (timer ticks) to gamepad axis value
+// Convert channelValue (timer ticks) to gamepad axis value, over the nominal pulse range
+// (with CHANNEL_CALIBRATION, the axes are converted by the per-channel tables of Calibration.ino)
+//
+// The conversion (see GamepadCore.h) uses integer arithmetic only, as this runs for every
+// channel of every refresh. As axisScale is a compile-time constant, so are its conversion
+// constants.
+
+static constexpr AxisScale axisScale (RMT_TICK_US, PPM_PULSE_CENTER, PPM_PULSE_DELTA, UNITY_BUG_WORKAROUND);
+
+static_assert ((int64_t) axisScale.ticksRange * axisScale.scale <= INT32_MAX,
+               "the axis value conversion overflows at this RMT tick rate");
+
+static_assert (AXIS_BITS >= 9 && AXIS_BITS <= 16, "AXIS_BITS must be within 9 to 16");
+
+#if POWER_SAVE && ! REFRESH_ON_FRAME
+ #error "POWER_SAVE requires REFRESH_ON_FRAME, as the GamepadRefresh task would keep polling"
+#endif
+
+
+// Gamepad buttons set by the switch channels (see SWITCH_BUTTON_CHANNELS)
+
+uint32_t _switchButtons (int16_t axes[]) {
+  uint32_t buttons = 0;
+  uint32_t button = 0;
+
+  for (uint32_t i = 0; i < axisCount; i++) {
+    if (! (SWITCH_BUTTON_CHANNELS & (1 << i)))
+      continue;
+    if (axes[i] > (UNITY_BUG_WORKAROUND ? AXIS_MAX / 2 : 0))
+      buttons |= 1 << button;
+    button++;
+  }
+  return buttons;
+}
 
 int16_t _channelValueToAxisValue (uint32_t channelValue) {
-    
-  // use floats during conversion to preserve precision
-  float axisValue = UNITY_BUG_WORKAROUND
-                  ? ((float) channelValue / RMT_TICK_US - (PPM_PULSE_CENTER - PPM_PULSE_DELTA))
-                    * ((float) AXIS_RESOLUTION / 2 / (2 * PPM_PULSE_DELTA))
-                  : ((float) channelValue / RMT_TICK_US - PPM_PULSE_CENTER)
-                    * ((float) AXIS_RESOLUTION / (2 * PPM_PULSE_DELTA));
-  
-  // perform boundary checks, as we don't want axis values to rollover/overflow
-  float axisMin = UNITY_BUG_WORKAROUND ? 0 : AXIS_MIN;
-   
-  if (axisValue < axisMin)
-    axisValue = axisMin;
-  else if (axisValue > AXIS_MAX)
-    axisValue = AXIS_MAX;
-
-  return (int16_t) axisValue;
+  return axisScale.convert (channelValue);
 }
 
 
 // Compute the gamepad refresh rate, which can be set dynamically via the refresh rate channel
 
-uint32_t _getRefreshRate() {
-  int16_t axisValue = abs(_channelValueToAxisValue (channelValues[REFRESH_RATE_CHANNEL -1]));
+uint32_t _getRefreshRate (uint32_t frame[]) {
+  int16_t axisValue = REFRESH_RATE_CHANNEL > 0 ? abs(_channelValueToAxisValue (frame[REFRESH_RATE_CHANNEL -1])) : 0;
   uint32_t refreshRate = REFRESH_RATE_CHANNEL > 0
     ? ( UNITY_BUG_WORKAROUND
       ? abs (axisValue - AXIS_MAX / 2) * 2 * REFRESH_RATE_MAX / AXIS_MAX
@@ -43,6 +65,84 @@ uint32_t _getRefreshRate() {
 }
 
 
+// Adapt the refresh rate to the stick speed and to the Bluetooth congestion (see GamepadCore.h).
+// The manual or default refresh rate is the ceiling, as well as the connection event rate:
+// faster notifications would only queue up.
+
+static RefreshController refreshController;
+
+uint32_t _adaptRefreshRate (uint32_t maxRate, uint32_t frame[], bool newFrame, uint32_t frameTimestamp) {
+  static uint32_t congestions = 0;
+  uint32_t now = millis();
+
+  if (newFrame) {
+    uint32_t thresholds[PPM_MAX_CHANNELS];
+    copyNoiseThresholds (thresholds);
+    refreshController.update (frame, frameTimestamp, thresholds);
+  }
+
+  // back off when notifications queue up or fail
+  uint32_t events = pipelineStats.congestions + pipelineStats.notifyErrors;
+  if (events != congestions) {
+    congestions = events;
+    refreshController.congestion (now);
+  }
+
+  uint32_t interval = gamepad.connectionInterval;
+  if (interval && maxRate > 1000000 / interval)
+    maxRate = 1000000 / interval;
+  return refreshController.rate (maxRate, now);
+}
+
+
+// Copy the most recent PPM frame to channels[] (see readFrame), its channel values in axis
+// order to frame[] and its reception time to *timestamp, applying the input filter to frame[]
+// if enabled. Returns true if the frame differs from *lastFrame, which is then updated.
+
+bool _takeFrame (uint32_t channels[], uint32_t frame[], uint32_t *timestamp, uint32_t *lastFrame) {
+  uint32_t frameChannels;
+  uint32_t frameNumber = readFrame (channels, &frameChannels, timestamp);
+  bool newFrame = frameNumber != *lastFrame;
+  *lastFrame = frameNumber;
+  frameAxes (channels, frame);
+
+#if INPUT_FILTER
+  // smooth the channel values, and extrapolate them to the notification time
+  if (newFrame)
+    filterFrame (frame, *timestamp);
+  predictFrame (frame, micros());
+#endif
+
+  return newFrame;
+}
+
+
+// Gamepad mode matching the refresh rate channel and axisCount: 7/8/15/16-bit single or dual gamepad
+// (frame[] holds the primary input's channels, see readFrame)
+
+uint32_t _gamepadMode (uint32_t frame[]) {
+  int16_t val = (! REFRESH_RATE_CHANNEL || REFRESH_RATE_CHANNEL > axisCount - PPM_AUX_AXES)
+              ? REFRESH_RATE_DEFAULT
+              : (UNITY_BUG_WORKAROUND ? _channelValueToAxisValue (frame[REFRESH_RATE_CHANNEL - 1]) * 2 - AXIS_MAX
+                                      : _channelValueToAxisValue (frame[REFRESH_RATE_CHANNEL - 1]));
+
+  return (val < 0 ? 0 : 1)                      // 8bit or 16bit axis values ?
+       + (axisCount > 6 ? 2 : 0)                // single or dual gamepad ?
+       + (UNITY_BUG_WORKAROUND ? 4 : 0)         // positive axis values only ?
+       + (DUAL_GAMEPAD_COMPOSITE ? COMPOSITE : 0);    // 12 axes in a single gamepad ?
+}
+
+
+// Start the GamepadRefresh task: once the initial noise thresholds are known, or right
+// away with a startup profile
+
+void startGamepadRefreshTask() {
+  gamepadRefreshTaskHandle = xTaskCreateStaticPinnedToCore (gamepadRefreshTask, "gamepadRefreshTask", GAMEPAD_REFRESH_STACK,
+                                                             NULL, GAMEPAD_REFRESH_PRIORITY, gamepadRefreshStack,
+                                                             &gamepadRefreshTcb, GAMEPAD_REFRESH_CORE);
+}
+
+
 void gamepadRefreshTask (void *pvParameter) {
 
   // Begin advertising as a single 7/8/15/16-bit single or dual gamepad, depending
@@ -56,51 +156,158 @@ void gamepadRefreshTask (void *pvParameter) {
     DEBUG_PRINTLN (REFRESH_RATE_DEFAULT);
   }
  
-  int16_t val = (! REFRESH_RATE_CHANNEL || REFRESH_RATE_CHANNEL > axisCount)
-              ? REFRESH_RATE_DEFAULT
-              : (UNITY_BUG_WORKAROUND ? _channelValueToAxisValue (channelValues[REFRESH_RATE_CHANNEL - 1]) * 2 - AXIS_MAX
-                                      : _channelValueToAxisValue (channelValues[REFRESH_RATE_CHANNEL - 1]));
-     
-  DEBUG_PRINT ( val < 0 ? "   Negative refresh rate --> 8-bit gamepad (compatibility mode) @ "
-                        : "   Positive refresh rate --> 16-bit gamepad @ ");   
-  DEBUG_PRINT (_getRefreshRate()); DEBUG_PRINTLN (" Hz");
+  // the primary input's channels (for the refresh rate channel), and the axes' channel values
+  uint32_t channels[FRAME_VALUES];
+  uint32_t frame[PPM_MAX_CHANNELS];
+  uint32_t frameChannels;
+  readFrame (channels, &frameChannels, NULL);
+
+  // with a startup profile, the PPM signal may not be there yet: its mode is checked later
+  uint32_t mode = profileAxisCount ? profileMode : _gamepadMode (channels);
+  bool modeChecked = ! profileAxisCount;
+  if (! profileAxisCount) {
+    uint32_t thresholds[PPM_MAX_CHANNELS];
+    copyNoiseThresholds (thresholds);
+    saveProfile (mode, thresholds);
+  }
+
+  DEBUG_PRINT ( mode & 1 ? "   Positive refresh rate --> 16-bit gamepad @ "
+                         : "   Negative refresh rate --> 8-bit gamepad (compatibility mode) @ ");
+  DEBUG_PRINT (_getRefreshRate (channels)); DEBUG_PRINTLN (" Hz");
   
   gamepadInitialized = true;
   DEBUG_PRINTLN ("   Waiting for Bluetooth connection...");
   DEBUG_PRINTLN (" ");
 
-  gamepad.begin (
-    (val < 0 ? 0 : 1)                  // 8bit or 16bit axis values ?
-    + (axisCount > 6 ? 2 : 0)          // single or dual gamepad ?
-    + (UNITY_BUG_WORKAROUND ? 4 : 0)   // positive axis values only ?
-  );
+  gamepad.flushTask = xTaskGetCurrentTaskHandle();   // woken up when the Bluetooth congestion ends, and on (dis)connection
+  gamepad.begin (mode);
+  refreshController.begin (axisCount, ADAPTIVE_RATE_MIN, ADAPTIVE_FULL_SPEED * RMT_TICK_US, ADAPTIVE_RATE_RECOVERY);
 
-  // endless loop running at the user-defined Gamepad refresh rate
-  uint32_t lastRefresh = 0;
+  // endless loop running at the user-defined Gamepad refresh rate. The inactivity refresh is
+  // due at keepAliveDue, which stays at the time of the wake-up until a report can be sent.
+  uint32_t keepAliveDue = 0;
+  uint32_t lastFrame = 0;
+  uint32_t frameTimestamp;
   while (gamepadInitialized) {
-    
+
+#if REFRESH_ON_FRAME
+    // Wait for the next PPM frame. The timeout ensures that the inactivity refresh
+    // still takes place when the PPM signal is lost. In power save mode, the timeout
+    // is the time left until the inactivity refresh is due, and the task sleeps until
+    // it is notified while there is no Bluetooth connection or PPM signal yet.
+    TickType_t timeout = pdMS_TO_TICKS (PPM_MAX_FRAMESIZE / 1000);
+#if POWER_SAVE
+    int32_t due = keepAliveDue - pdTICKS_TO_MS (xTaskGetTickCount());
+    timeout = ! gamepad.connected || ! channelsAvailable ? portMAX_DELAY
+            : pdMS_TO_TICKS (due > 0 ? due : 0);
+#endif
+    pipelineStats.taskSleep (TASK_GAMEPAD_REFRESH);
+    ulTaskNotifyTake (pdTRUE, timeout);
+    pipelineStats.taskWake (TASK_GAMEPAD_REFRESH);
+#endif
+
+    // send the reports held back by a Bluetooth congestion
+    gamepad.flush();
+
+    // take a consistent copy of the most recent PPM frame
+    bool newFrame = _takeFrame (channels, frame, &frameTimestamp, &lastFrame);
+
+    // without a connection or a signal, the inactivity refresh is due as soon as they are there
+    uint32_t now = pdTICKS_TO_MS (xTaskGetTickCount());
+    if (! gamepad.connected || ! channelsAvailable)
+      keepAliveDue = now;
+
+    // with a startup profile, Bluetooth is up before the PPM signal: wait for it, and
+    // check that it selects the profile's gamepad mode
+    if (! channelsAvailable) {
+      if (! POWER_SAVE)               // ...which notifies this task in power save mode
+        pipelineStats.taskDelay (TASK_GAMEPAD_REFRESH, 10);
+      continue;
+    }
+    if (! modeChecked) {
+      modeChecked = true;
+      if (_gamepadMode (channels) != mode)
+        discardProfile();
+    }
+
+#if CHANNEL_CALIBRATION
+    // rebuild the conversion tables after a calibration pass, and send the recalibrated axes
+    bool recalibrated = calibrationChanged;
+    if (recalibrated) {
+      calibrationChanged = false;
+      buildAxisCurves();
+    }
+#else
+    bool recalibrated = false;
+#endif
+
     // Compute refresh rate, as the user may change it dynamically via the refresh rate channel
-    uint32_t refreshRate = _getRefreshRate();
-    uint32_t now = xTaskGetTickCount() / portTICK_PERIOD_MS;
+    uint32_t refreshRate = _getRefreshRate (channels);
+#if ADAPTIVE_REFRESH
+    refreshRate = _adaptRefreshRate (refreshRate, frame, newFrame, frameTimestamp);
+#endif
+    pipelineStats.refreshRate = refreshRate;
+
+    bool keepAlive = (int32_t) (now - keepAliveDue) >= 0 || recalibrated;
+
+    // check a new PPM frame for user activity, only once
+    bool changed = false;
+    if (gamepad.connected && newFrame) {
+      uint32_t start = PipelineStats::cycles();
+      changed = changeDetected (frame);
+      pipelineStats.addCycles (STAGE_CHANGE, PipelineStats::cycles() - start);
+
+      if (! changed)
+        pipelineStats.reportsSuppressed++;
+    }
 
     if ( gamepad.connected                                            // BLE connection established ?
-          && (changeDetected()                                           // and user activity detected ?
-             || (now - lastRefresh) > REFRESH_INACTIVITY_MILLIS) ) {     // or last refresh older than REFRESH_INACTIVITY_MILLIS ?
+          && (changed                                                    // and user activity detected ?
+             || keepAlive) ) {                                           // or last refresh older than REFRESH_INACTIVITY_MILLIS ?
+
+#if NOTIFY_PACING
+      // hold the notification back until shortly before the next predicted connection event,
+      // then send the newest PPM frame. The prediction is a heuristic, see GamepadCore.h
+      uint32_t holdMillis = corePacingDelay (gamepad.microsToNextConnectionEvent(), NOTIFY_PACING_GUARD_MICROS);
+      if (holdMillis) {
+        pipelineStats.taskDelay (TASK_GAMEPAD_REFRESH, holdMillis);
+        if (_takeFrame (channels, frame, &frameTimestamp, &lastFrame))
+          changeDetected (frame);     // ...to update the reference values
+      }
+#endif
 
       // convert timer ticks to gamepad axis values
+      uint32_t start = PipelineStats::cycles();
       for (int i = 0; i < axisCount; i++) {
-        axisValues[i] = _channelValueToAxisValue (channelValues[i]);
-        // DEBUG_PRINT (channelValues[i]); DEBUG_PRINT ("/");
+#if CHANNEL_CALIBRATION
+        axisValues[i] = axisCurved[i] ? axisCurves[i].convert (frame[i]) : _channelValueToAxisValue (frame[i]);
+#else
+        axisValues[i] = _channelValueToAxisValue (frame[i]);
+#endif
+        // DEBUG_PRINT (frame[i]); DEBUG_PRINT ("/");
         DEBUG_PRINT (gamepad.compatibilityMode ? (axisValues[i] >> 8) : axisValues[i]); DEBUG_PRINT (" ");
       }
+      pipelineStats.addCycles (STAGE_CONVERT, PipelineStats::cycles() - start);
       DEBUG_PRINT ("/ "); DEBUG_PRINT (refreshRate); DEBUG_PRINTLN (" Hz");
                  
-      // send BLE HID notification and reset the lastRefresh timestamp
-      gamepad.setAxes (axisValues);
-      lastRefresh = now;
+      // send BLE HID notifications for the changed gamepad reports (or all of them on
+      // inactivity) and postpone the inactivity refresh
+      gamepad.setAxes (axisValues, keepAlive, _switchButtons (axisValues));
+      keepAliveDue = now + REFRESH_INACTIVITY_MILLIS + 1;
+
+      if (changed)
+        pipelineStats.addMicros (STAGE_END_TO_END, micros() - frameTimestamp);
+
+#if REFRESH_ON_FRAME
+      // the refresh rate is an upper bound: frames arriving in the meantime are
+      // picked up by the next ulTaskNotifyTake call
+      pipelineStats.taskDelay (TASK_GAMEPAD_REFRESH, 1000 / refreshRate);
+#endif
     }
-    
-    vTaskDelay ((1000 / refreshRate) / portTICK_PERIOD_MS);
+
+#if ! REFRESH_ON_FRAME
+    pipelineStats.taskDelay (TASK_GAMEPAD_REFRESH, 1000 / refreshRate);
+#endif
   }
   
   Serial.println ("gamepadRefreshTask exiting : gamepadInitialized is false");
@@ -0,0 +1,40 @@
+/*
+   --------- InputFilter
+
+   Optional "One Euro" filter, applied to every channel before its conversion to a gamepad
+   axis value (see INPUT_FILTER, and InputFilter in GamepadCore.h).
+
+   The One Euro filter is a low-pass filter whose cutoff frequency adapts to the speed of
+   the channel value: at rest the cutoff is low (FILTER_MIN_CUTOFF), removing jitter, and
+   it rises with the speed (FILTER_BETA), so that fast stick movements are not delayed.
+
+   As a by-product, the filter tracks the speed of every channel. This allows extrapolating
+   the filtered values by FILTER_PREDICT_MILLIS milliseconds past the notification time, in
+   order to compensate the delay of the PPM frame and the Bluetooth transmission.
+
+   The filter runs in the GamepadRefresh task. The extras/filter_eval.cpp tool evaluates the
+   filter parameters on recorded PPM captures.
+*/
+
+static InputFilter _inputFilter;
+static bool _filterStarted = false;
+
+
+// Update the filter with a new PPM frame, received at the given time (us)
+
+void filterFrame (uint32_t frame[], uint32_t timestamp) {
+  if (! _filterStarted) {
+    _inputFilter.begin (axisCount, RMT_TICK_US, FILTER_MIN_CUTOFF, FILTER_BETA, FILTER_SPEED_CUTOFF, FILTER_PREDICT_MILLIS);
+    _filterStarted = true;
+  }
+  _inputFilter.update (frame, timestamp);
+}
+
+
+// Replace the frame's channel values by the filtered values, extrapolated to the given
+// time (us) plus FILTER_PREDICT_MILLIS
+
+void predictFrame (uint32_t frame[], uint32_t now) {
+  if (_filterStarted)
+    _inputFilter.predict (frame, now);
+}
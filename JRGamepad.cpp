@@ -1,15 +1,9 @@
-#include <BLEDevice.h>
-#include <BLEUtils.h>
-#include <BLEServer.h>
-#include "BLE2902.h"
-#include "BLEHIDDevice.h"
-#include "HIDTypes.h"
-#include "HIDKeyboardTypes.h"
-#include <driver/adc.h>
 #include "sdkconfig.h"
 
 #include "Arduino.h"
 #include "JRGamepad.h"
+#include "PipelineStats.h"
+#include "GamepadCore.h"
 
 static const char _gamepadName [][16] =
 {
@@ -23,6 +17,14 @@ static const char _gamepadName [][16] =
   "JR Gamepad 2x15"
 };
 
+static const char _compositeGamepadName [][17] =
+{
+  "JR Gamepad 12x8",    // Single gamepad with 12 axes in a single HID report, see COMPOSITE
+  "JR Gamepad 12x16",
+  "JR Gamepad 12x7",
+  "JR Gamepad 12x15"
+};
+
 
 // HID reports:
 //
@@ -33,544 +35,219 @@ static const char _gamepadName [][16] =
 //  - The last 2 channels are mapped to the rX and rY axes, which are typically used for the left
 //    and right analog triggers
 //
-// The "dual" modes with more than 6 channels are mapped as two gamepads in a composite HID report.
-
-static const uint8_t _single8bitHIDreport[] = {
-
-  USAGE_PAGE(1),                0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),                     0x05, // USAGE (Gamepad)
-  COLLECTION(1),                0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x 8-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  LOGICAL_MINIMUM(1),  0x81, //     LOGICAL_MINIMUM (-127)
-  LOGICAL_MAXIMUM(1),  0x7F, //     LOGICAL_MAXIMUM (127)
-  REPORT_SIZE(1),      0x08, //     REPORT_SIZE (8)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-  END_COLLECTION(0)              // END_COLLECTION (Application)
-};
+// The "dual" modes with more than 6 channels are mapped as two gamepads in a composite HID report,
+// unless the COMPOSITE flag is set, which maps all 12 channels to a single gamepad. The 6 additional
+// axes are then mapped to the Slider, Dial, Wheel, vX, vY and vZ usages, which are not supported by
+// every gamepad driver (DirectInput under Windows only supports 8 axes)
+//
+// The HID report map is generated from the report layout by coreBuildReportMap (see GamepadCore.h)
 
-static const uint8_t _single16bitHIDreport[] = {
-
-  USAGE_PAGE(1),       0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x16-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  0x16,                0x01, 0x80,  // LOGICAL_MINIMUM (-32767)
-  0x26,                0xFF, 0x7F,  // LOGICAL_MAXIMUM (32767)
-  REPORT_SIZE(1),      0x10, //     REPORT_SIZE (16)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-
-  END_COLLECTION(0)          //     END_COLLECTION
-};
+static uint8_t _reportMap [CORE_MAX_REPORT_MAP];
 
-static const uint8_t _dual8bitHIDreport[] = {
-  USAGE_PAGE(1),       0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1 / 2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x 8-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  LOGICAL_MINIMUM(1),  0x81, //     LOGICAL_MINIMUM (-127)
-  LOGICAL_MAXIMUM(1),  0x7F, //     LOGICAL_MAXIMUM (127)
-  REPORT_SIZE(1),      0x08, //     REPORT_SIZE (8)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-  END_COLLECTION(0),         //     END_COLLECTION
-
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x02, //     Gamepad 2 / 2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x 8-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  LOGICAL_MINIMUM(1),  0x81, //     LOGICAL_MINIMUM (-127)
-  LOGICAL_MAXIMUM(1),  0x7F, //     LOGICAL_MAXIMUM (127)
-  REPORT_SIZE(1),      0x08, //     REPORT_SIZE (8)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-  END_COLLECTION(0)          //     END_COLLECTION
-};
 
-static const uint8_t _dual16bitHIDreport[] = {
-
-  USAGE_PAGE(1),       0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1/2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x16-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  0x16,                0x01, 0x80,  // LOGICAL_MINIMUM (-32767)
-  0x26,                0xFF, 0x7F,  // LOGICAL_MAXIMUM (32767)
-  REPORT_SIZE(1),      0x10, //     REPORT_SIZE (16)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-
-  END_COLLECTION(0),         //     END_COLLECTION
-
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x02, //     Gamepad 2/2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x16-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  0x16,                0x01, 0x80,  // LOGICAL_MINIMUM (-32767)
-  0x26,                0xFF, 0x7F,  // LOGICAL_MAXIMUM (32767)
-  REPORT_SIZE(1),      0x10, //     REPORT_SIZE (16)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-
-  END_COLLECTION(0)          //     END_COLLECTION
-};
+// Constructor
 
+JRGamepad::JRGamepad (const char* deviceName, const char* deviceManufacturer, uint8_t batteryLevel) :
+  transport(jrGamepadTransport()), started(false), stackMode(-1), freeHeap(0)
+{
+  this->connected = false;
+  this->diagnostics = false;
+  this->connectionIntervalRequest = 7500;
+  this->axisBits = 16;
+  this->connectionInterval = 0;
+  this->connectionAnchor = 0;
+  this->congested = false;
+  this->flushTask = NULL;
+  this->beginMicros = 0;
+  this->beginHeap = 0;
+  this->endHeap = 0;
+  this->deviceName = deviceName;
+  this->deviceManufacturer = deviceManufacturer;
+  this->batteryLevel = batteryLevel;
+}
 
-// Unity under Windows bug workaround: same HID reports as above, but with positive axis values only...
-
-static const uint8_t _single7bitHIDreport[] = {
-
-  USAGE_PAGE(1),                0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),                     0x05, // USAGE (Gamepad)
-  COLLECTION(1),                0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x 8-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x7F, //     LOGICAL_MAXIMUM (127)
-  REPORT_SIZE(1),      0x08, //     REPORT_SIZE (8)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-  END_COLLECTION(0)              // END_COLLECTION (Application)
-};
 
-static const uint8_t _single15bitHIDreport[] = {
-
-  USAGE_PAGE(1),       0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x16-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  0x16,                0x00, 0x00,  // LOGICAL_MINIMUM (0)
-  0x26,                0xFF, 0x7F,  // LOGICAL_MAXIMUM (32767)
-  REPORT_SIZE(1),      0x10, //     REPORT_SIZE (16)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-
-  END_COLLECTION(0)          //     END_COLLECTION
-};
+// Begin Bluetooth advertising. Returns false if the transport keeps its stack (see
+// JRGamepadTransport::keepsStack), and was started in another gamepad mode.
 
-static const uint8_t _dual7bitHIDreport[] = {
-  USAGE_PAGE(1),       0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1 / 2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x 8-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x7F, //     LOGICAL_MAXIMUM (127)
-  REPORT_SIZE(1),      0x08, //     REPORT_SIZE (8)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-  END_COLLECTION(0),         //     END_COLLECTION
-
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x02, //     Gamepad 2 / 2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x 8-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x7F, //     LOGICAL_MAXIMUM (127)
-  REPORT_SIZE(1),      0x08, //     REPORT_SIZE (8)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-  END_COLLECTION(0)          //     END_COLLECTION
-};
+bool JRGamepad::begin (uint8_t gamepadMode)
+{
+  if (this->stackMode >= 0 && gamepadMode != this->stackMode && this->transport->keepsStack())
+    return false;
+
+  if (this->started)                    // already started in another mode ?
+    this->end();
+
+  this->composite           = (gamepadMode & COMPOSITE) && (gamepadMode & DUAL_8BIT);
+  this->gamepadMode         = gamepadMode & ~COMPOSITE;
+  this->gamepads            = (this->gamepadMode & DUAL_8BIT) && ! this->composite ? 2 : 1;
+  this->compatibilityMode   = ! (this->gamepadMode & 0x01);
+  this->unityBugWorkaround  = this->gamepadMode > 3;
+  this->deviceName          = this->composite
+                            ? _compositeGamepadName[(this->gamepadMode & 0x01) | (this->gamepadMode & SINGLE_7BIT) >> 1]
+                            : _gamepadName[this->gamepadMode];
+
+  // HID report layout: 8 buttons, followed by 6 axes (or 16 buttons and 12 axes in composite
+  // mode, which carries both gamepads' buttons) with 8 bits, or axisBits bits in the
+  // high-resolution modes
+  this->layout.gamepads     = this->gamepads;
+  this->layout.axes         = this->composite ? 12 : 6;
+  this->layout.bits         = this->compatibilityMode ? 8 : this->axisBits;
+  this->layout.buttons      = this->composite ? 16 : 8;
+  this->layout.positive     = this->unityBugWorkaround;
+  this->reportLength        = coreReportLength (&this->layout);
+  this->reportSent[0]       = this->reportSent[1] = false;
+  this->reportPending[0]    = this->reportPending[1] = false;
+
+
+  // Initialize the Bluetooth stack with the matching HID report map, and start advertising
+  this->freeHeap = ESP.getFreeHeap();
+  uint32_t start = micros();
+  this->transport->begin (this, _reportMap, coreBuildReportMap (_reportMap, &this->layout));
+  this->beginMicros = micros() - start;
+  this->beginHeap = this->freeHeap - ESP.getFreeHeap();
+  this->stackMode = gamepadMode;
+  this->started = true;
+  this->updateDiagnostics();
+  return true;
+}
 
-static const uint8_t _dual15bitHIDreport[] = {
-
-  USAGE_PAGE(1),       0x01, // USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x01, //     Gamepad 1/2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x16-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  0x16,                0x00, 0x00,  // LOGICAL_MINIMUM (0)
-  0x26,                0xFF, 0x7F,  // LOGICAL_MAXIMUM (32767)
-  REPORT_SIZE(1),      0x10, //     REPORT_SIZE (16)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-
-  END_COLLECTION(0),         //     END_COLLECTION
-
-  USAGE(1),            0x05, // USAGE (Gamepad)
-  COLLECTION(1),       0x01, // COLLECTION (Application)
-
-  REPORT_ID(1),        0x02, //     Gamepad 2/2
-
-  // ------------------------------------------------- Buttons 1 to 8 - unused, but necessary
-  USAGE_PAGE(1),       0x09, //     USAGE_PAGE (Button)
-  USAGE_MINIMUM(1),    0x01, //     USAGE_MINIMUM (Button 1)
-  USAGE_MAXIMUM(1),    0x08, //     USAGE_MAXIMUM (Button 8)
-  LOGICAL_MINIMUM(1),  0x00, //     LOGICAL_MINIMUM (0)
-  LOGICAL_MAXIMUM(1),  0x01, //     LOGICAL_MAXIMUM (1)
-  REPORT_SIZE(1),      0x01, //     REPORT_SIZE (1)
-  REPORT_COUNT(1),     0x08, //     REPORT_COUNT (8)
-  HIDINPUT(1),         0x02, //     INPUT (Data, Variable, Absolute)
-
-  // ------------------------------------------------- 6x16-bit resolution gamepad axes
-  USAGE_PAGE(1),       0x01, //     USAGE_PAGE (Generic Desktop)
-  USAGE(1),            0x30, //     USAGE (X)
-  USAGE(1),            0x31, //     USAGE (Y)
-  USAGE(1),            0x32, //     USAGE (Z)
-  USAGE(1),            0x33, //     USAGE (rX)
-  USAGE(1),            0x34, //     USAGE (rY)
-  USAGE(1),            0x35, //     USAGE (rZ)
-  0x16,                0x00, 0x00,  // LOGICAL_MINIMUM (0)
-  0x26,                0xFF, 0x7F,  // LOGICAL_MAXIMUM (32767)
-  REPORT_SIZE(1),      0x10, //     REPORT_SIZE (16)
-  REPORT_COUNT(1),     0x06, //     REPORT_COUNT (6)
-  HIDINPUT(1),         0x02, //     INPUT (Data,Var,Abs)
-
-  END_COLLECTION(0)          //     END_COLLECTION
-};
 
+// End Bluetooth advertising, and release the Bluetooth stack's resources, so that begin()
+// can be called again with another gamepad mode (unless the transport keeps its stack, as
+// Bluedroid does: begin() then resumes in the same gamepad mode)
 
-// BLEDevice server callbacks for handling Bluetooth connection / disconnection
+void JRGamepad::end(void)
+{
+  if (! this->started)
+    return;
+
+  this->transport->end();
+  this->endHeap = this->freeHeap - ESP.getFreeHeap();
+  this->started = false;
 
-class MyCallbacks : public BLEServerCallbacks {
-  public :
+  this->connected = false;
+  this->connectionInterval = 0;
+  this->congested = false;
+}
 
-    JRGamepad* JRGamepadInstance;
 
-    MyCallbacks (JRGamepad* o_JRGamepad) {
-      this->JRGamepadInstance = o_JRGamepad;
-    };
+// Set gamepad axis values and buttons
+//
+// Note: The axes array must be sized to hold 12 channels. Unused channels
+// have to be set to zero before passing the array as parameter.
+// Buttons 1 to 8 of the first gamepad are set by bits 0 to 7 of buttons, those of the
+// second gamepad by bits 8 to 15.
+//
+// Only the gamepads whose HID report bytes have changed since the last notification are
+// notified, unless force is true (which is used to keep the connection alive).
+//
+// The reports are queued, and sent by flush(): the queue holds only the newest report of each
+// gamepad, so that a report not sent yet (while the Bluetooth stack is congested) is replaced
+// by the newer one, instead of piling up in the Bluetooth stack's buffers.
 
-    void onConnect (BLEServer* pServer) {
-      this->JRGamepadInstance->connected = true;
+void JRGamepad::setAxes (int16_t axes[], bool force, uint32_t buttons)
+{
+  if (! this->connected)
+    return;
 
-      for (uint32_t g = 0; g < this->JRGamepadInstance->gamepads; g++) {
-        BLE2902* desc = (BLE2902*)this->JRGamepadInstance->inputGamepad[g]->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
-        desc->setNotifications(true);
-      }
+  uint8_t report[JRGAMEPAD_MAX_REPORT];
+  
+  for (uint32_t g = 0; g < this->gamepads; g++) {
+    // 8 buttons, followed by 6 axes (or 16 buttons and 12 axes in composite mode)
+    coreEncodeReport (report, &axes[g * 6], buttons >> (g * 8), &this->layout);
+
+    // skip the notification if this gamepad's report is unchanged
+    const uint8_t *latest = this->reportPending[g] ? this->pending[g] : this->reports[g];
+    if (! force && (this->reportPending[g] || this->reportSent[g]) && memcmp (report, latest, this->reportLength) == 0) {
+      pipelineStats.reportsUnchanged++;
+      continue;
     }
 
-    void onDisconnect (BLEServer* pServer) {
-      this->JRGamepadInstance->connected = false;
+    // replace a stale report that hasn't been sent yet
+    if (this->reportPending[g])
+      pipelineStats.reportsStale++;
+    memcpy (this->pending[g], report, this->reportLength);
+    this->reportPending[g] = true;
+  }
 
-      for (int g = 0; g < this->JRGamepadInstance->gamepads; g++) {
-        BLE2902* desc = (BLE2902*)this->JRGamepadInstance->inputGamepad[g]->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
-        desc->setNotifications(false);
-      }
-    }
-};
+  this->flush();
+}
 
 
-// Constructor
+// Notify the queued HID reports, unless the Bluetooth stack is congested
 
-JRGamepad::JRGamepad (std::string deviceName, std::string deviceManufacturer, uint8_t batteryLevel) : hid(0)
+void JRGamepad::flush (void)
 {
-  this->connected = false;
-  this->deviceName = deviceName;
-  this->deviceManufacturer = deviceManufacturer;
-  this->batteryLevel = batteryLevel;
+  if (! this->connected) {
+    this->reportPending[0] = this->reportPending[1] = false;
+    return;
+  }
+
+  for (uint32_t g = 0; g < this->gamepads && ! this->congested; g++) {
+    if (! this->reportPending[g])
+      continue;
+
+    uint32_t start = PipelineStats::cycles();
+    bool sent = this->transport->notify (g, this->pending[g], this->reportLength);
+    pipelineStats.addCycles (STAGE_NOTIFY, PipelineStats::cycles() - start);
+    if (! sent)                         // congested: the report stays queued
+      break;
+
+    memcpy (this->reports[g], this->pending[g], this->reportLength);
+    this->reportPending[g] = false;
+    this->reportSent[g] = true;
+    pipelineStats.reportsSent++;
+    if (! pipelineStats.firstNotifyMicros)
+      pipelineStats.firstNotifyMicros = micros();
+  }
+  pipelineStats.queueDepth = this->queueDepth();
 }
 
 
-// Begin Bluetooth advertising
+// Number of queued HID reports (0 to 2)
 
-void JRGamepad::begin (uint8_t gamepadMode)
+uint32_t JRGamepad::queueDepth (void)
 {
-  this->gamepadMode         = gamepadMode;
-  this->gamepads            = (gamepadMode >> 1) > 1 ? 2 : 1;
-  this->compatibilityMode   = ! (gamepadMode & 0x01);
-  this->unityBugWorkaround  = gamepadMode > 3;
-  this->deviceName          = _gamepadName[gamepadMode];
+  return this->reportPending[0] + this->reportPending[1];
+}
 
 
-  // Initialize BLEDevice with a matching HID report, and start advertising
-  
-  //Serial.println (micros());
-  BLEDevice::init (this->deviceName);   // ...interferes with RMT, causing the error: "RMT[0] ERR / status: 0x04000000"
-  //Serial.println (micros());
-  
-  BLEServer *pServer = BLEDevice::createServer();
-  pServer->setCallbacks (new MyCallbacks(this));
-
-  this->hid = new BLEHIDDevice (pServer);
-  for (uint32_t g = 0; g < this->gamepads; g++)
-    this->inputGamepad[g] = this->hid->inputReport(g + 1); // REPORT ID from report map
-    
-  this->hid->manufacturer()->setValue (this->deviceManufacturer);
-
-  this->hid->pnp(0x01, 0x02e5, 0xabcd, 0x0110);
-  this->hid->hidInfo(0x00, 0x01);
-
-  BLESecurity *pSecurity = new BLESecurity();
-  pSecurity->setAuthenticationMode(ESP_LE_AUTH_BOND);
-
-  // select the HID report matching the gamepad mode
-  if (this->gamepadMode == SINGLE_8BIT)
-    this->hid->reportMap ((uint8_t*) _single8bitHIDreport, sizeof (_single8bitHIDreport));
-  else if (this->gamepadMode == SINGLE_16BIT)
-    this->hid->reportMap ((uint8_t*) _single16bitHIDreport, sizeof (_single16bitHIDreport));
-  else if (this->gamepadMode == DUAL_8BIT)
-    this->hid->reportMap ((uint8_t*) _dual8bitHIDreport, sizeof (_dual8bitHIDreport));
-  else if (this->gamepadMode == DUAL_16BIT)
-    this->hid->reportMap ((uint8_t*) _dual16bitHIDreport, sizeof (_dual16bitHIDreport));
-  else if (this->gamepadMode == SINGLE_7BIT)
-    this->hid->reportMap ((uint8_t*) _single7bitHIDreport, sizeof (_single7bitHIDreport));
-  else if (this->gamepadMode == SINGLE_15BIT)
-    this->hid->reportMap ((uint8_t*) _single15bitHIDreport, sizeof (_single15bitHIDreport));
-  else if (this->gamepadMode == DUAL_7BIT)
-    this->hid->reportMap ((uint8_t*) _dual7bitHIDreport, sizeof (_dual7bitHIDreport));
-  else if (this->gamepadMode == DUAL_15BIT)
-    this->hid->reportMap ((uint8_t*) _dual15bitHIDreport, sizeof (_dual15bitHIDreport));
-    
-  this->hid->startServices();
-
-  BLEAdvertising *pAdvertising = pServer->getAdvertising();
-  pAdvertising->setAppearance (HID_GAMEPAD);
-  pAdvertising->addServiceUUID (this->hid->hidService()->getUUID());
-  pAdvertising->start();
-  this->hid->setBatteryLevel (this->batteryLevel);
+// Microseconds until the next predicted connection event, or 0 if the connection interval is unknown
+// (see the notify pacing in GamepadCore.h)
+
+uint32_t JRGamepad::microsToNextConnectionEvent (void)
+{
+  return coreMicrosToConnectionEvent (micros(), this->connectionAnchor, this->connectionInterval);
 }
 
 
-// End Bluetooth advertising / unimplemented ...never reached
-void JRGamepad::end(void)
+// Update the diagnostics characteristic with the current pipeline statistics
+
+void JRGamepad::updateDiagnostics (void)
 {
+  if (! this->started || ! this->diagnostics)
+    return;
+
+  uint8_t stats[PIPELINE_STATS_SIZE];
+  this->transport->setDiagnostics (stats, pipelineStats.serialize (stats));
 }
 
 
-// Set gamepad axis values
-//
-// Note: The axes array must be sized to hold 12 channels. Unused channels
-// have to be set to zero before passing the array as parameter.
+// Name of the Bluetooth LE stack
 
-void JRGamepad::setAxes (int16_t axes[])
+const char* JRGamepad::transportName (void)
 {
-  if (! this->connected)
-    return;
+  return this->transport->name();
+}
 
-  uint8_t report[13];
-  int16_t val;
-  
-  for (uint32_t g = 0; g < this->gamepads; g++) {
-    uint32_t i = 0;
-    report[i++] = 0;                        // 8 buttons (1 byte)
-    for (uint32_t a = 0; a < 6; a++) {      // 6 axes
-      if (this->compatibilityMode) {
-        val = axes[g * 6 + a] >> 8;
-        report[i++] = (val);                // 1 byte for each 8-bit axis (high byte of 16-bit axis value)
-      }
-      else {
-        val = axes[g * 6 + a];
-        report[i++] = val;                  // 2 bytes for each 16-bit axis
-        report[i++] = (val >> 8);
-      }
-    }
-    this->inputGamepad[g]->setValue (report, this->compatibilityMode ? 7 : 13);
-    this->inputGamepad[g]->notify();
-  }
+
+// ATT MTU required by the HID reports, or 0 if the default MTU (20-byte notifications) will do:
+// the 16-bit composite report does not fit. HID over GATT notifies a report without its report
+// ID, which is given by the characteristic's report reference instead.
+
+uint32_t JRGamepad::mtu (void)
+{
+  uint32_t mtu = this->reportLength + 3;        // ATT header
+  return mtu > 23 ? mtu : 0;
 }
@@ -2,14 +2,30 @@
 //
 // It borrows heavily from the Arduino "ESP32-BLE-Gamepad" library by lemmingdev,
 // and from ESP32 code examples from a famous Marxist revolutionary (chegewara ;-)
+//
+// The HID report map & reports are built by JRGamepad, and carried by a JRGamepadTransport
+// wrapping one of two Bluetooth LE stacks, selected by JRGAMEPAD_NIMBLE:
+//
+//  - 0: the ESP32 Arduino core's BLE library, based on Bluedroid (see JRGamepadBluedroid.cpp)
+//  - 1: the NimBLE-Arduino library, which must be installed with the Library Manager
+//       (see JRGamepadNimBLE.cpp). It takes less RAM & flash, and initializes faster.
+//
+// Both transports receive the very same HID report map & reports, so the gamepads look
+// identical to the host.
 
 #ifndef JRGAMEPAD_H
 #define JRGAMEPAD_H
 #include "sdkconfig.h"
 #if defined(CONFIG_BT_ENABLED)
 
-#include "BLEHIDDevice.h"
-#include "BLECharacteristic.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "GamepadCore.h"
+
+// Bluetooth LE stack (set here, as the sketch's parameters are not visible to the .cpp files)
+#ifndef JRGAMEPAD_NIMBLE
+#define JRGAMEPAD_NIMBLE 0
+#endif
 
 // Gamepad modes
 #define SINGLE_8BIT   0
@@ -21,36 +37,107 @@
 #define DUAL_7BIT     6
 #define DUAL_15BIT    7
 
+// Gamepad mode flag: map the 12 axes of the dual modes to a single gamepad, so that a single
+// HID report (and a single notification) carries all the axes
+#define COMPOSITE     8
+
+// Maximum HID report size: 16 buttons + 12 16-bit axes (composite mode)
+#define JRGAMEPAD_MAX_REPORT 26
+
+// Custom GATT service & read-only characteristic exposing the serialized PipelineStats
+// (see PipelineStats.cpp for the binary format), if diagnostics are enabled
+#define JRGAMEPAD_DIAGNOSTICS_SERVICE_UUID  "9e5d1e47-5c13-43a0-8635-82ad38a1386f"
+#define JRGAMEPAD_DIAGNOSTICS_CHAR_UUID     "9e5d1e48-5c13-43a0-8635-82ad38a1386f"
+
+
+class JRGamepad;
+
+
+// Interface of the Bluetooth LE stacks carrying the HID reports. A transport reports the
+// connection state, the connection interval and the congestion through the public members of
+// the JRGamepad passed to begin().
+
+class JRGamepadTransport {
+
+  public:
+    virtual const char* name (void) = 0;
+
+    // Initialize the Bluetooth stack with the HID report map (report IDs 1 and 2 for the
+    // gamepads), plus the diagnostics characteristic if requested, and start advertising
+    virtual void begin (JRGamepad* gamepad, const uint8_t* reportMap, size_t reportMapLength) = 0;
+
+    // Stop advertising, and release the Bluetooth stack's resources, unless keepsStack()
+    virtual void end (void) = 0;
+
+    // True if end() merely stops advertising and disconnects the host, keeping the Bluetooth
+    // stack and its GATT services: begin() then resumes with the report map of the first call
+    virtual bool keepsStack (void) = 0;
+
+    // Notify the HID report of a gamepad (0 or 1). Returns false if the report could not be
+    // queued, because the Bluetooth stack is congested: it will be retried after the congestion.
+    virtual bool notify (uint32_t gamepad, const uint8_t* report, size_t length) = 0;
+
+    // Update the value of the diagnostics characteristic, if it was created
+    virtual void setDiagnostics (const uint8_t* data, size_t length) = 0;
+};
+
+// The transport selected by JRGAMEPAD_NIMBLE
+JRGamepadTransport* jrGamepadTransport (void);
+
 
 class JRGamepad {
 
   private:
-    BLEHIDDevice* hid;
-    static void taskServer (void* pvParameter);
+    JRGamepadTransport* transport;
+    bool started;
+    int32_t stackMode;                          // gamepad mode of the transport's GATT services, -1 before begin
+    uint32_t freeHeap;                          // free heap before begin()
+
+    uint8_t reports[2][JRGAMEPAD_MAX_REPORT];   // most recently notified HID report of each gamepad
+    bool reportSent[2];                         // true once the gamepad's report has been notified
+    uint8_t pending[2][JRGAMEPAD_MAX_REPORT];   // newest HID report of each gamepad, not notified yet
+    bool reportPending[2];                      // true if the gamepad's pending report is waiting
+    HidLayout layout;                           // HID report layout (see GamepadCore.h)
+    uint32_t reportLength;                      // HID report length in bytes (without report ID)
     
   public:
     uint8_t batteryLevel;
-    std::string deviceManufacturer;
-    std::string deviceName;
+    const char* deviceManufacturer;
+    const char* deviceName;
     
     uint32_t gamepads;        // number of gamepads: 1 or 2
     uint32_t gamepadMode;     // 0-7 (see defines above)
+    bool composite;           // true if the 12 axes of a dual mode are sent as a single gamepad
     bool compatibilityMode;   // true if axes should have 8-bit instead of 16-bit resolution
     bool unityBugWorkaround;  // true if only positive axis values should be used (1 bit of resolution loss),
                               // ...needed for Unity-based RC simulators under Windows
     bool connected;           // true if paired and connected to host
+    bool diagnostics;         // true if the diagnostics characteristic should be created (set before begin)
+    uint8_t axisBits;         // bits per axis in the high-resolution modes, 9 to 16 (set before begin)
+    uint32_t connectionIntervalRequest;     // connection interval (us) requested on connection, 0 for the host's default
+    volatile uint32_t connectionInterval;   // connection interval (us) negotiated with the host, 0 if unknown
+    volatile uint32_t connectionAnchor;     // time (us) of a past connection event, as reported by the stack (an estimate)
+    volatile bool congested;                // true while the Bluetooth stack reports congestion
+    TaskHandle_t flushTask;                 // task notified when the congestion ends, so that it calls flush(),
+                                            // and when the host connects or disconnects
+    uint32_t beginMicros;                   // time taken by the Bluetooth stack's initialization in begin() (us)
+    int32_t beginHeap;                      // heap taken by the Bluetooth stack's initialization in begin() (bytes)
+    int32_t endHeap;                        // heap taken by a begin() / end() cycle (bytes), which a leak makes grow
+                                            // from the second cycle on
    
-    BLECharacteristic* inputGamepad[2];
-    JRGamepad ( std::string deviceName          = "JR Gamepad",
-                std::string deviceManufacturer  = "sardus1970",
+    JRGamepad ( const char* deviceName          = "JR Gamepad",
+                const char* deviceManufacturer  = "sardus1970",
     			      uint8_t batteryLevel            = 100 );
   
-    void begin (uint8_t gamepadMode);
+    bool begin (uint8_t gamepadMode);
     void end (void);
-    void setAxes(int16_t axes[]);
-      
-  protected:
-    virtual void onStarted (BLEServer *pServer) { };
+    void setAxes(int16_t axes[], bool force = false, uint32_t buttons = 0);
+    void flush (void);
+    uint32_t queueDepth (void);
+    void updateDiagnostics (void);
+    uint32_t microsToNextConnectionEvent (void);
+    const char* transportName (void);
+    uint32_t mtu (void);
 };
 
 #endif // CONFIG_BT_ENABLED
@@ -0,0 +1,242 @@
+// JRGamepadTransport for the ESP32 Arduino core's BLE library, based on the Bluedroid stack
+// (see JRGamepad.h)
+
+#include "sdkconfig.h"
+#include "JRGamepad.h"
+#if defined(CONFIG_BT_ENABLED) && ! JRGAMEPAD_NIMBLE
+
+#include <BLEDevice.h>
+#include <BLEUtils.h>
+#include <BLEServer.h>
+#include "BLE2902.h"
+#include "BLEHIDDevice.h"
+#include "BLESecurity.h"
+#include "HIDTypes.h"
+
+#include "Arduino.h"
+#include "PipelineStats.h"
+#include <new>
+
+
+class BluedroidTransport : public JRGamepadTransport {
+
+  public:
+    JRGamepad* gamepad;
+    BLEServer* server;
+    BLEHIDDevice* hid;
+    BLEServerCallbacks* callbacks;
+    BLESecurity* security;
+    BLECharacteristic* inputGamepad[2];
+    BLECharacteristic* diagnosticsCharacteristic;
+
+    const char* name (void) { return "Bluedroid"; }
+    void begin (JRGamepad* gamepad, const uint8_t* reportMap, size_t reportMapLength);
+    void end (void);
+    bool keepsStack (void) { return true; }
+    bool notify (uint32_t gamepad, const uint8_t* report, size_t length);
+    void setDiagnostics (const uint8_t* data, size_t length);
+
+    void setNotifications (bool enable);
+};
+
+static BluedroidTransport _transport;
+
+JRGamepadTransport* jrGamepadTransport (void)
+{
+  return &_transport;
+}
+
+
+// GAP event handler for tracking the connection interval negotiated with the host.
+//
+// The connection events are not reported by the Bluetooth stack, so the time at which the
+// connection parameter update is reported serves as the anchor from which the following
+// connection events are predicted. This callback is not a connection event itself, and the
+// prediction drifts: notify pacing is a heuristic (see GamepadCore.h).
+
+static JRGamepad* _gamepadInstance = NULL;
+
+static void _gapEventHandler (esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param)
+{
+  if (event == ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT && _gamepadInstance && param->update_conn_params.status == 0) {
+    _gamepadInstance->connectionAnchor = micros();
+    _gamepadInstance->connectionInterval = param->update_conn_params.conn_int * 1250;   // 1.25 ms units
+  }
+}
+
+
+// GATTS event handler for tracking the congestion of the connection: the Bluetooth stack
+// reports congestion when its notification buffers fill up, and the delivery status of every
+// notification. The reports held back during the congestion are flushed by the flushTask.
+
+static void _gattsEventHandler (esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t* param)
+{
+  if (! _gamepadInstance)
+    return;
+
+  if (event == ESP_GATTS_CONGEST_EVT) {
+    _gamepadInstance->congested = param->congest.congested;
+    if (param->congest.congested)
+      pipelineStats.congestions++;
+    else if (_gamepadInstance->flushTask)
+      xTaskNotifyGive (_gamepadInstance->flushTask);
+  }
+  else if (event == ESP_GATTS_CONF_EVT && param->conf.status != ESP_GATT_OK)
+    pipelineStats.notifyErrors++;
+}
+
+
+// BLEDevice server callbacks for handling Bluetooth connection / disconnection
+
+class MyCallbacks : public BLEServerCallbacks {
+  public :
+
+    BluedroidTransport* transport;
+
+    MyCallbacks (BluedroidTransport* transport) {
+      this->transport = transport;
+    };
+
+    void onConnect (BLEServer* pServer) {
+      this->transport->gamepad->connected = true;
+      this->transport->setNotifications (true);
+      if (this->transport->gamepad->flushTask)
+        xTaskNotifyGive (this->transport->gamepad->flushTask);
+    }
+
+    // request a short connection interval, so that notifications don't wait long for the next
+    // connection event. The host has the final word, see _gapEventHandler
+    void onConnect (BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      uint16_t interval = this->transport->gamepad->connectionIntervalRequest / 1250;   // 1.25 ms units
+      if (interval)
+        pServer->updateConnParams (param->connect.remote_bda, interval, interval * 2, 0, 400);
+    }
+
+    void onDisconnect (BLEServer* pServer) {
+      this->transport->gamepad->connected = false;
+      this->transport->gamepad->connectionInterval = 0;
+      this->transport->gamepad->congested = false;
+      this->transport->setNotifications (false);
+      if (this->transport->gamepad->flushTask)
+        xTaskNotifyGive (this->transport->gamepad->flushTask);
+    }
+};
+
+
+// Static storage for the objects handed over to the BLE library, which are constructed by
+// the first begin(), so that they don't fragment the heap shared with Bluedroid
+
+alignas (MyCallbacks)  static uint8_t _callbacksStorage [sizeof (MyCallbacks)];
+alignas (BLEHIDDevice) static uint8_t _hidStorage [sizeof (BLEHIDDevice)];
+alignas (BLESecurity)  static uint8_t _securityStorage [sizeof (BLESecurity)];
+
+
+// Initialize BLEDevice with the HID report map, and start advertising.
+//
+// The BLE library can't release its GATT server: BLEDevice::deinit() leaves the server, its
+// services, characteristics & descriptors allocated, and BLEHIDDevice doesn't delete them
+// either. So the stack is initialized only once, and end() merely stops advertising and
+// disconnects the host: a later begin() resumes advertising with the same HID report map
+// (JRGamepad refuses another gamepad mode, see keepsStack).
+
+void BluedroidTransport::begin (JRGamepad* gamepad, const uint8_t* reportMap, size_t reportMapLength)
+{
+  this->gamepad = gamepad;
+  _gamepadInstance = gamepad;
+
+  if (this->hid) {                      // ...resuming after end()
+    BLEDevice::getAdvertising()->start();
+    return;
+  }
+
+  //Serial.println (micros());
+  BLEDevice::init (gamepad->deviceName);   // ...interferes with RMT, causing the error: "RMT[0] ERR / status: 0x04000000"
+  //Serial.println (micros());
+
+  if (gamepad->mtu())
+    BLEDevice::setMTU (gamepad->mtu());
+
+  BLEDevice::setCustomGapHandler (_gapEventHandler);
+  BLEDevice::setCustomGattsHandler (_gattsEventHandler);
+
+  BLEServer *pServer = BLEDevice::createServer();
+  this->server = pServer;
+  this->callbacks = new (_callbacksStorage) MyCallbacks (this);
+  pServer->setCallbacks (this->callbacks);
+
+  this->hid = new (_hidStorage) BLEHIDDevice (pServer);
+  for (uint32_t g = 0; g < gamepad->gamepads; g++)
+    this->inputGamepad[g] = this->hid->inputReport(g + 1); // REPORT ID from report map
+
+  this->hid->manufacturer()->setValue (gamepad->deviceManufacturer);
+
+  this->hid->pnp(0x01, 0x02e5, 0xabcd, 0x0110);
+  this->hid->hidInfo(0x00, 0x01);
+
+  this->security = new (_securityStorage) BLESecurity();
+  this->security->setAuthenticationMode(ESP_LE_AUTH_BOND);
+
+  // the HID report map matching the gamepad mode
+  this->hid->reportMap ((uint8_t*) reportMap, reportMapLength);
+
+  this->hid->startServices();
+
+  // custom service exposing the pipeline statistics
+  this->diagnosticsCharacteristic = NULL;
+  if (gamepad->diagnostics) {
+    BLEService *pService = pServer->createService (JRGAMEPAD_DIAGNOSTICS_SERVICE_UUID);
+    this->diagnosticsCharacteristic = pService->createCharacteristic (JRGAMEPAD_DIAGNOSTICS_CHAR_UUID,
+                                                                      BLECharacteristic::PROPERTY_READ);
+    pService->start();
+  }
+
+  BLEAdvertising *pAdvertising = pServer->getAdvertising();
+  pAdvertising->setAppearance (HID_GAMEPAD);
+  pAdvertising->addServiceUUID (this->hid->hidService()->getUUID());
+  pAdvertising->start();
+  this->hid->setBatteryLevel (gamepad->batteryLevel);
+}
+
+
+// Stop advertising, and disconnect the host. The stack and the GATT server are kept, see begin()
+
+void BluedroidTransport::end (void)
+{
+  BLEDevice::getAdvertising()->stop();
+  if (this->gamepad->connected)
+    this->server->disconnect (this->server->getConnId());
+  _gamepadInstance = NULL;
+}
+
+
+// Notify a HID report. Bluedroid queues every notification, and reports its congestion
+// asynchronously (see _gattsEventHandler): while congested, the report stays pending, and is
+// notified by flush() once the congestion ends
+
+bool BluedroidTransport::notify (uint32_t gamepad, const uint8_t* report, size_t length)
+{
+  if (this->gamepad->congested)
+    return false;
+
+  this->inputGamepad[gamepad]->setValue ((uint8_t*) report, length);
+  this->inputGamepad[gamepad]->notify();
+  return true;
+}
+
+
+void BluedroidTransport::setDiagnostics (const uint8_t* data, size_t length)
+{
+  if (this->diagnosticsCharacteristic)
+    this->diagnosticsCharacteristic->setValue ((uint8_t*) data, length);
+}
+
+
+void BluedroidTransport::setNotifications (bool enable)
+{
+  for (uint32_t g = 0; g < this->gamepad->gamepads; g++) {
+    BLE2902* desc = (BLE2902*)this->inputGamepad[g]->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
+    desc->setNotifications(enable);
+  }
+}
+
+#endif // CONFIG_BT_ENABLED && ! JRGAMEPAD_NIMBLE
@@ -0,0 +1,229 @@
+// JRGamepadTransport for the NimBLE-Arduino library (see JRGamepad.h)
+//
+// NimBLE doesn't report the congestion of a connection: a notification that doesn't find a
+// free buffer fails instead (BLE_HS_ENOMEM), and is retried after the next connection event,
+// when the controller has sent the queued notifications.
+
+#include "sdkconfig.h"
+#include "JRGamepad.h"
+#if defined(CONFIG_BT_ENABLED) && JRGAMEPAD_NIMBLE
+
+#include <NimBLEDevice.h>
+#include <NimBLEHIDDevice.h>
+#include "freertos/timers.h"
+
+#include "Arduino.h"
+#include "PipelineStats.h"
+#include <new>
+#include <string>
+
+
+class NimBLETransport : public JRGamepadTransport,
+                        public NimBLEServerCallbacks,
+                        public NimBLECharacteristicCallbacks {
+
+  public:
+    JRGamepad* gamepad;
+    NimBLEHIDDevice* hid;
+    NimBLECharacteristic* inputGamepad[2];
+    NimBLECharacteristic* diagnosticsCharacteristic;
+    int notifyStatus;                   // error code of the last notification, 0 unless it failed (see onStatus)
+
+    const char* name (void) { return "NimBLE"; }
+    void begin (JRGamepad* gamepad, const uint8_t* reportMap, size_t reportMapLength);
+    void end (void);
+    bool keepsStack (void) { return false; }
+    bool notify (uint32_t gamepad, const uint8_t* report, size_t length);
+    void setDiagnostics (const uint8_t* data, size_t length);
+
+    void onConnect (NimBLEServer* pServer, ble_gap_conn_desc* desc);
+    void onDisconnect (NimBLEServer* pServer, ble_gap_conn_desc* desc);
+    void onStatus (NimBLECharacteristic* pCharacteristic, Status s, int code);
+};
+
+static NimBLETransport _transport;
+
+JRGamepadTransport* jrGamepadTransport (void)
+{
+  return &_transport;
+}
+
+
+// Static storage for the HID device, which is constructed by begin() and destroyed by end()
+
+alignas (NimBLEHIDDevice) static uint8_t _hidStorage [sizeof (NimBLEHIDDevice)];
+
+// statically allocated timer, ending the congestion after a connection interval
+static StaticTimer_t _congestionTimerBuffer;
+static TimerHandle_t _congestionTimer = NULL;
+
+
+static void _congestionTimerCallback (TimerHandle_t timer)
+{
+  _transport.gamepad->congested = false;
+  if (_transport.gamepad->flushTask)
+    xTaskNotifyGive (_transport.gamepad->flushTask);
+}
+
+
+// GAP event handler for tracking the connection interval negotiated with the host.
+//
+// The connection events are not reported by the Bluetooth stack, so the time at which the
+// connection parameter update is reported serves as the anchor from which the following
+// connection events are predicted. This callback is not a connection event itself, and the
+// prediction drifts: notify pacing is a heuristic (see GamepadCore.h).
+
+static int _gapEventHandler (ble_gap_event* event, void* arg)
+{
+  ble_gap_conn_desc desc;
+  if (event->type == BLE_GAP_EVENT_CONN_UPDATE && event->conn_update.status == 0
+      && ble_gap_conn_find (event->conn_update.conn_handle, &desc) == 0) {
+    _transport.gamepad->connectionAnchor = micros();
+    _transport.gamepad->connectionInterval = desc.conn_itvl * 1250;   // 1.25 ms units
+  }
+  return 0;
+}
+
+
+// Server callbacks for handling Bluetooth connection / disconnection. NimBLE keeps track of
+// the host's subscription to the HID reports, and restores it for a bonded host.
+
+void NimBLETransport::onConnect (NimBLEServer* pServer, ble_gap_conn_desc* desc)
+{
+  this->gamepad->connectionAnchor = micros();
+  this->gamepad->connectionInterval = desc->conn_itvl * 1250;   // 1.25 ms units
+  this->gamepad->connected = true;
+
+  // request a short connection interval, so that notifications don't wait long for the next
+  // connection event. The host has the final word, see _gapEventHandler
+  uint16_t interval = this->gamepad->connectionIntervalRequest / 1250;   // 1.25 ms units
+  if (interval)
+    pServer->updateConnParams (desc->conn_handle, interval, interval * 2, 0, 400);
+
+  if (this->gamepad->flushTask)
+    xTaskNotifyGive (this->gamepad->flushTask);
+}
+
+
+void NimBLETransport::onDisconnect (NimBLEServer* pServer, ble_gap_conn_desc* desc)
+{
+  xTimerStop (_congestionTimer, 0);
+  this->gamepad->connected = false;
+  this->gamepad->connectionInterval = 0;
+  this->gamepad->congested = false;
+  if (this->gamepad->flushTask)
+    xTaskNotifyGive (this->gamepad->flushTask);
+}
+
+
+// Delivery status of a notification, reported from within NimBLECharacteristic::notify().
+// Only ERROR_GATT is a transmit failure: a host that isn't connected or hasn't subscribed to
+// the report (ERROR_NO_CLIENT, ERROR_NOTIFY_DISABLED) simply doesn't receive it
+
+void NimBLETransport::onStatus (NimBLECharacteristic* pCharacteristic, Status s, int code)
+{
+  if (pCharacteristic == this->inputGamepad[0] || pCharacteristic == this->inputGamepad[1])
+    this->notifyStatus = s == ERROR_GATT ? (code ? code : -1) : 0;
+}
+
+
+// Initialize NimBLE with the HID report map, and start advertising
+
+void NimBLETransport::begin (JRGamepad* gamepad, const uint8_t* reportMap, size_t reportMapLength)
+{
+  this->gamepad = gamepad;
+
+  if (! _congestionTimer)
+    _congestionTimer = xTimerCreateStatic ("congestion", 1, pdFALSE, NULL,
+                                           _congestionTimerCallback, &_congestionTimerBuffer);
+
+  NimBLEDevice::init (gamepad->deviceName);
+  NimBLEDevice::setSecurityAuth (true, false, false);   // bonding, like ESP_LE_AUTH_BOND
+  NimBLEDevice::setCustomGapHandler (_gapEventHandler);
+
+  if (gamepad->mtu())
+    NimBLEDevice::setMTU (gamepad->mtu());
+
+  NimBLEServer *pServer = NimBLEDevice::createServer();
+  pServer->setCallbacks (this, false);
+
+  this->hid = new (_hidStorage) NimBLEHIDDevice (pServer);
+  for (uint32_t g = 0; g < gamepad->gamepads; g++) {
+    this->inputGamepad[g] = this->hid->inputReport(g + 1); // REPORT ID from report map
+    this->inputGamepad[g]->setCallbacks (this);
+  }
+
+  this->hid->manufacturer()->setValue (std::string (gamepad->deviceManufacturer));
+
+  this->hid->pnp(0x01, 0x02e5, 0xabcd, 0x0110);
+  this->hid->hidInfo(0x00, 0x01);
+
+  // the HID report map matching the gamepad mode
+  this->hid->reportMap ((uint8_t*) reportMap, reportMapLength);
+
+  this->hid->startServices();
+
+  // custom service exposing the pipeline statistics
+  this->diagnosticsCharacteristic = NULL;
+  if (gamepad->diagnostics) {
+    NimBLEService *pService = pServer->createService (JRGAMEPAD_DIAGNOSTICS_SERVICE_UUID);
+    this->diagnosticsCharacteristic = pService->createCharacteristic (JRGAMEPAD_DIAGNOSTICS_CHAR_UUID,
+                                                                      NIMBLE_PROPERTY::READ);
+    pService->start();
+  }
+
+  NimBLEAdvertising *pAdvertising = pServer->getAdvertising();
+  pAdvertising->setAppearance (HID_GAMEPAD);
+  pAdvertising->addServiceUUID (this->hid->hidService()->getUUID());
+  pAdvertising->start();
+  this->hid->setBatteryLevel (gamepad->batteryLevel);
+}
+
+
+// Stop advertising, and release NimBLE's resources (including the server, services and
+// characteristics)
+
+void NimBLETransport::end (void)
+{
+  xTimerStop (_congestionTimer, 0);
+  NimBLEDevice::getAdvertising()->stop();
+  NimBLEDevice::deinit (true);
+
+  this->hid->~NimBLEHIDDevice();
+  this->hid = NULL;
+
+  this->diagnosticsCharacteristic = NULL;
+  this->inputGamepad[0] = this->inputGamepad[1] = NULL;
+}
+
+
+// Notify a HID report. A notification failing for lack of buffers marks the connection as
+// congested until the next connection event, when the report is retried
+
+bool NimBLETransport::notify (uint32_t gamepad, const uint8_t* report, size_t length)
+{
+  this->notifyStatus = 0;
+  this->inputGamepad[gamepad]->setValue (report, length);
+  this->inputGamepad[gamepad]->notify();
+
+  if (this->notifyStatus == BLE_HS_ENOMEM) {
+    this->gamepad->congested = true;
+    pipelineStats.congestions++;
+
+    uint32_t interval = this->gamepad->connectionInterval ? this->gamepad->connectionInterval : 7500;
+    xTimerChangePeriod (_congestionTimer, interval / 1000 / portTICK_PERIOD_MS + 1, 0);
+    return false;
+  }
+  if (this->notifyStatus)
+    pipelineStats.notifyErrors++;
+  return true;
+}
+
+
+void NimBLETransport::setDiagnostics (const uint8_t* data, size_t length)
+{
+  if (this->diagnosticsCharacteristic)
+    this->diagnosticsCharacteristic->setValue (data, length);
+}
+
+#endif // CONFIG_BT_ENABLED && JRGAMEPAD_NIMBLE
@@ -24,8 +24,16 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/timers.h"
 #include "driver/rmt.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
 #include "JRGamepad.h"
+#include "PipelineStats.h"
+#include "SerialDecoders.h"
+#include "RmtCapture.h"
+#include "GamepadCore.h"
+#include "Preferences.h"
 #include "Arduino.h"
 
 
@@ -34,9 +42,70 @@
 // Debug mode: if defined, a lot of stuff gets printed to the Serial Monitor
 #undef DEBUG
 
+// Diagnostics mode: if set to 1, pipeline latency histograms and throughput counters are
+// printed to the Serial Monitor every DIAGNOSTICS_INTERVAL_MILLIS milliseconds, and exposed
+// via a custom Bluetooth GATT characteristic (see JRGamepad.h)
+#define DIAGNOSTICS 0
+#define DIAGNOSTICS_INTERVAL_MILLIS 5000
+
+// Capture mode: if set to 1, the raw RMT frames of the PPM signal are written to the Serial
+// port in a binary format (see RmtCapture.h), so that they can be replayed off-target.
+// Requires DEBUG and DIAGNOSTICS to be disabled, as their output would be interleaved.
+#define CAPTURE_RMT_FRAMES 0
+
+// Bluetooth restart check: if set to 1, setup() merely starts and ends the gamepad twice, and
+// prints the heap taken by both begin() / end() cycles, instead of running the module. The
+// second cycle must take no heap, or end() leaks (see JRGamepad::endHeap).
+#define BLE_RESTART_CHECK 0
+
 // The JR module's PPM input is attached to this pin
 #define PPM_PIN GPIO_NUM_22
 
+// Input signal on PPM_PIN:
+//  - INPUT_PPM is the JR module bay's standard PPM signal
+//  - INPUT_SBUS and INPUT_CRSF are serial signals that many transmitters can output instead
+//    of PPM. They offer higher frame rates (up to 500 Hz for CRSF), 16 channels and digital
+//    11-bit channel values
+#define INPUT_PPM  0
+#define INPUT_SBUS 1
+#define INPUT_CRSF 2
+#define INPUT_PROTOCOL INPUT_PPM
+
+// Baud rate of the CRSF signal, which must match the transmitter's setting for the external
+// module: EdgeTX defaults to 400000 baud, while other transmitters and firmwares use 420000
+#define CRSF_BAUDRATE 400000
+
+// PPM frame validation: if set to 1, PPM frames with an unexpected number of channels, a
+// channel pulse outside PPM_PULSE_MIN .. PPM_PULSE_MAX microseconds or an excessive total
+// length are rejected, instead of reaching the gamepad as stick spikes.
+//  - a channel jumping by more than PPM_MAX_SLEW microseconds keeps its previous value until
+//    the next frame confirms the jump (0 disables the slew check, which otherwise delays
+//    genuinely fast movements & switch flips by one frame)
+//  - up to PPM_BRIDGE_FRAMES consecutive rejected frames are replaced by a linear
+//    extrapolation of the last valid frames, so that short glitches go unnoticed
+#define PPM_VALIDATION 1
+#define PPM_PULSE_MIN 800
+#define PPM_PULSE_MAX 2200
+#define PPM_MAX_SLEW 600
+#define PPM_BRIDGE_FRAMES 2
+
+// High-resolution sampling: if set to 1, the PPM signal is sampled with 62.5 nanosecond
+// instead of 100 nanosecond RMT clock ticks, ie. 16000 instead of 10000 steps over the
+// channel pulse range (about 14 instead of 13 bits), so that the 15- and 16-bit gamepad
+// modes get more real resolution. Faster RMT clocks aren't possible, as the channel pulses
+// would overflow the RMT's 15-bit pulse durations.
+#define RMT_HIGH_RESOLUTION 0
+
+// Additional PPM inputs: up to 3 more PPM signals (from a head tracker, a pedal unit, etc.) can
+// be decoded on the PPM_AUX_PINS, each by its own RMT channel. The first PPM_AUX_CHANNELS
+// channels of every additional input are appended to the axes of the PPM_PIN input, whose
+// number of axes is reduced accordingly (there are at most 12 gamepad axes).
+// Every input is detected and lost on its own: the axes of a lost additional input are centered.
+// Remove the additional pins from unusedOutput below!
+#define PPM_AUX_INPUTS 0
+#define PPM_AUX_PINS { GPIO_NUM_21, GPIO_NUM_19, GPIO_NUM_18 }
+#define PPM_AUX_CHANNELS 3
+
 // ESP32 onboard LED pin:
 //  - a fast flash (5Hz) indicates PPM signal absence
 //  - a slow flash (1Hz) indicates that Bluetooth is not connected
@@ -79,6 +148,47 @@ const int unusedOutput[] = { 0,1,4,5,12,13,14,15,16,17,18,19,20,21,23,24,25,26,2
 #define REFRESH_RATE_MAX 100
 #define REFRESH_RATE_DEFAULT -25
 
+// Event-driven refresh: if set to 1, the GamepadRefresh task is woken up by the
+// ChannelExtractor as soon as a complete PPM frame has been decoded, so that stick
+// movements are sent without waiting for the next refresh period. The refresh rate
+// then only acts as an upper bound.
+// If set to 0, the channel values are polled at the refresh rate.
+#define REFRESH_ON_FRAME 1
+
+// Adaptive refresh rate: if set to 1, the refresh rate follows the stick speed, so that
+// fast movements are sent at the full refresh rate, while slow movements are sent at a
+// lower rate, saving power and airtime (still sticks are only refreshed to keep the
+// connection alive). The refresh rate set by REFRESH_RATE_DEFAULT or the refresh rate
+// channel becomes the ceiling.
+//  - ADAPTIVE_RATE_MIN is the refresh rate of the slowest movements (Hz)
+//  - ADAPTIVE_FULL_SPEED is the stick speed that selects the full refresh rate (pulse width
+//    change per second, in microseconds: a full stick deflection is 1000 us)
+//  - on Bluetooth congestion or failed notifications, the refresh rate is halved (down to
+//    ADAPTIVE_RATE_MIN), and then recovers by ADAPTIVE_RATE_RECOVERY Hz per second
+#define ADAPTIVE_REFRESH 0
+#define ADAPTIVE_RATE_MIN 10
+#define ADAPTIVE_FULL_SPEED 2000
+#define ADAPTIVE_RATE_RECOVERY 20
+
+// Bluetooth connection interval requested from the computer, in microseconds. Notifications
+// are transmitted at connection events, so shorter intervals mean lower latency. 7500 us is
+// the minimum allowed by the Bluetooth specification, and the computer has the final word.
+// Set to 0 to keep the computer's default.
+#define BLE_CONNECTION_INTERVAL 7500
+
+// The Bluetooth LE stack (Bluedroid or NimBLE) is selected by JRGAMEPAD_NIMBLE in JRGamepad.h.
+// The memory report shows the heap & time taken by its initialization.
+
+// Notify pacing: if set to 1, notifications are held back until NOTIFY_PACING_GUARD_MICROS
+// microseconds before the next expected connection event, and then sent with the newest
+// PPM frame. The connection events are predicted from the negotiated connection interval and
+// the time at which the stack reported it, which is only a heuristic: that report lags the
+// actual connection event, and the ESP32's clock drifts against the Bluetooth controller's,
+// so that a notification may miss the event it was held back for. Check extras/link_sim.cpp
+// before enabling it.
+#define NOTIFY_PACING 0
+#define NOTIFY_PACING_GUARD_MICROS 1500
+
 // On transmitters that will always output an 8-channel PPM signal, regardless of the
 // number of channels that you actually want, you can specify a lower number of channels
 // using FORCE_CHANNEL_COUNT.
@@ -89,10 +199,101 @@ const int unusedOutput[] = { 0,1,4,5,12,13,14,15,16,17,18,19,20,21,23,24,25,26,2
 // FORCE_CHANNEL_COUNT to zero
 #define FORCE_CHANNEL_COUNT 6
 
+// With more than 6 channels, two gamepads are notified separately for each refresh.
+// Set DUAL_GAMEPAD_COMPOSITE to 1 to map all 12 axes to a single gamepad instead, so that
+// a single notification carries the whole PPM frame. Note that not every gamepad driver
+// supports more than 6 axes (DirectInput under Windows only supports 8 axes)
+#define DUAL_GAMEPAD_COMPOSITE 0
+
+// Axis resolution of the high-resolution (15- and 16-bit) modes: the axis values are sent with
+// AXIS_BITS bits (9 to 16). The PPM signal is sampled with about 13 bits (14 bits with
+// RMT_HIGH_RESOLUTION), so AXIS_BITS 13 or 14 loses nothing, while shrinking the HID reports
+// (11 instead of 13 bytes with 6 13-bit axes). You may have to re-pair the module after changing it.
+#define AXIS_BITS 16
+
+// Switch channels: the channels in SWITCH_BUTTON_CHANNELS (a bit mask, bit 0 for channel 1) also
+// set a gamepad button, which is pressed while the channel is above its center. The buttons are
+// numbered in channel order, with up to 8 buttons per gamepad (16 with DUAL_GAMEPAD_COMPOSITE).
+// Set to 0 for no buttons.
+#define SWITCH_BUTTON_CHANNELS 0
+
+// Channel calibration: if set to 1, every channel is converted to its gamepad axis according to
+// its calibrated endpoints & center, which are measured by a calibration pass and stored in the
+// non-volatile storage. Send 'c' in the Serial Monitor to start the calibration pass, move all
+// the sticks, sliders & switches to their endpoints, center the sticks and send 'c' again.
+// Send 'r' to reset the calibration. Without calibration, the channels span PPM_PULSE_CENTER
+// +/- PPM_PULSE_DELTA, and are converted exactly as with CHANNEL_CALIBRATION set to 0, which
+// also leaves the Serial Monitor input alone.
+//  - CHANNEL_DEADBAND is the deadband around the center of every channel (in microseconds)
+//  - CHANNEL_EXPO sets the expo of every channel (0 to 100%, 0 for a linear response)
+#define CHANNEL_CALIBRATION 0
+#define CHANNEL_DEADBAND 0
+#define CHANNEL_EXPO { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+
+// Startup profile: if set to 1, the number of axes, the gamepad mode and the channel noise
+// thresholds are stored in the non-volatile storage, and reused on the next boot: Bluetooth
+// then starts advertising without waiting for the PPM signal, and the noise thresholds don't
+// need to be sampled first. The board restarts if the PPM signal doesn't match the profile
+// (after changing the transmitter's channel count or the gamepad mode), which disconnects the
+// computer: only enable it for a transmitter setup that doesn't change.
+#define PERSIST_PROFILE 0
+
 // NoiseEstimator: scale factor when using max noise as the threshold.
 // Good values for NOISE_SCALE are in the range 1.1f to 1.5f
 #define NOISE_SCALE 1.2f
 
+// NoiseEstimator hysteresis: once a channel has moved, its noise threshold is divided by
+// NOISE_HYSTERESIS until the channel has been at rest for NOISE_HOLD_MILLIS milliseconds,
+// so that small, slow stick movements are not swallowed
+#define NOISE_HYSTERESIS 2
+#define NOISE_HOLD_MILLIS 250
+
+// Input filter: if set to 1, a speed-adaptive "One Euro" filter smoothes every channel
+// before its conversion to a gamepad axis value. Slow stick movements are filtered
+// heavily (less jitter), fast movements hardly at all (less lag):
+//
+//  - FILTER_MIN_CUTOFF is the cutoff frequency at rest (Hz): lower values reduce jitter
+//  - FILTER_BETA is the cutoff frequency increase per stick speed unit (Hz per us/s):
+//    higher values reduce lag during fast movements
+//  - FILTER_SPEED_CUTOFF is the cutoff frequency of the stick speed estimate (Hz)
+//  - FILTER_PREDICT_MILLIS extrapolates the filtered values by this many milliseconds
+//    past the notification time, to compensate the PPM frame & Bluetooth delays
+//    (0 disables the prediction, which will otherwise overshoot on sudden stops)
+#define INPUT_FILTER 0
+#define FILTER_MIN_CUTOFF 1.0f
+#define FILTER_BETA 0.007f
+#define FILTER_SPEED_CUTOFF 1.0f
+#define FILTER_PREDICT_MILLIS 0
+
+// Power save mode: if set to 1, the tasks only wake up when there is something to do (a new
+// PPM frame, a due inactivity refresh, a Bluetooth connection, ...) instead of polling
+// periodically, so that the CPU idles as long as possible between the PPM frames. Once the
+// PPM signal has been absent for POWER_SAVE_IDLE_MILLIS milliseconds, the RMT receiver is shut
+// down until the next edge on PPM_PIN. If the ESP-IDF libraries are built with power management
+// (CONFIG_PM_ENABLE) and tickless idle (CONFIG_FREERTOS_USE_TICKLESS_IDLE), the ESP32
+// light-sleeps while it idles without the RMT receiver: between the PPM frames, the receiver
+// is stopped until POWER_SAVE_SLEEP_GUARD_MICROS before the predicted start of the next frame
+// (see FrameTiming in GamepadCore.h).
+// The busy time per PPM frame and the wakeups of every task are part of the DIAGNOSTICS output.
+#define POWER_SAVE 0
+#define POWER_SAVE_IDLE_MILLIS 2000
+#define POWER_SAVE_SLEEP_GUARD_MICROS 2000
+
+// Task layout: the core (0, 1 or tskNO_AFFINITY) and the priority of every task.
+// The Bluetooth controller & host tasks run on core 0, the Arduino loop() on core 1:
+//  - the ChannelExtractor runs on core 1 at a high priority, so that PPM frames are decoded
+//    right away, without being delayed by the Bluetooth stack
+//  - the GamepadRefresh task runs next to the Bluetooth host on core 0, so that its
+//    notifications are handed over without crossing cores
+//  - the NoiseEstimator only runs in the background, at a low priority
+// The CPU share and worst wakeup latency of every task are part of the DIAGNOSTICS output.
+#define CHANNEL_EXTRACTOR_CORE     1
+#define CHANNEL_EXTRACTOR_PRIORITY 5
+#define GAMEPAD_REFRESH_CORE       0
+#define GAMEPAD_REFRESH_PRIORITY   3
+#define NOISE_ESTIMATOR_CORE       1
+#define NOISE_ESTIMATOR_PRIORITY   1
+
 // Unity under Windows bug workaround:
 // - if set to 1, only positive gamepad axis values are used (1 bit resolution loss!)
 // - if set to 0, gamepad axis values will span the entire range of negative and positive values
@@ -121,8 +322,39 @@ const int unusedOutput[] = { 0,1,4,5,12,13,14,15,16,17,18,19,20,21,23,24,25,26,2
 // The ESP32 RMT module is used to sample and decode the PPM signal. Only change these
 // values if you know the implications (ie. read the datasheets first!)
 #define RMT_RX_CHANNEL   RMT_CHANNEL_0          // RMT has 8 channels and we have to pick one
-#define RMT_CLK_DIV      8                      // RMT clock divider (80 MHz gets divided by RMT_CLK_DIV)
+                                                // (the additional PPM inputs use the following ones)
+#define RMT_CLK_DIV      (RMT_HIGH_RESOLUTION ? 5 : 8)  // RMT clock divider (80 MHz gets divided by RMT_CLK_DIV)
 #define RMT_TICK_US      (80 / RMT_CLK_DIV)     // RMT clock ticks per microsecond
+#define RMT_DURATION_MAX 32767                  // RMT pulse durations are 15-bit values (in ticks)
+
+// Shortest separator pulse of a PPM channel (in microseconds): the rest of the channel pulse,
+// up to PPM_PULSE_MAX - PPM_SEPARATOR_MIN, has to fit into a single RMT pulse duration
+#define PPM_SEPARATOR_MIN 300
+
+// RMT idle threshold (in ticks), which ends the PPM frame: the minimum sync pulse length, but
+// no longer than an RMT pulse duration, so that an overlong pulse ends the frame (which is
+// then rejected) instead of rolling over
+#define RMT_IDLE_THRESHOLD (PPM_SYNC_MINIMUM * RMT_TICK_US < RMT_DURATION_MAX ? PPM_SYNC_MINIMUM * RMT_TICK_US : RMT_DURATION_MAX)
+
+// RMT receive buffering. Each RMT memory block holds 64 items (one item per PPM channel, plus
+// the sync pulse), and is taken away from the following RMT channel. The ring buffer holds
+// the decoded frames until the ChannelExtractor reads them, which may be delayed when the
+// Bluetooth stack keeps the CPU busy.
+#define RMT_MEM_BLOCKS   2                      // RMT memory blocks (64 items each)
+#define RMT_RINGBUF_SIZE 2048                   // ring buffer size in bytes (4 bytes per item)
+
+// LED blink timer period (a fast flash toggles the LED on every period), and its period
+// while the LED is steady in power save mode
+#define LED_TIMER_MILLIS  100
+#define LED_STEADY_MILLIS 1000
+
+// FreeRTOS task stack sizes (in bytes). The stacks are statically allocated, so that they
+// don't compete with the Bluetooth stack for heap memory. The memory report printed after the
+// first HID notification shows how much of every stack has remained unused.
+#define CHANNEL_EXTRACTOR_STACK 3072
+#define NOISE_ESTIMATOR_STACK   2048
+#define GAMEPAD_REFRESH_STACK   8192            // the Bluetooth stack is initialized by this task
+#define AUX_EXTRACTOR_STACK     2048            // one for every additional PPM input
 
 // Gamepad axis resolution (16 bit, only the high byte is used in 8 bit mode)
 // AXIS_MIN is 0 in UNITY_BUG_WORKAROUND mode, resulting in a 1 bit resolution loss
@@ -130,9 +362,16 @@ const int unusedOutput[] = { 0,1,4,5,12,13,14,15,16,17,18,19,20,21,23,24,25,26,2
 #define AXIS_MIN        -32767
 #define AXIS_MAX        32767
 
-// The minimum & maximum number of PPM channels supported by this implementation
+// The minimum & maximum number of PPM channels supported by this implementation, and
+// the maximum number of channels that can be mapped to gamepad axes (2 gamepads x 6 axes)
 #define PPM_MIN_CHANNELS 2
-#define PPM_MAX_CHANNELS 12
+#define PPM_MAX_CHANNELS 16
+#define GAMEPAD_MAX_AXES 12
+
+// Number of gamepad axes taken by the additional PPM inputs, and the size of a published frame:
+// the primary input's channels, followed by those of the additional inputs (see readFrame)
+#define PPM_AUX_AXES (PPM_AUX_INPUTS * PPM_AUX_CHANNELS)
+#define FRAME_VALUES (PPM_MAX_CHANNELS + PPM_AUX_AXES)
 
 // Macros for printing to the Serial Monitor, depending on whether DEBUG is defined
 #ifdef DEBUG
@@ -146,10 +385,16 @@ const int unusedOutput[] = { 0,1,4,5,12,13,14,15,16,17,18,19,20,21,23,24,25,26,2
 
 // ----- Globals
 
-// raw RMT tick values of the channels in the most recent PPM frame (set by ChannelExtractor)
-static uint32_t channelValues[PPM_MAX_CHANNELS];
+// raw RMT tick values of the channels in the most recent PPM frame, followed by the channels of
+// the additional PPM inputs from PPM_MAX_CHANNELS on, and the frame's reception time, under a
+// seqlock (set by the ChannelExtractor tasks, see FrameStore in GamepadCore.h).
+// Use readFrame() to obtain a consistent copy of the most recent PPM frame.
+static FrameStore frameStore;
+
+// serializes the updates of frameStore by the primary and the additional inputs' ChannelExtractors
+static portMUX_TYPE frameMux = portMUX_INITIALIZER_UNLOCKED;
 
-// number of channels detected in the most recent PPM frame (set by ChannelExtractor)
+// number of channels detected in the most recent PPM frame of the primary input (set by ChannelExtractor)
 static uint32_t channelCount = 0;
 
 // normalized gamepad axis values ranging from AXIS_MIN to AXIS_MAX (set by GamepadRefresh)
@@ -163,18 +408,88 @@ static uint32_t missingFrames = 1;
 
 // flags indicating completed initialization of the ChannelExtractor, NoiseEstimator and GamepadRefresh tasks
 static bool channelsAvailable  = false;         // ChannelExtractor : true when the PPM signal is detected for the first time
-static bool noiseEstimated     = false;         // NoiseEstimator   : true if channel noise estimation is completed
+static bool noiseEstimated     = false;         // NoiseEstimator   : true if the initial channel noise estimation is completed
 static bool gamepadInitialized = false;         // GamepadRefresh   : true after Bluetooth advertising has started
 
+// startup profile loaded from the non-volatile storage, valid if profileAxisCount is not 0 (see Profile.ino)
+static uint32_t profileAxisCount = 0;
+static uint32_t profileMode = 0;
+static uint32_t profileThresholds[PPM_MAX_CHANNELS];
+
+// handle of the GamepadRefresh task, notified by the ChannelExtractor on every new PPM frame
+static TaskHandle_t gamepadRefreshTaskHandle = NULL;
+
+// statically allocated task stacks & control blocks, and the remaining task handles
+static StackType_t channelExtractorStack[CHANNEL_EXTRACTOR_STACK];
+static StackType_t noiseEstimatorStack[NOISE_ESTIMATOR_STACK];
+static StackType_t gamepadRefreshStack[GAMEPAD_REFRESH_STACK];
+static StaticTask_t channelExtractorTcb, noiseEstimatorTcb, gamepadRefreshTcb;
+static TaskHandle_t channelExtractorTaskHandle = NULL;
+static TaskHandle_t noiseEstimatorTaskHandle = NULL;
+#if PPM_AUX_INPUTS
+static StackType_t auxExtractorStack[PPM_AUX_INPUTS][AUX_EXTRACTOR_STACK];
+static StaticTask_t auxExtractorTcb[PPM_AUX_INPUTS];
+static TaskHandle_t auxExtractorTaskHandle[PPM_AUX_INPUTS];
+#endif
+
+// statically allocated LED blink timer
+static StaticTimer_t ledTimerBuffer;
+static TimerHandle_t ledTimer = NULL;
+
+// channel noise thresholds & change detection (see NoiseEstimator.ino)
+static NoiseEstimator noiseEstimator;
+
 // the Gamepad BLE implementation for this particular sketch
 static JRGamepad gamepad;
 
 
+// ----- Memory report
+
+void _printTaskStack (const char *name, TaskHandle_t handle, uint32_t size) {
+  if (handle)
+    Serial.printf ("  %-22s %5u bytes, %5u never used\n", name, size, uxTaskGetStackHighWaterMark (handle));
+}
+
+void printMemoryReport() {
+  Serial.printf ("Heap: %u bytes free of %u (minimum %u), largest block %u\n",
+                 ESP.getFreeHeap(), ESP.getHeapSize(), ESP.getMinFreeHeap(), ESP.getMaxAllocHeap());
+  if (gamepad.beginMicros)                   // ...once begin() has returned
+    Serial.printf ("Bluetooth stack (%s): initialized in %u ms, taking %d bytes of heap\n",
+                   gamepad.transportName(), gamepad.beginMicros / 1000, gamepad.beginHeap);
+  Serial.printf ("Static task stacks: %u bytes\n",
+                 CHANNEL_EXTRACTOR_STACK + NOISE_ESTIMATOR_STACK + GAMEPAD_REFRESH_STACK + PPM_AUX_INPUTS * AUX_EXTRACTOR_STACK);
+  _printTaskStack ("channelExtractorTask", channelExtractorTaskHandle, CHANNEL_EXTRACTOR_STACK);
+#if PPM_AUX_INPUTS
+  for (int i = 0; i < PPM_AUX_INPUTS; i++)
+    _printTaskStack ("auxExtractorTask", auxExtractorTaskHandle[i], AUX_EXTRACTOR_STACK);
+#endif
+  _printTaskStack ("noiseEstimatorTask", noiseEstimatorTaskHandle, NOISE_ESTIMATOR_STACK);
+  _printTaskStack ("gamepadRefreshTask", gamepadRefreshTaskHandle, GAMEPAD_REFRESH_STACK);
+}
+
+
+#if BLE_RESTART_CHECK
+
+void _checkRestart() {
+  for (int cycle = 1; cycle <= 2; cycle++) {
+    gamepad.begin (SINGLE_16BIT);
+    int32_t beginHeap = gamepad.beginHeap;
+    gamepad.end();
+    Serial.printf ("Bluetooth restart check (%s), cycle %d: begin() took %d bytes of heap, end() released all but %d\n",
+                   gamepad.transportName(), cycle, beginHeap, gamepad.endHeap);
+  }
+  Serial.println (gamepad.endHeap > 0 ? "Bluetooth restart check: the second cycle LEAKED" : "Bluetooth restart check: ok");
+}
+
+#endif
+
+
 // ----- Arduino setup
 
 void setup() {
   // use the lowest CPU frequency we can get away with, to reduce power consumption
   setCpuFrequencyMhz (80);  // ...80 MHz is the minimum for Bluetooth
+  pipelineStats.begin();
   Serial.begin (115200);
   Serial.println (" ");
   Serial.println ("========================================================");
@@ -193,27 +508,107 @@ void setup() {
     digitalWrite (unusedOutput[i], LOW);
   }
 
+#if BLE_RESTART_CHECK
+  _checkRestart();
+  vTaskSuspend (NULL);
+#endif
+
+  loadCalibration();
+
+  gamepad.diagnostics = DIAGNOSTICS;
+  gamepad.connectionIntervalRequest = BLE_CONNECTION_INTERVAL;
+  gamepad.axisBits = AXIS_BITS;
+
+  // with the last session's profile, Bluetooth starts while waiting for the PPM signal
+  if (loadProfile()) {
+    axisCount = profileAxisCount;
+    restoreNoiseEstimate (profileThresholds);
+    startGamepadRefreshTask();
+  }
+
   // start the ChannelExtractor task
-  xTaskCreate (channelExtractorTask, "channelExtractorTask", 1024, NULL, 1, NULL);
+  channelExtractorTaskHandle = xTaskCreateStaticPinnedToCore (channelExtractorTask, "channelExtractorTask", CHANNEL_EXTRACTOR_STACK,
+                                                              NULL, CHANNEL_EXTRACTOR_PRIORITY, channelExtractorStack,
+                                                              &channelExtractorTcb, CHANNEL_EXTRACTOR_CORE);
+#if PPM_AUX_INPUTS
+  startAuxExtractorTasks();
+#endif
+
+#if POWER_SAVE && CONFIG_PM_ENABLE
+  // let the ESP32 light-sleep whenever all tasks are idle, and no driver holds a power
+  // management lock (the RMT driver holds one while receiving)
+  esp_pm_config_esp32_t pmConfig;
+  pmConfig.max_freq_mhz = 80;
+  pmConfig.min_freq_mhz = 80;
+  pmConfig.light_sleep_enable = true;
+  esp_pm_configure (&pmConfig);
+#endif
+
+  // start blinking the LED
+  ledTimer = xTimerCreateStatic ("ledTimer", LED_TIMER_MILLIS / portTICK_PERIOD_MS, pdTRUE, NULL,
+                                 ledTimerCallback, &ledTimerBuffer);
+  xTimerStart (ledTimer, 0);
+
+  if (! CAPTURE_RMT_FRAMES)
+    printMemoryReport();
+}
+
+
+// ----- LED blink timer
+
+// Blink the ESP32 onboard LED on error conditions. The callback runs in the FreeRTOS timer
+// task every LED_TIMER_MILLIS milliseconds, instead of keeping the loop() busy.
+
+void ledTimerCallback (TimerHandle_t timer) {
+  static uint32_t ticks = 0;
+  ticks++;
+
+  bool steady = false;
+  if (missingFrames > 0)                      // no PPM signal ?
+    digitalWrite (LED_PIN, ticks & 1);        // blink fast (5Hz)
+  else if (! gamepad.connected)               // no BLE Gamepad connection ?
+    digitalWrite (LED_PIN, (ticks / 5) & 1);  // blink slowly (1Hz)
+  else {
+    digitalWrite (LED_PIN, HIGH);
+    steady = true;
+  }
+
+#if POWER_SAVE
+  // while the LED is steady, only check once per second whether it has to blink
+  TickType_t period = (steady ? LED_STEADY_MILLIS : LED_TIMER_MILLIS) / portTICK_PERIOD_MS;
+  if (xTimerGetPeriod (timer) != period)
+    xTimerChangePeriod (timer, period, 0);
+#endif
 }
 
 
 // ----- Arduino loop
 
 void loop() {
-  
-  // blink the ESP32 onboard LED on error conditions
-  
-  if (missingFrames > 0) {                    // no PPM signal ?
-    // blink fast (5Hz)
-    digitalWrite (LED_PIN, LOW); delay (100);
-    digitalWrite (LED_PIN, HIGH);    
+
+#if DIAGNOSTICS
+  // dump the pipeline statistics
+  static uint32_t lastDiagnostics = 0;
+  if (millis() - lastDiagnostics > DIAGNOSTICS_INTERVAL_MILLIS) {
+    lastDiagnostics = millis();
+    pipelineStats.print (Serial);
+    printMemoryReport();
+    gamepad.updateDiagnostics();
   }
-  else if (! gamepad.connected) {            // no BLE Gamepad connection ?
-    // blink slowly (1Hz)
-    digitalWrite (LED_PIN, LOW); delay (500);
-    digitalWrite (LED_PIN, HIGH); delay (400);    
+#endif
+
+  // report the startup time & the memory usage once, after the first HID notification
+  static bool memoryReported = false;
+  if (! memoryReported && pipelineStats.firstNotifyMicros && ! CAPTURE_RMT_FRAMES) {
+    memoryReported = true;
+    Serial.printf ("First HID notification %u ms after boot (%s)\n", pipelineStats.firstNotifyMicros / 1000,
+                   profileAxisCount ? "startup profile" : "no startup profile");
+    printMemoryReport();
   }
-  
-  delay (100);
+
+  // serial commands of the calibration pass
+  bool calibrating = pollCalibration();
+
+  // in power save mode, the calibration pass is the only reason to poll often
+  pipelineStats.taskDelay (TASK_LOOP, POWER_SAVE && ! calibrating ? 1000 : 100);
 }
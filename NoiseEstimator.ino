@@ -1,142 +1,155 @@
  /*
    --------- NoiseEstimator task
-  
+
    We only want to perform a gamepad refresh when the channel values change as the result of
    user input, not as a result of channel background noise!
-  
-   Therefore the channel noise is sampled during the first second after PPM signal detection
-   and a noise threshold is computed as follows:
-  
-    - The lowest (_min) and highest (_max) value of every channel is sampled for 1 second
-    - Then the difference (_diff) between the _min and _max channel values is computed
-    - The noise threshold value is calculated by taking either the median difference or
-      the maximum difference, depending on the measured noise amplitude:
-      
-      The maximum difference is suitable for PPM signals with little, low-amplitude noise
-      that is undetectable in an 8-bit signal.
-      The median difference is best for noisier PPM signals that feature irregular,
-      high-amplitude noise peaks that would appear in an 8-bit signal.
-  
+
+   As the noise differs between channels (gimbals vs switches) and drifts with temperature
+   and battery voltage, a noise threshold is maintained for every channel by the core's
+   NoiseEstimator (see GamepadCore.cpp):
+
+    - The lowest and highest value of every channel is sampled during the first second
+      after PPM signal detection. Their difference, scaled by NOISE_SCALE, is the channel's
+      initial noise threshold.
+    - Afterwards, the NoiseEstimator task keeps tracking every channel: the channel's noise
+      threshold follows the standard deviation of the channel value while at rest. It tells
+      the stick movements apart by itself, also while there is no Bluetooth connection, so
+      that they don't inflate the thresholds that get saved to the startup profile.
+
    The changeDetected() function, which is invoked by the GamepadRefresh task, compares
-   the current channel values with the previous reference channel values (_ref), and returns
-   true if the difference exceeds the noise threshold.
+   the current channel values with the previous reference channel values, and returns
+   true if the difference exceeds the channel's noise threshold.
+
+   As the tracking and the change detection run on different tasks, both access the
+   NoiseEstimator within the noiseMux critical section, and the other tasks read the noise
+   thresholds through copyNoiseThresholds().
+
+   A hysteresis prevents small stick movements from being swallowed: once a channel has
+   moved, it is compared against its noise threshold divided by NOISE_HYSTERESIS, until it
+   has been at rest for NOISE_HOLD_MILLIS milliseconds.
+
+   With a startup profile (see Profile.ino), the initial noise thresholds are those of the
+   last session, and the sampling is skipped.
 */
 
-uint32_t _min[PPM_MAX_CHANNELS];   // lowest sampled channel values
-uint32_t _max[PPM_MAX_CHANNELS];   // highest sampled channel values
-uint32_t _diff[PPM_MAX_CHANNELS];  // their difference
-uint32_t _ref[PPM_MAX_CHANNELS];   // reference channel values
+// Save the refined noise thresholds to the startup profile after this many milliseconds
+#define NOISE_PROFILE_SAVE_MILLIS 60000
 
-uint32_t _noiseThreshold;          // the computed noise threshold
+// guards the NoiseEstimator's state: update() runs on this task, while changeDetected() runs on
+// the GamepadRefresh task, and both use the noise thresholds and the channels' movement state
+static portMUX_TYPE noiseMux = portMUX_INITIALIZER_UNLOCKED;
 
 
-// Comparator for the C-language's qsort function (We must sort the _diff array
-// in order to find the median value)
+// Use the noise thresholds of the startup profile, instead of sampling them
 
-int _cmpfunc (const void * a, const void * b) {
-   return ( *(uint32_t*)a - *(uint32_t*)b );
+void restoreNoiseEstimate (uint32_t thresholds[]) {
+  noiseEstimator.begin (axisCount, (PPM_PULSE_CENTER - PPM_PULSE_DELTA) * RMT_TICK_US,
+                        (PPM_PULSE_CENTER + PPM_PULSE_DELTA) * RMT_TICK_US,
+                        NOISE_SCALE, NOISE_HYSTERESIS, NOISE_HOLD_MILLIS);
+  noiseEstimator.restore (thresholds);
+  noiseEstimated = true;
 }
 
 
 void noiseEstimatorTask (void *pvParameter) {
+  uint32_t channels[FRAME_VALUES];
+  uint32_t frame[PPM_MAX_CHANNELS];
+  uint32_t frameChannels;
 
-  // 1. Initialize data structures
+  // the initial noise thresholds are only sampled without a startup profile
+  if (! noiseEstimated) {
 
-  DEBUG_PRINTLN ("");
-  DEBUG_PRINTLN ("2. NoiseEstimator: sampling noise...");
-  
-  for (int i = 0; i < axisCount; i++) {
-    _min[i] = (PPM_PULSE_CENTER + PPM_PULSE_DELTA) * RMT_TICK_US;
-    _max[i] = (PPM_PULSE_CENTER - PPM_PULSE_DELTA) * RMT_TICK_US;
-    _ref[i] = _diff[i] = 0;
-  }
+    // 1. Initialize data structures
+
+    DEBUG_PRINTLN ("");
+    DEBUG_PRINTLN ("2. NoiseEstimator: sampling noise...");
+
+    noiseEstimator.begin (axisCount, (PPM_PULSE_CENTER - PPM_PULSE_DELTA) * RMT_TICK_US,
+                          (PPM_PULSE_CENTER + PPM_PULSE_DELTA) * RMT_TICK_US,
+                          NOISE_SCALE, NOISE_HYSTERESIS, NOISE_HOLD_MILLIS);
+
+
+    // 2. Sample noise during 1 second
+
+    // iterate 100 times with a 10 millisecond pause between each iteration
+    for (int l = 0; l < 100; l++) {
+      //DEBUG_PRINT ("*");
+      readFrame (channels, &frameChannels, NULL);
+      frameAxes (channels, frame);
+
+      noiseEstimator.sample (frame);
+      pipelineStats.taskDelay (TASK_NOISE_ESTIMATOR, 10);
+    }
 
-    
-  // 2. Sample noise during 1 second
 
-  // iterate 100 times with a 10 millisecond pause between each iteration
-  for (int l = 0; l < 100; l++) {
-    //DEBUG_PRINT ("*");
+    // 3. Finished sampling: Compute the initial noise thresholds
 
-    // remember the minimum and maximum value of every channel
+    noiseEstimator.finishSampling();
+
+    DEBUG_PRINT ("   Noise thresholds : ");
     for (int i = 0; i < axisCount; i++) {
-      if (channelValues[i] < _min[i])
-        _min[i] = channelValues[i];
-      if (channelValues[i] > _max[i])
-        _max[i] = channelValues[i];
+      DEBUG_PRINT (noiseEstimator.threshold[i]);
+      DEBUG_PRINT (" ");
     }
-    vTaskDelay (10 / portTICK_PERIOD_MS);
+    DEBUG_PRINTLN();
+    noiseEstimated = true;
+
+    // initialize gamepad
+    startGamepadRefreshTask();
   }
 
 
-  // 3. Finished sampling: Compute the noise threshold
+  // 4. Keep tracking the channel noise
 
-  // calculate the differences between the min and max channel values
-  for (int i = 0; i < axisCount; i++)
-    _diff[i] = _max[i] - _min[i];
-  
-  // ...sort them
-  qsort (_diff, axisCount, sizeof(uint32_t), _cmpfunc);
-  
-  DEBUG_PRINT ("   Diff : ");
-  for (int i = 0; i < axisCount; i++) {
-    DEBUG_PRINT (_diff[i]);
-    DEBUG_PRINT (" ");
-  }
-  DEBUG_PRINTLN();
-
-  // maximum measured noise amplitude
-  uint32_t maxNoiseAmplitude = _diff[axisCount - 1];
-
-  // if there is a lot of noise (maximum noise amplitude is detectable at 8-bit resolution)
-  // then use the median difference as the noise threshold value, otherwise use the maxNoise value:
-  
-  if (maxNoiseAmplitude > (RMT_TICK_US * 1000 / 256)) {
-    
-    // use the median noise difference (very noisy/unstable PPM signal)
-    DEBUG_PRINT ("   Noise threshold (median) = ");
-
-    _noiseThreshold = (axisCount & 0x00000001) == 1  // even or odd number of channels ?
-      ? _diff[axisCount / 2]
-      : (_diff[axisCount / 2 - 1] + _diff[axisCount / 2]) / 2;
-  }
-  else {
-    
-    // use the max noise measurement (stable PPM signal with little noise)
-    DEBUG_PRINT ("   Noise threshold (max) = ");
-    _noiseThreshold = maxNoiseAmplitude * NOISE_SCALE;
-  }
-  DEBUG_PRINTLN (_noiseThreshold);
-  noiseEstimated = true;
+  uint32_t lastFrame = readFrame (channels, &frameChannels, NULL);
+  uint32_t start = millis();
+  bool saved = false;
+  while (true) {
+    uint32_t frameNumber = readFrame (channels, &frameChannels, NULL);
+    if (frameNumber != lastFrame) {
+      frameAxes (channels, frame);
+      portENTER_CRITICAL (&noiseMux);
+      noiseEstimator.update (frame, pdTICKS_TO_MS (xTaskGetTickCount()));
+      portEXIT_CRITICAL (&noiseMux);
+      lastFrame = frameNumber;
+    }
 
-  // initialize gamepad
-  xTaskCreate (gamepadRefreshTask, "gamepadRefreshTask", 65536, NULL, 1, NULL);
+    // store the refined noise thresholds for the next boot, once (this task is their only writer)
+    if (! saved && millis() - start > NOISE_PROFILE_SAVE_MILLIS) {
+      saved = true;
+      saveNoiseProfile (noiseEstimator.threshold);
+    }
 
-  // terminate the NoiseEstimator task
-  vTaskDelete (NULL);
+#if POWER_SAVE
+    // wait for the ChannelExtractor's next PPM frame, instead of polling
+    pipelineStats.taskSleep (TASK_NOISE_ESTIMATOR);
+    ulTaskNotifyTake (pdTRUE, portMAX_DELAY);
+    pipelineStats.taskWake (TASK_NOISE_ESTIMATOR);
+#else
+    pipelineStats.taskDelay (TASK_NOISE_ESTIMATOR, 10);
+#endif
+  }
 }
 
 
 // Detect if channel value changes have resulted from user input by comparing the
-// difference of the current channel values with the last reference values,
-// against the noise threshold.
-
-bool changeDetected() {
-
-  // check each channel value against the noise threshold
-  for (int i = 0; i < axisCount; i++) {
-    uint32_t difference = channelValues[i] > _ref[i]
-      ? channelValues[i] - _ref[i]
-      : _ref[i] - channelValues[i];
-    
-    if (difference > _noiseThreshold) {
-      
-      // set the current channel values as the new reference values
-      for (i = 0; i < axisCount; i++)
-        _ref[i] = channelValues[i];
-                   
-      return true;
-    }
-  }
-  return false;
+// difference of the given frame's channel values with the last reference values,
+// against the channel noise thresholds.
+
+bool changeDetected (uint32_t frame[]) {
+  uint32_t now = pdTICKS_TO_MS (xTaskGetTickCount());
+  portENTER_CRITICAL (&noiseMux);
+  bool changed = noiseEstimator.changeDetected (frame, now);
+  portEXIT_CRITICAL (&noiseMux);
+  return changed;
+}
+
+
+// Copy the current noise thresholds, for the other tasks
+
+void copyNoiseThresholds (uint32_t thresholds[]) {
+  portENTER_CRITICAL (&noiseMux);
+  for (int i = 0; i < PPM_MAX_CHANNELS; i++)
+    thresholds[i] = noiseEstimator.threshold[i];
+  portEXIT_CRITICAL (&noiseMux);
 }
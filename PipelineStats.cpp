@@ -0,0 +1,232 @@
+#include "Arduino.h"
+#include "PipelineStats.h"
+
+PipelineStats pipelineStats;
+
+static const char _stageName [PIPELINE_STAGES][12] =
+{
+  "receive",
+  "convert",
+  "change",
+  "notify",
+  "end-to-end"
+};
+
+static const char _taskName [PIPELINE_TASKS][12] =
+{
+  "extractor",
+  "noise",
+  "refresh",
+  "loop"
+};
+
+
+// Add a sample to the histogram
+
+void PipelineHistogram::add (uint32_t micros)
+{
+  uint32_t bucket = micros ? 32 - __builtin_clz (micros) : 0;
+  if (bucket >= PIPELINE_HISTOGRAM_BUCKETS)
+    bucket = PIPELINE_HISTOGRAM_BUCKETS - 1;
+
+  this->buckets[bucket]++;
+  this->count++;
+  this->sum += micros;
+  if (micros > this->max)
+    this->max = micros;
+}
+
+
+// Return the upper bound of the bucket containing the given percentile
+
+uint32_t PipelineHistogram::percentile (uint32_t percent)
+{
+  uint32_t threshold = (uint64_t) this->count * percent / 100;
+  uint32_t total = 0;
+
+  for (uint32_t b = 0; b < PIPELINE_HISTOGRAM_BUCKETS - 1; b++) {
+    total += this->buckets[b];
+    if (total > threshold)
+      return (1UL << b) - 1;
+  }
+  return this->max;
+}
+
+
+// Constructor
+
+PipelineStats::PipelineStats () : cpuMhz(80), startMillis(0)
+{
+  memset (this->latency, 0, sizeof (this->latency));
+  memset (this->tasks, 0, sizeof (this->tasks));
+  this->framesReceived = this->framesMissed = this->framesDropped = this->framesOverrun = 0;
+  this->framesRejected = this->framesBridged = this->glitchesHeld = 0;
+  this->firstNotifyMicros = 0;
+  this->congestions = this->notifyErrors = this->refreshRate = 0;
+  this->reportsStale = this->queueDepth = 0;
+  this->reportsSent = this->reportsSuppressed = this->reportsUnchanged = 0;
+}
+
+
+void PipelineStats::begin (void)
+{
+  this->cpuMhz = getCpuFrequencyMhz();
+  this->startMillis = millis();
+}
+
+
+void PipelineStats::addCycles (PipelineStage stage, uint32_t cycles)
+{
+  this->latency[stage].add (cycles / this->cpuMhz);
+}
+
+
+void PipelineStats::addMicros (PipelineStage stage, uint32_t micros)
+{
+  this->latency[stage].add (micros);
+}
+
+
+void PipelineStats::taskWake (PipelineTask task)
+{
+  TaskSchedule *t = &this->tasks[task];
+  uint32_t now = micros();
+  uint32_t due = t->due;
+
+  if (due && (int32_t) (now - due) > 0 && now - due > t->maxLatency)
+    t->maxLatency = now - due;
+  t->due = 0;
+  t->wakeTime = now;
+  t->wakeups++;
+}
+
+
+void PipelineStats::taskSleep (PipelineTask task)
+{
+  TaskSchedule *t = &this->tasks[task];
+  if (t->wakeups)
+    t->busyMicros += micros() - t->wakeTime;
+}
+
+
+void PipelineStats::taskNotify (PipelineTask task)
+{
+  if (! this->tasks[task].due)
+    this->tasks[task].due = micros();
+}
+
+
+void PipelineStats::taskDelay (PipelineTask task, uint32_t millis)
+{
+  this->taskSleep (task);
+  this->tasks[task].due = micros() + millis * 1000;
+  vTaskDelay (millis / portTICK_PERIOD_MS);
+  this->taskWake (task);
+}
+
+
+// Serialize the statistics into a compact little-endian binary record:
+//
+//  - version (7), number of stages, number of histogram buckets, reserved (1 byte each)
+//  - uptime (ms), frames received, frames missed, frames dropped, frames overrun, reports
+//    sent, reports suppressed, reports unchanged, frames rejected, frames bridged, glitches
+//    held, the time from boot to the first notification in us, congestion events, failed
+//    notifications, the current refresh rate, stale reports and the queue depth (4 bytes each)
+//  - for every stage: count, sum and max (4 bytes each), followed by the histogram
+//    buckets (2 bytes each, saturated)
+//  - for every task (extractor, noise, refresh, loop): busy time (ms), wakeups and worst
+//    wakeup latency (us) (4 bytes each)
+
+static uint8_t* _put32 (uint8_t *p, uint32_t value)
+{
+  *p++ = value; *p++ = value >> 8; *p++ = value >> 16; *p++ = value >> 24;
+  return p;
+}
+
+size_t PipelineStats::serialize (uint8_t *buffer)
+{
+  uint8_t *p = buffer;
+
+  *p++ = 7;
+  *p++ = PIPELINE_STAGES;
+  *p++ = PIPELINE_HISTOGRAM_BUCKETS;
+  *p++ = 0;
+
+  p = _put32 (p, millis() - this->startMillis);
+  p = _put32 (p, this->framesReceived);
+  p = _put32 (p, this->framesMissed);
+  p = _put32 (p, this->framesDropped);
+  p = _put32 (p, this->framesOverrun);
+  p = _put32 (p, this->reportsSent);
+  p = _put32 (p, this->reportsSuppressed);
+  p = _put32 (p, this->reportsUnchanged);
+  p = _put32 (p, this->framesRejected);
+  p = _put32 (p, this->framesBridged);
+  p = _put32 (p, this->glitchesHeld);
+  p = _put32 (p, this->firstNotifyMicros);
+  p = _put32 (p, this->congestions);
+  p = _put32 (p, this->notifyErrors);
+  p = _put32 (p, this->refreshRate);
+  p = _put32 (p, this->reportsStale);
+  p = _put32 (p, this->queueDepth);
+
+  for (uint32_t s = 0; s < PIPELINE_STAGES; s++) {
+    PipelineHistogram *h = &this->latency[s];
+    p = _put32 (p, h->count);
+    p = _put32 (p, h->sum);
+    p = _put32 (p, h->max);
+    for (uint32_t b = 0; b < PIPELINE_HISTOGRAM_BUCKETS; b++) {
+      uint32_t value = h->buckets[b] > 0xFFFF ? 0xFFFF : h->buckets[b];
+      *p++ = value; *p++ = value >> 8;
+    }
+  }
+
+  for (uint32_t t = 0; t < PIPELINE_TASKS; t++) {
+    p = _put32 (p, this->tasks[t].busyMicros / 1000);
+    p = _put32 (p, this->tasks[t].wakeups);
+    p = _put32 (p, this->tasks[t].maxLatency);
+  }
+  return p - buffer;
+}
+
+
+// Print a compact summary
+
+void PipelineStats::print (Print &out)
+{
+  uint32_t seconds = (millis() - this->startMillis) / 1000;
+
+  out.printf ("frames %u missed %u dropped %u overrun %u | reports %u (%u/s) suppressed %u unchanged %u\n",
+              this->framesReceived, this->framesMissed, this->framesDropped, this->framesOverrun,
+              this->reportsSent, seconds ? this->reportsSent / seconds : 0,
+              this->reportsSuppressed, this->reportsUnchanged);
+  out.printf ("rejected %u bridged %u glitches held %u | first notify %u ms after boot\n",
+              this->framesRejected, this->framesBridged, this->glitchesHeld, this->firstNotifyMicros / 1000);
+  out.printf ("refresh rate %u Hz | congestions %u notify errors %u | queued %u stale %u\n",
+              this->refreshRate, this->congestions, this->notifyErrors, this->queueDepth, this->reportsStale);
+
+  for (uint32_t s = 0; s < PIPELINE_STAGES; s++) {
+    PipelineHistogram *h = &this->latency[s];
+    out.printf ("  %-10s n=%u avg=%u p50<=%u p99<=%u max=%u us\n",
+                _stageName[s], h->count, h->count ? h->sum / h->count : 0,
+                h->percentile (50), h->percentile (99), h->max);
+  }
+
+  // CPU share in hundredths of a percent, and busy time per received PPM frame
+  uint32_t uptime = millis() - this->startMillis;
+  uint32_t frames = this->framesReceived;
+  uint64_t totalMicros = 0;
+  uint32_t totalWakeups = 0;
+  for (uint32_t t = 0; t < PIPELINE_TASKS; t++) {
+    TaskSchedule *task = &this->tasks[t];
+    uint32_t share = uptime ? task->busyMicros * 10 / uptime : 0;
+    out.printf ("  %-10s cpu %u.%02u%% %u us/frame wakeups %u (%u/s) worst latency %u us\n",
+                _taskName[t], share / 100, share % 100, frames ? (uint32_t) (task->busyMicros / frames) : 0,
+                task->wakeups, seconds ? task->wakeups / seconds : 0, task->maxLatency);
+    totalMicros += task->busyMicros;
+    totalWakeups += task->wakeups;
+  }
+  uint32_t share = uptime ? totalMicros * 10 / uptime : 0;
+  out.printf ("  %-10s cpu %u.%02u%% %u us/frame wakeups %u/s\n", "total", share / 100, share % 100,
+              frames ? (uint32_t) (totalMicros / frames) : 0, seconds ? totalWakeups / seconds : 0);
+}
@@ -0,0 +1,115 @@
+// The PipelineStats class collects latency histograms and throughput counters of the
+// PPM-to-HID pipeline, so that end-to-end latency can be measured in the field without
+// a logic analyzer.
+//
+// Stage durations are measured with the CPU cycle counter. As the cycle counters of the
+// two ESP32 cores are not synchronized, the end-to-end latency (from the reception of a
+// PPM frame to the completion of the HID notification) is measured in microseconds.
+
+#ifndef PIPELINESTATS_H
+#define PIPELINESTATS_H
+
+#include "Arduino.h"
+
+// Latency histogram: bucket 0 counts 0 us, bucket n counts 2^(n-1) to 2^n - 1 us, and the
+// last bucket counts everything above
+#define PIPELINE_HISTOGRAM_BUCKETS 16
+
+// Size of the serialized statistics, see serialize()
+#define PIPELINE_STATS_SIZE (4 + 17 * 4 + PIPELINE_STAGES * (3 * 4 + PIPELINE_HISTOGRAM_BUCKETS * 2) + PIPELINE_TASKS * 3 * 4)
+
+// Pipeline stages
+enum PipelineStage {
+  STAGE_RECEIVE,      // ChannelExtractor: PPM frame decoding & publishing
+  STAGE_CONVERT,      // GamepadRefresh: channel value to axis value conversion
+  STAGE_CHANGE,       // GamepadRefresh: changeDetected()
+  STAGE_NOTIFY,       // JRGamepad: setValue() & notify()
+  STAGE_END_TO_END,   // PPM frame reception to notification completion
+  PIPELINE_STAGES
+};
+
+
+// Pipeline tasks
+enum PipelineTask {
+  TASK_CHANNEL_EXTRACTOR,
+  TASK_NOISE_ESTIMATOR,
+  TASK_GAMEPAD_REFRESH,
+  TASK_LOOP,          // Arduino loop(): diagnostics & serial commands
+  PIPELINE_TASKS
+};
+
+
+struct PipelineHistogram {
+  uint32_t count;     // number of samples
+  uint32_t sum;       // sum of the samples (us)
+  uint32_t max;       // largest sample (us)
+  uint32_t buckets[PIPELINE_HISTOGRAM_BUCKETS];
+
+  void add (uint32_t micros);
+  uint32_t percentile (uint32_t percent);     // upper bound of the percentile's bucket (us)
+};
+
+
+// Scheduling statistics of a task: the time between a task's wakeup and its next wait is
+// accounted as busy time, and the delay between the moment a wakeup was due (the end of a
+// vTaskDelay, or a task notification) and the actual wakeup is the wakeup latency.
+// Note that vTaskDelay has a 1 tick (1 ms) granularity.
+//
+// The busy time per received PPM frame is the duty cycle profile of the pipeline: along with
+// the number of wakeups, it shows how long the CPU can idle (or sleep) between the frames.
+struct TaskSchedule {
+  uint64_t busyMicros;          // time spent running (us)
+  uint32_t wakeups;             // number of wakeups
+  uint32_t maxLatency;          // worst wakeup latency (us)
+  uint32_t wakeTime;            // time of the last wakeup (us)
+  volatile uint32_t due;        // time the next wakeup is due (us), 0 if unknown
+};
+
+
+class PipelineStats {
+
+  private:
+    uint32_t cpuMhz;
+    uint32_t startMillis;
+
+  public:
+    PipelineHistogram latency[PIPELINE_STAGES];
+    TaskSchedule tasks[PIPELINE_TASKS];
+
+    volatile uint32_t framesReceived;     // PPM frames decoded by the ChannelExtractor
+    volatile uint32_t framesMissed;       // PPM frame timeouts
+    volatile uint32_t framesDropped;      // PPM frames skipped for a newer frame, when the ChannelExtractor fell behind
+    volatile uint32_t framesOverrun;      // PPM frames truncated by the RMT memory, or lost to a full ring buffer
+    volatile uint32_t framesRejected;     // PPM frames failing the validation (channel count, pulse bounds, frame length)
+    volatile uint32_t framesBridged;      // rejected PPM frames replaced by an extrapolation of the previous frames
+    volatile uint32_t glitchesHeld;       // channel jumps exceeding the slew limit, held until confirmed by the next frame
+    volatile uint32_t firstNotifyMicros;  // startup time: from boot to the first HID report notification (0 until then)
+    volatile uint32_t reportsSent;        // HID report notifications
+    volatile uint32_t reportsSuppressed;  // new PPM frames not sent, as no change exceeded the noise threshold
+    volatile uint32_t reportsUnchanged;   // HID reports not sent, as their bytes were unchanged
+    volatile uint32_t congestions;        // Bluetooth congestion events (notification buffers full)
+    volatile uint32_t notifyErrors;       // HID report notifications that failed
+    volatile uint32_t refreshRate;        // current refresh rate (Hz), set by the GamepadRefresh task
+    volatile uint32_t reportsStale;       // queued HID reports replaced by a newer one before they could be sent
+    volatile uint32_t queueDepth;         // HID reports held back by congestion, after the last flush
+
+    PipelineStats();
+
+    void begin (void);                    // call after setting the CPU frequency
+    void addCycles (PipelineStage stage, uint32_t cycles);
+    void addMicros (PipelineStage stage, uint32_t micros);
+
+    void taskWake (PipelineTask task);    // call when the task resumes running
+    void taskSleep (PipelineTask task);   // call before the task waits
+    void taskNotify (PipelineTask task);  // call before notifying the task
+    void taskDelay (PipelineTask task, uint32_t millis);  // vTaskDelay, accounted for
+
+    size_t serialize (uint8_t *buffer);   // buffer must hold PIPELINE_STATS_SIZE bytes
+    void print (Print &out);
+
+    static inline uint32_t cycles (void) { return ESP.getCycleCount(); }
+};
+
+extern PipelineStats pipelineStats;
+
+#endif // PIPELINESTATS_H
@@ -0,0 +1,82 @@
+/*
+   --------- Startup profile
+
+   The number of axes, the gamepad mode and the channel noise thresholds of the last session
+   are stored in the ESP32's non-volatile storage (NVS). On the next boot, they allow the
+   GamepadRefresh task to bring up Bluetooth while the ChannelExtractor is still waiting for
+   the PPM signal, and the NoiseEstimator to skip its initial 1 second sampling.
+
+   If the PPM signal doesn't match the profile (different number of channels, or a different
+   gamepad mode selected by the refresh rate channel), the profile is cleared and the board
+   restarts, as the HID report map can't be changed once Bluetooth advertising has started.
+*/
+
+#define PROFILE_NAMESPACE "jrgamepad"
+#define PROFILE_VERSION   1
+
+// The noise thresholds are stored in RMT ticks: a profile stored with a different tick rate
+// (see RMT_HIGH_RESOLUTION) is ignored
+
+static Preferences _profile;
+
+
+// Load the profile, returns true if a valid profile was found
+
+bool loadProfile() {
+  if (! PERSIST_PROFILE || ! _profile.begin (PROFILE_NAMESPACE, true))
+    return false;
+
+  uint32_t axes = _profile.getUInt ("axes", 0);
+  if (_profile.getUInt ("version", 0) == PROFILE_VERSION
+      && _profile.getUInt ("ticks", 0) == RMT_TICK_US
+      && axes >= PPM_MIN_CHANNELS && axes <= GAMEPAD_MAX_AXES
+      && _profile.getBytes ("noise", profileThresholds, sizeof (profileThresholds)) == sizeof (profileThresholds)) {
+    profileAxisCount = axes;
+    profileMode = _profile.getUInt ("mode", 0);
+  }
+  _profile.end();
+
+  DEBUG_PRINT ("   Startup profile: "); DEBUG_PRINTLN (profileAxisCount ? "loaded" : "none");
+  return profileAxisCount != 0;
+}
+
+
+// Store the current number of axes, the gamepad mode and the noise thresholds
+
+void saveProfile (uint32_t mode, uint32_t thresholds[]) {
+  if (! PERSIST_PROFILE || ! _profile.begin (PROFILE_NAMESPACE, false))
+    return;
+
+  _profile.putUInt ("version", PROFILE_VERSION);
+  _profile.putUInt ("ticks", RMT_TICK_US);
+  _profile.putUInt ("axes", axisCount);
+  _profile.putUInt ("mode", mode);
+  _profile.putBytes ("noise", thresholds, PPM_MAX_CHANNELS * sizeof (uint32_t));
+  _profile.end();
+  profileMode = mode;
+}
+
+
+// Store refined noise thresholds, if a profile has been saved or loaded
+
+void saveNoiseProfile (uint32_t thresholds[]) {
+  if (! PERSIST_PROFILE || ! _profile.begin (PROFILE_NAMESPACE, false))
+    return;
+
+  if (_profile.getUInt ("axes", 0) == axisCount)
+    _profile.putBytes ("noise", thresholds, PPM_MAX_CHANNELS * sizeof (uint32_t));
+  _profile.end();
+}
+
+
+// Clear a profile that doesn't match the PPM signal, and restart
+
+void discardProfile() {
+  Serial.println ("Startup profile doesn't match the PPM signal: restarting...");
+  if (_profile.begin (PROFILE_NAMESPACE, false)) {
+    _profile.clear();
+    _profile.end();
+  }
+  delay (100);
+  ESP.restart();
+}
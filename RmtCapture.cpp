@@ -0,0 +1,83 @@
+#include "RmtCapture.h"
+
+
+static uint8_t _checksum (const uint8_t *data, size_t length)
+{
+  uint8_t checksum = 0;
+
+  while (length--)
+    checksum ^= *data++;
+  return checksum;
+}
+
+static uint8_t* _put32 (uint8_t *p, uint32_t value)
+{
+  *p++ = value; *p++ = value >> 8; *p++ = value >> 16; *p++ = value >> 24;
+  return p;
+}
+
+static uint32_t _get32 (const uint8_t *p)
+{
+  return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+size_t rmtCaptureEncode (uint8_t *buffer, const uint32_t items[], uint32_t count, uint32_t flags, uint32_t timestamp)
+{
+  uint8_t *p = buffer;
+
+  if (count > RMT_CAPTURE_MAX_ITEMS)
+    count = RMT_CAPTURE_MAX_ITEMS;
+
+  *p++ = RMT_CAPTURE_SYNC0;
+  *p++ = RMT_CAPTURE_SYNC1;
+  *p++ = count;
+  *p++ = flags;
+  p = _put32 (p, timestamp);
+  for (uint32_t i = 0; i < count; i++)
+    p = _put32 (p, items[i]);
+
+  *p = _checksum (buffer + 2, p - buffer - 2);
+  return p + 1 - buffer;
+}
+
+
+RmtCaptureDecoder::RmtCaptureDecoder () : length(0), count(0), flags(0), timestamp(0), errors(0)
+{
+}
+
+bool RmtCaptureDecoder::feed (uint8_t byte)
+{
+  // wait for the sync bytes
+  if ((this->length == 0 && byte != RMT_CAPTURE_SYNC0) ||
+      (this->length == 1 && byte != RMT_CAPTURE_SYNC1)) {
+    this->length = byte == RMT_CAPTURE_SYNC0 ? 1 : 0;
+    return false;
+  }
+
+  this->record[this->length++] = byte;
+  if (this->length < RMT_CAPTURE_HEADER)
+    return false;
+
+  uint32_t size = RMT_CAPTURE_HEADER + this->record[2] * 4 + 1;
+  if (this->record[2] > RMT_CAPTURE_MAX_ITEMS) {
+    this->length = 0;
+    this->errors++;
+    return false;
+  }
+  if (this->length < size)
+    return false;
+  this->length = 0;
+
+  if (_checksum (this->record + 2, size - 3) != this->record[size - 1]) {
+    this->errors++;
+    return false;
+  }
+
+  this->count = this->record[2];
+  this->flags = this->record[3];
+  this->timestamp = _get32 (this->record + 4);
+  for (uint32_t i = 0; i < this->count; i++)
+    this->items[i] = _get32 (this->record + RMT_CAPTURE_HEADER + i * 4);
+  return true;
+}
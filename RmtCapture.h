@@ -0,0 +1,55 @@
+// Binary capture format for the raw RMT frames received by the ChannelExtractor, so that
+// real PPM signals can be recorded over the serial port and replayed off-target.
+//
+// A capture is a stream of records, one per ring buffer item (or frame timeout):
+//
+//  - sync bytes 0xA5 0x5A
+//  - number of RMT items (1 byte, 0 for a frame timeout)
+//  - flags (1 byte, see RMT_CAPTURE_*)
+//  - reception time in microseconds (4 bytes)
+//  - RMT items as 32-bit words, as produced by the RMT driver (4 bytes each)
+//  - checksum: XOR of all the preceding record bytes except the sync bytes (1 byte)
+//
+// All values are little-endian. As the serial port may also carry text (the startup banner),
+// the decoder resynchronizes on the sync bytes and discards records with a bad checksum.
+
+#ifndef RMTCAPTURE_H
+#define RMTCAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RMT_CAPTURE_SYNC0      0xA5
+#define RMT_CAPTURE_SYNC1      0x5A
+#define RMT_CAPTURE_MAX_ITEMS  128
+#define RMT_CAPTURE_HEADER     8
+#define RMT_CAPTURE_MAX_RECORD (RMT_CAPTURE_HEADER + RMT_CAPTURE_MAX_ITEMS * 4 + 1)
+
+// Record flags
+#define RMT_CAPTURE_DROPPED    0x01     // the frame was skipped for a newer one by the ChannelExtractor
+#define RMT_CAPTURE_OVERRUN    0x02     // the ring buffer was nearly full when the frame was received
+
+
+// Encode a record into buffer (sized for RMT_CAPTURE_MAX_RECORD bytes), returns its size.
+// Item counts above RMT_CAPTURE_MAX_ITEMS are truncated.
+size_t rmtCaptureEncode (uint8_t *buffer, const uint32_t items[], uint32_t count, uint32_t flags, uint32_t timestamp);
+
+
+class RmtCaptureDecoder {
+
+  private:
+    uint8_t record[RMT_CAPTURE_MAX_RECORD];
+    uint32_t length;
+
+  public:
+    uint32_t items[RMT_CAPTURE_MAX_ITEMS];  // RMT items of the most recent record
+    uint32_t count;                         // number of items in the most recent record
+    uint32_t flags;                         // flags of the most recent record
+    uint32_t timestamp;                     // reception time of the most recent record (us)
+    uint32_t errors;                        // number of records discarded due to a bad checksum
+
+    RmtCaptureDecoder();
+    bool feed (uint8_t byte);               // returns true when a complete record has been decoded
+};
+
+#endif // RMTCAPTURE_H
@@ -0,0 +1,149 @@
+#include "SerialDecoders.h"
+
+
+// Unpack 16 11-bit channel values, packed least significant bit first
+
+static void _unpackChannels (const uint8_t *data, uint16_t channels[])
+{
+  uint32_t bits = 0;
+  uint32_t bitCount = 0;
+
+  for (uint32_t c = 0; c < RC_SERIAL_CHANNELS; c++) {
+    while (bitCount < 11) {
+      bits |= (uint32_t) *data++ << bitCount;
+      bitCount += 8;
+    }
+    channels[c] = bits & 0x07FF;
+    bits >>= 11;
+    bitCount -= 11;
+  }
+}
+
+
+// Drop the first byte of a rejected frame, and the following bytes up to the next possible
+// start of a frame. Returns the number of bytes kept.
+
+static uint32_t _resync (uint8_t frame[], uint32_t length, bool (*isStart) (uint8_t byte))
+{
+  uint32_t start = 1;
+  while (start < length && ! isStart (frame[start]))
+    start++;
+
+  for (uint32_t i = start; i < length; i++)
+    frame[i - start] = frame[i];
+  return length - start;
+}
+
+
+// ----- SBUS
+
+static bool _isSbusHeader (uint8_t byte)
+{
+  return byte == SBUS_HEADER;
+}
+
+SbusDecoder::SbusDecoder () : length(0), failsafe(false), errors(0)
+{
+  for (uint32_t c = 0; c < RC_SERIAL_CHANNELS; c++)
+    this->channels[c] = 992;
+}
+
+bool SbusDecoder::feed (uint8_t byte)
+{
+  // wait for the header byte
+  if (this->length == 0 && byte != SBUS_HEADER)
+    return false;
+
+  this->frame[this->length++] = byte;
+  if (this->length < SBUS_FRAME_SIZE)
+    return false;
+
+  // end byte: 0x00 for SBUS, 0x04 / 0x14 / 0x24 / 0x34 for SBUS2
+  if (byte != 0x00 && (byte & 0x0F) != 0x04) {
+    // the header was a channel data byte: resynchronize on the next header byte received so far,
+    // as a stream joined mid-frame would otherwise stay misaligned
+    this->errors++;
+    this->length = _resync (this->frame, this->length, _isSbusHeader);
+    return false;
+  }
+  this->length = 0;
+
+  _unpackChannels (&this->frame[1], this->channels);
+  this->failsafe = this->frame[23] & 0x08;
+  return true;
+}
+
+
+// ----- CRSF
+//
+// Frame layout: address, length (of the type, payload & CRC bytes), type, payload, CRC-8
+// (DVB-S2 polynomial 0xD5, computed over the type & payload bytes)
+
+static uint8_t _crc8 (const uint8_t *data, uint32_t length)
+{
+  uint8_t crc = 0;
+
+  while (length--) {
+    crc ^= *data++;
+    for (uint32_t b = 0; b < 8; b++)
+      crc = crc & 0x80 ? (crc << 1) ^ 0xD5 : crc << 1;
+  }
+  return crc;
+}
+
+CrsfDecoder::CrsfDecoder () : length(0), errors(0)
+{
+  for (uint32_t c = 0; c < RC_SERIAL_CHANNELS; c++)
+    this->channels[c] = 992;
+}
+
+// address byte: flight controller, radio transmitter or CRSF transmitter
+static bool _isCrsfAddress (uint8_t byte)
+{
+  return byte == 0xC8 || byte == 0xEA || byte == 0xEE;
+}
+
+bool CrsfDecoder::feed (uint8_t byte)
+{
+  // wait for an address byte
+  if (this->length == 0 && ! _isCrsfAddress (byte))
+    return false;
+
+  this->frame[this->length++] = byte;
+
+  // a rejected frame may hide the start of the next one: the bytes following its address are
+  // checked again (see _resync), until a frame is incomplete or valid
+  while (this->length >= 2) {
+    uint32_t frameLength = this->frame[1] + 2u;
+    if (frameLength < 4 || frameLength > CRSF_MAX_FRAME) {
+      this->errors++;
+      this->length = _resync (this->frame, this->length, _isCrsfAddress);
+      continue;
+    }
+    if (this->length < frameLength)
+      return false;
+
+    uint8_t *type = &this->frame[2];
+    uint32_t size = frameLength - 3;            // type & payload
+    if (_crc8 (type, size) != type[size]) {
+      this->errors++;
+      this->length = _resync (this->frame, this->length, _isCrsfAddress);
+      continue;
+    }
+
+    bool channels = *type == CRSF_TYPE_RC_CHANNELS_PACKED && size >= 1 + 22;
+    if (channels)
+      _unpackChannels (type + 1, this->channels);
+
+    // keep the bytes following the frame, if it was found by a resynchronization
+    for (uint32_t i = frameLength; i < this->length; i++)
+      this->frame[i - frameLength] = this->frame[i];
+    this->length -= frameLength;
+    if (this->length && ! _isCrsfAddress (this->frame[0]))
+      this->length = _resync (this->frame, this->length, _isCrsfAddress);
+
+    if (channels)
+      return true;
+  }
+  return false;
+}
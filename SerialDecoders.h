@@ -0,0 +1,60 @@
+// Incremental decoders for the SBUS and CRSF serial RC protocols, which many transmitters
+// can output on their JR module bay pins instead of PPM.
+//
+// Bytes are fed one at a time as they are received. The decoders work on fixed-size frame
+// buffers, and never allocate memory. After a rejected frame, they resynchronize on the next
+// possible start of a frame within the bytes received so far, so that a stream joined
+// mid-frame locks on even if its channel data contains header bytes.
+//
+// Both protocols carry 16 channels with 11-bit values ranging from 172 (988 us) over 992
+// (1500 us) to 1811 (2012 us).
+
+#ifndef SERIALDECODERS_H
+#define SERIALDECODERS_H
+
+#include <stdint.h>
+
+#define RC_SERIAL_CHANNELS 16
+
+// SBUS: 100 kbaud, 8E2, inverted signal, 25-byte frames every 7 or 14 ms
+#define SBUS_BAUDRATE     100000
+#define SBUS_FRAME_SIZE   25
+#define SBUS_HEADER       0x0F
+
+// CRSF: 8N1, frames of up to 64 bytes at up to 500 Hz. The baud rate depends on the
+// transmitter (see CRSF_BAUDRATE in the sketch)
+#define CRSF_MAX_FRAME    64
+#define CRSF_TYPE_RC_CHANNELS_PACKED 0x16
+
+
+class SbusDecoder {
+
+  private:
+    uint8_t frame[SBUS_FRAME_SIZE];
+    uint32_t length;
+
+  public:
+    uint16_t channels[RC_SERIAL_CHANNELS];  // channel values of the most recent frame
+    bool failsafe;                          // failsafe flag of the most recent frame
+    uint32_t errors;                        // number of frames discarded due to a bad end byte
+
+    SbusDecoder();
+    bool feed (uint8_t byte);               // returns true when a complete frame has been decoded
+};
+
+
+class CrsfDecoder {
+
+  private:
+    uint8_t frame[CRSF_MAX_FRAME];
+    uint32_t length;
+
+  public:
+    uint16_t channels[RC_SERIAL_CHANNELS];  // channel values of the most recent RC channels frame
+    uint32_t errors;                        // number of frames discarded due to a bad length or CRC
+
+    CrsfDecoder();
+    bool feed (uint8_t byte);               // returns true when a complete RC channels frame has been decoded
+};
+
+#endif // SERIALDECODERS_H
@@ -0,0 +1,110 @@
+/*
+   --------- Axis conversion test
+
+   Checks the integer AxisScale conversion (see GamepadCore.h) against the float conversion
+   that it replaced, for every channel value from 0 to 3000 us, with the default pulse range
+   (1500 +/- 500 us), both RMT tick rates (10 and 16 ticks per microsecond) and both axis
+   ranges (full range, and positive only with the Unity bug workaround):
+
+    - AxisScale must return the exact value of the conversion, truncated towards zero and
+      clamped to the axis range
+    - it may differ from the float conversion by 1 LSB, where the float rounding error pushes
+      the product across an integer: those inputs are counted, and any larger difference is
+      an error. The 7/8-bit gamepad modes use the upper byte of the 16-bit value, which may
+      then differ by 1 LSB as well.
+    - no more inputs may differ than documented: 31 (full range) and 16 (positive) at 10 ticks
+      per microsecond, none at 16 ticks per microsecond
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -I. extras/axis_scale_test.cpp GamepadCore.cpp -o axis_scale_test
+
+   Returns 0 if all checks pass.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "GamepadCore.h"
+
+// The sketch's default parameters (see JR_BLE_Gamepad.ino)
+#define PPM_PULSE_CENTER 1500
+#define PPM_PULSE_DELTA  500
+#define AXIS_RESOLUTION  65536
+#define AXIS_MIN         -32767
+#define AXIS_MAX         32767
+
+
+// The float conversion of the sketch before AxisScale
+
+static int16_t _floatConvert (uint32_t channelValue, uint32_t tickRate, bool unityBugWorkaround)
+{
+  float axisValue = unityBugWorkaround
+                  ? ((float) channelValue / tickRate - (PPM_PULSE_CENTER - PPM_PULSE_DELTA))
+                    * ((float) AXIS_RESOLUTION / 2 / (2 * PPM_PULSE_DELTA))
+                  : ((float) channelValue / tickRate - PPM_PULSE_CENTER)
+                    * ((float) AXIS_RESOLUTION / (2 * PPM_PULSE_DELTA));
+
+  float axisMin = unityBugWorkaround ? 0 : AXIS_MIN;
+
+  if (axisValue < axisMin)
+    axisValue = axisMin;
+  else if (axisValue > AXIS_MAX)
+    axisValue = AXIS_MAX;
+
+  return (int16_t) axisValue;
+}
+
+
+// The exact conversion, in 64-bit integer arithmetic
+
+static int16_t _exactConvert (uint32_t channelValue, uint32_t tickRate, bool unityBugWorkaround)
+{
+  int64_t zero = (unityBugWorkaround ? PPM_PULSE_CENTER - PPM_PULSE_DELTA : PPM_PULSE_CENTER) * (int64_t) tickRate;
+  int64_t scale = unityBugWorkaround ? AXIS_RESOLUTION / 2 : AXIS_RESOLUTION;
+  int64_t value = ((int64_t) channelValue - zero) * scale / (2 * PPM_PULSE_DELTA * (int64_t) tickRate);
+
+  int64_t axisMin = unityBugWorkaround ? 0 : AXIS_MIN;
+  return value < axisMin ? axisMin : value > AXIS_MAX ? AXIS_MAX : value;
+}
+
+
+static bool _check (uint32_t tickRate, bool unityBugWorkaround, uint32_t maxDifferences)
+{
+  AxisScale axisScale (tickRate, PPM_PULSE_CENTER, PPM_PULSE_DELTA, unityBugWorkaround);
+  uint32_t values = 3000 * tickRate + 1;
+  uint32_t errors = 0, differences = 0, narrowDifferences = 0;
+
+  for (uint32_t ticks = 0; ticks < values; ticks++) {
+    int32_t value = axisScale.convert (ticks);
+    int32_t exact = _exactConvert (ticks, tickRate, unityBugWorkaround);
+    int32_t legacy = _floatConvert (ticks, tickRate, unityBugWorkaround);
+
+    if (value != exact || abs (value - legacy) > 1 || abs ((value >> 8) - (legacy >> 8)) > 1) {
+      if (errors++ < 10)
+        printf ("  ERROR at %u ticks: %d, exact %d, float %d\n", ticks, value, exact, legacy);
+      continue;
+    }
+    differences += value != legacy;
+    narrowDifferences += (value >> 8) != (legacy >> 8);
+  }
+
+  printf ("%2u ticks/us, %-10s: %u values, %u differ by 1 LSB from the float conversion (%u in 8 bits), %u errors\n",
+          tickRate, unityBugWorkaround ? "positive" : "full range", values, differences, narrowDifferences, errors);
+  if (differences > maxDifferences)
+    printf ("  ERROR: more than %u values differ from the float conversion\n", maxDifferences);
+  return errors == 0 && differences <= maxDifferences;
+}
+
+
+int main ()
+{
+  bool passed = true;
+  passed &= _check (10, false, 31);
+  passed &= _check (10, true,  16);
+  passed &= _check (16, false, 0);
+  passed &= _check (16, true,  0);
+  printf (passed ? "PASSED\n" : "FAILED\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,364 @@
+/*
+   --------- Input filter evaluation
+
+   Runs the sketch's One Euro input filter (InputFilter, see GamepadCore.h) on the computer
+   over a stick trace, for a range of filter settings, and reports for every setting:
+
+    - the jitter: the RMS change of the filtered channel values from one frame to the next,
+      while the stick is at rest (us)
+    - the lag: the delay (ms) by which the filtered values best match the raw values while the
+      stick moves, and the remaining RMS error at that delay (us). Prediction
+      (FILTER_PREDICT_MILLIS) results in a smaller, or negative, lag.
+
+   The trace is either a capture recorded with CAPTURE_RMT_FRAMES (see RmtCapture.h), or a
+   synthetic one: the first four channels are sticks, moving during 2 seconds and resting
+   during 2 seconds, with a configurable noise. A channel is at rest while its raw values
+   stay within the rest threshold during 200 ms, and moving while they span more than 10 times
+   that threshold.
+
+   The filter is evaluated at the frame reception times, as the filtered frame would be
+   notified right away with REFRESH_ON_FRAME.
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -I. extras/filter_eval.cpp GamepadCore.cpp RmtCapture.cpp -o filter_eval
+
+   Usage:
+
+     filter_eval [-c channels] [-r frame rate] [-n noise] [-s seconds] [-S seed] [-q rest threshold] [setting...]
+     filter_eval -p capture.bin [-t ticks] [-q rest threshold] [setting...]
+
+   A setting is given as minCutoff,beta,predictMillis (for example 1.0,0.007,0), without any
+   setting a range of settings around the sketch's defaults is evaluated.
+   -q sets the rest threshold in microseconds (the noise, or 3 us, by default).
+   -t sets the RMT clock ticks per microsecond: 10 by default, 16 for captures recorded with
+   RMT_HIGH_RESOLUTION.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <vector>
+
+#include "GamepadCore.h"
+#include "RmtCapture.h"
+
+// The sketch's default parameters (see JR_BLE_Gamepad.ino)
+#define PPM_PULSE_CENTER     1500
+#define PPM_PULSE_DELTA      500
+#define FILTER_SPEED_CUTOFF  1.0f
+
+// window for detecting the rest & movement of a channel (us)
+#define EVAL_WINDOW_MICROS   200000
+
+// range of the lag search (us)
+#define EVAL_LAG_MIN         -100000
+#define EVAL_LAG_MAX         200000
+#define EVAL_LAG_STEP        500
+
+// RMT clock ticks per microsecond
+static uint32_t _tickRate = 10;
+
+
+// ----- Stick trace
+
+struct Trace {
+  uint32_t channels;
+  std::vector<uint64_t> time;               // frame reception times (us)
+  std::vector<uint32_t> values;             // channel values of every frame (ticks)
+  std::vector<uint8_t>  rest;               // per frame & channel: 1 at rest, 2 moving, 0 neither
+
+  uint32_t frames (void) const { return this->time.size(); }
+  uint32_t value (uint32_t f, uint32_t c) const { return this->values[f * this->channels + c]; }
+  void classify (double restThreshold);
+};
+
+
+// Classify every frame of every channel as at rest or moving, from the range of its raw values
+// within the surrounding window
+
+void Trace::classify (double restThreshold)
+{
+  this->rest.assign (this->values.size(), 0);
+  uint32_t first = 0, last = 0;
+
+  for (uint32_t f = 0; f < this->frames(); f++) {
+    while (this->time[first] + EVAL_WINDOW_MICROS / 2 < this->time[f])
+      first++;
+    while (last + 1 < this->frames() && this->time[last + 1] <= this->time[f] + EVAL_WINDOW_MICROS / 2)
+      last++;
+
+    for (uint32_t c = 0; c < this->channels; c++) {
+      uint32_t minimum = 0xFFFFFFFF, maximum = 0;
+      for (uint32_t w = first; w <= last; w++) {
+        uint32_t value = this->value (w, c);
+        minimum = value < minimum ? value : minimum;
+        maximum = value > maximum ? value : maximum;
+      }
+      double range = (double) (maximum - minimum) / _tickRate;
+      this->rest[f * this->channels + c] = range <= restThreshold ? 1 : range > 10 * restThreshold ? 2 : 0;
+    }
+  }
+}
+
+
+static uint32_t _seed = 1;
+
+static uint32_t _random (void)
+{
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return _seed;
+}
+
+// The first four channels are sticks, moving during 2 seconds and resting during 2 seconds,
+// the remaining ones are switches (as in pipeline_bench.cpp)
+static void _syntheticTrace (Trace *trace, uint32_t channels, uint32_t frameRate, uint32_t noise, uint32_t seconds)
+{
+  trace->channels = channels;
+  for (uint64_t f = 0; f < (uint64_t) seconds * frameRate; f++) {
+    uint64_t now = f * 1000000 / frameRate;
+    double t = now / 1e6;
+    bool moving = ((uint64_t) t / 2) % 2;
+
+    trace->time.push_back (now);
+    for (uint32_t i = 0; i < channels; i++) {
+      double value = PPM_PULSE_CENTER;
+      if (i < 4 && moving)
+        value += PPM_PULSE_DELTA * 0.8 * sin (2 * M_PI * t * (0.3 + 0.2 * i));
+      else if (i >= 4)
+        value += (i % 2) ? PPM_PULSE_DELTA : -PPM_PULSE_DELTA;
+
+      // triangular noise distribution, from -noise to +noise us
+      if (noise)
+        value += (int32_t) (_random() % (noise + 1) + _random() % (noise + 1)) - (int32_t) noise;
+      trace->values.push_back ((uint32_t) (value * _tickRate));
+    }
+  }
+}
+
+
+// Decode the frames of a capture: the channel count of the first frame is kept, frames with
+// another channel count are skipped
+
+static int _loadCapture (Trace *trace, const char *path)
+{
+  FILE *capture = fopen (path, "rb");
+  if (! capture) {
+    perror (path);
+    return 1;
+  }
+
+  RmtCaptureDecoder decoder;
+  uint64_t now = 0;
+  uint32_t last = 0, skipped = 0;
+  bool started = false;
+  int c;
+
+  trace->channels = 0;
+  while ((c = fgetc (capture)) != EOF) {
+    if (! decoder.feed (c))
+      continue;
+
+    // unwrap the 32-bit microsecond timestamps
+    if (started)
+      now += (uint32_t) (decoder.timestamp - last);
+    started = true;
+    last = decoder.timestamp;
+
+    if (decoder.flags & RMT_CAPTURE_DROPPED || decoder.count >= RMT_CAPTURE_MAX_ITEMS || ! decoder.count)
+      continue;
+
+    uint32_t frame[CORE_MAX_CHANNELS];
+    uint32_t channels = coreDecodeFrame (decoder.items, decoder.count, frame);
+    if (! trace->channels && channels >= 2)
+      trace->channels = channels;
+    if (channels != trace->channels) {
+      skipped++;
+      continue;
+    }
+    trace->time.push_back (now);
+    trace->values.insert (trace->values.end(), frame, frame + channels);
+  }
+  fclose (capture);
+
+  fprintf (stderr, "capture: %u bad records, %u frames (%u channels), %u skipped, %.1f s\n",
+           decoder.errors, trace->frames(), trace->channels, skipped, now / 1e6);
+  return trace->frames() < 2;
+}
+
+
+// ----- Evaluation
+
+struct Setting {
+  float minCutoff, beta;
+  uint32_t predictMillis;
+  bool raw;                                 // unfiltered, as a reference
+};
+
+struct Result {
+  double jitter;                            // RMS frame-to-frame change at rest (us)
+  double lag;                               // best matching delay while moving (ms)
+  double error;                             // RMS error at that delay (us)
+};
+
+
+// Raw value of channel c at time t (us), interpolated linearly
+
+static double _rawAt (const Trace *trace, uint32_t c, int64_t t, uint32_t *hint)
+{
+  uint32_t f = *hint;
+  while (f > 0 && (int64_t) trace->time[f] > t)
+    f--;
+  while (f + 1 < trace->frames() && (int64_t) trace->time[f + 1] <= t)
+    f++;
+  *hint = f;
+
+  if (t <= (int64_t) trace->time[0] || f + 1 >= trace->frames())
+    return (double) trace->value (f, c) / _tickRate;
+
+  double x = (double) (t - (int64_t) trace->time[f]) / (trace->time[f + 1] - trace->time[f]);
+  return ((1 - x) * trace->value (f, c) + x * trace->value (f + 1, c)) / _tickRate;
+}
+
+
+static Result _evaluate (const Trace *trace, const Setting *setting)
+{
+  uint32_t channels = trace->channels;
+  std::vector<double> output (trace->values.size());
+  InputFilter filter;
+  filter.begin (channels, _tickRate, setting->minCutoff, setting->beta, FILTER_SPEED_CUTOFF, setting->predictMillis);
+
+  for (uint32_t f = 0; f < trace->frames(); f++) {
+    uint32_t frame[CORE_MAX_CHANNELS];
+    for (uint32_t c = 0; c < channels; c++)
+      frame[c] = trace->value (f, c);
+    if (! setting->raw) {
+      filter.update (frame, (uint32_t) trace->time[f]);
+      filter.predict (frame, (uint32_t) trace->time[f]);
+    }
+    for (uint32_t c = 0; c < channels; c++)
+      output[f * channels + c] = (double) frame[c] / _tickRate;
+  }
+
+  // jitter: frame-to-frame changes while at rest
+  Result result = { 0, 0, 0 };
+  double sum = 0;
+  uint32_t count = 0;
+  for (uint32_t f = 1; f < trace->frames(); f++)
+    for (uint32_t c = 0; c < channels; c++)
+      if (trace->rest[f * channels + c] == 1 && trace->rest[(f - 1) * channels + c] == 1) {
+        double change = output[f * channels + c] - output[(f - 1) * channels + c];
+        sum += change * change;
+        count++;
+      }
+  result.jitter = count ? sqrt (sum / count) : NAN;
+
+  // lag: the delay of the raw values that matches the moving filtered values best
+  double best = INFINITY;
+  for (int32_t lag = EVAL_LAG_MIN; lag <= EVAL_LAG_MAX; lag += EVAL_LAG_STEP) {
+    sum = 0;
+    count = 0;
+    for (uint32_t c = 0; c < channels; c++) {
+      uint32_t hint = 0;
+      for (uint32_t f = 0; f < trace->frames(); f++) {
+        if (trace->rest[f * channels + c] != 2)
+          continue;
+        double error = output[f * channels + c] - _rawAt (trace, c, (int64_t) trace->time[f] - lag, &hint);
+        sum += error * error;
+        count++;
+      }
+    }
+    if (count && sum / count < best) {
+      best = sum / count;
+      result.lag = lag / 1000.0;
+    }
+  }
+  result.error = count ? sqrt (best) : NAN;
+  if (! count)
+    result.lag = NAN;
+  return result;
+}
+
+
+int main (int argc, char *argv[])
+{
+  uint32_t channels = 8, frameRate = 44, noise = 2, seconds = 20;
+  double restThreshold = 0;
+  const char *capture = NULL;
+  int option;
+
+  while ((option = getopt (argc, argv, "c:r:n:s:S:q:p:t:")) != -1) {
+    switch (option) {
+      case 'c': channels = atoi (optarg); break;
+      case 'r': frameRate = atoi (optarg); break;
+      case 'n': noise = atoi (optarg); break;
+      case 's': seconds = atoi (optarg); break;
+      case 'S': _seed = atoi (optarg) | 1; break;
+      case 'q': restThreshold = atof (optarg); break;
+      case 'p': capture = optarg; break;
+      case 't': _tickRate = atoi (optarg); break;
+      default:
+        fprintf (stderr, "usage: %s [-c channels] [-r frame rate] [-n noise] [-s seconds] [-S seed] [-q rest threshold] [setting...]\n"
+                         "       %s -p capture.bin [-t ticks] [-q rest threshold] [setting...]\n"
+                         "setting: minCutoff,beta,predictMillis\n", argv[0], argv[0]);
+        return 1;
+    }
+  }
+  if (channels < 2 || channels > CORE_MAX_CHANNELS || frameRate < 1 || seconds < 1 || _tickRate < 1 || _tickRate > 16) {
+    fprintf (stderr, "invalid parameters\n");
+    return 1;
+  }
+
+  // the settings given on the command line, or a range around the sketch's defaults
+  std::vector<Setting> settings;
+  Setting raw = { 0, 0, 0, true };
+  settings.push_back (raw);
+  for (int i = optind; i < argc; i++) {
+    Setting setting = { 0, 0, 0, false };
+    if (sscanf (argv[i], "%f,%f,%u", &setting.minCutoff, &setting.beta, &setting.predictMillis) < 2
+        || setting.minCutoff <= 0) {
+      fprintf (stderr, "invalid setting: %s\n", argv[i]);
+      return 1;
+    }
+    settings.push_back (setting);
+  }
+  if (settings.size() == 1) {
+    static const float minCutoffs[] = { 0.5f, 1.0f, 2.0f, 4.0f };
+    static const float betas[] = { 0.002f, 0.007f, 0.02f };
+    static const uint32_t predictions[] = { 0, 20 };
+    for (float minCutoff : minCutoffs)
+      for (float beta : betas)
+        for (uint32_t predictMillis : predictions) {
+          Setting setting = { minCutoff, beta, predictMillis, false };
+          settings.push_back (setting);
+        }
+  }
+
+  Trace trace;
+  if (capture) {
+    if (_loadCapture (&trace, capture))
+      return 1;
+  }
+  else {
+    _syntheticTrace (&trace, channels, frameRate, noise, seconds);
+    printf ("%u channels @ %u Hz, noise +/-%u us, %u ticks/us, %u s\n", channels, frameRate, noise, _tickRate, seconds);
+  }
+  if (! restThreshold)
+    restThreshold = ! capture && noise ? 2.0 * noise : 3.0;
+  trace.classify (restThreshold);
+
+  printf ("min cutoff     beta  predict |  jitter (us)  lag (ms)  error (us)\n");
+  for (const Setting &setting : settings) {
+    Result result = _evaluate (&trace, &setting);
+    if (setting.raw)
+      printf ("%-25s |", "raw");
+    else
+      printf ("%7.2f Hz %8.4f %5u ms |", setting.minCutoff, setting.beta, setting.predictMillis);
+    printf (" %12.2f %9.1f %11.2f\n", result.jitter, result.lag, result.error);
+  }
+  return 0;
+}
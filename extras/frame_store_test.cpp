@@ -0,0 +1,151 @@
+/*
+   --------- Frame handoff test
+
+   Checks the seqlock by which the ChannelExtractor tasks hand the newest frame over to their
+   readers (FrameStore, see GamepadCore.h), with the sketch's additional PPM inputs:
+
+    - an additional input's frame reaches the readers on its own, without a primary frame,
+      and leaves the primary input's channels unchanged, and vice versa
+    - a primary and an additional input publishing concurrently, as their tasks do, never
+      hand a torn copy over to a reader
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -pthread -I. extras/frame_store_test.cpp GamepadCore.cpp -o frame_store_test
+
+   Returns 0 if all checks pass.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "GamepadCore.h"
+
+// The sketch's frame layout (see JR_BLE_Gamepad.ino), with 2 additional inputs of 3 channels
+#define PPM_MAX_CHANNELS 16
+#define PPM_AUX_INPUTS   2
+#define PPM_AUX_CHANNELS 3
+#define FRAME_VALUES     (PPM_MAX_CHANNELS + PPM_AUX_INPUTS * PPM_AUX_CHANNELS)
+
+#define PRIMARY_CHANNELS 8
+
+
+static bool _check (bool condition, const char *what)
+{
+  if (! condition)
+    printf ("  ERROR: %s\n", what);
+  return condition;
+}
+
+
+// Reads the store as the sketch's readFrame() does
+
+static uint32_t _read (FrameStore *store, uint32_t values[], uint32_t *count, uint32_t *timestamp)
+{
+  uint32_t number;
+  while (! store->read (values, FRAME_VALUES, count, timestamp, &number))
+    std::this_thread::yield();
+  return number;
+}
+
+
+static void _fill (uint32_t values[], uint32_t count, uint32_t value)
+{
+  for (uint32_t i = 0; i < count; i++)
+    values[i] = value;
+}
+
+
+static bool _checkAuxOnly (void)
+{
+  bool passed = true;
+  FrameStore store;
+  uint32_t primary[PRIMARY_CHANNELS], aux[PPM_AUX_CHANNELS];
+  uint32_t values[FRAME_VALUES], count, timestamp;
+
+  _fill (primary, PRIMARY_CHANNELS, 15000);
+  store.publish (primary, PRIMARY_CHANNELS, 1000);
+  uint32_t number = _read (&store, values, &count, &timestamp);
+
+  // the second additional input's frame, without any primary frame
+  _fill (aux, PPM_AUX_CHANNELS, 12000);
+  store.publishAux (PPM_MAX_CHANNELS + PPM_AUX_CHANNELS, aux, PPM_AUX_CHANNELS, 5000);
+  uint32_t auxNumber = _read (&store, values, &count, &timestamp);
+
+  passed &= _check (auxNumber != number, "additional input's frame not seen as a new frame");
+  passed &= _check (timestamp == 5000, "additional input's frame without its reception time");
+  for (uint32_t c = 0; c < PPM_AUX_CHANNELS; c++)
+    passed &= _check (values[PPM_MAX_CHANNELS + PPM_AUX_CHANNELS + c] == 12000, "additional input's channel not published");
+  for (uint32_t c = 0; c < PRIMARY_CHANNELS; c++)
+    passed &= _check (values[c] == 15000, "primary channel changed by an additional input's frame");
+  passed &= _check (count == PRIMARY_CHANNELS, "primary channel count changed by an additional input's frame");
+
+  // a primary frame leaves the additional inputs' channels as they are
+  _fill (primary, PRIMARY_CHANNELS, 18000);
+  store.publish (primary, PRIMARY_CHANNELS, 9000);
+  _read (&store, values, &count, &timestamp);
+  for (uint32_t c = 0; c < PPM_AUX_CHANNELS; c++)
+    passed &= _check (values[PPM_MAX_CHANNELS + PPM_AUX_CHANNELS + c] == 12000, "additional input's channel changed by a primary frame");
+
+  return passed;
+}
+
+
+// Every frame holds a single value in all its slots, so a torn copy mixes values
+
+static bool _checkConcurrent (void)
+{
+  FrameStore store;
+  std::mutex writers;                       // the sketch's frameMux
+  std::atomic<bool> running (true);
+  uint32_t torn = 0, reads = 0;
+
+  std::thread primaryTask ([&] {
+    uint32_t frame[PRIMARY_CHANNELS];
+    for (uint32_t n = 1; running; n++) {
+      _fill (frame, PRIMARY_CHANNELS, n);
+      std::lock_guard<std::mutex> lock (writers);
+      store.publish (frame, PRIMARY_CHANNELS, n);
+    }
+  });
+  std::thread auxTask ([&] {
+    uint32_t frame[PPM_AUX_CHANNELS];
+    for (uint32_t n = 1; running; n++) {
+      _fill (frame, PPM_AUX_CHANNELS, n);
+      std::lock_guard<std::mutex> lock (writers);
+      store.publishAux (PPM_MAX_CHANNELS, frame, PPM_AUX_CHANNELS, n);
+    }
+  });
+
+  for (; reads < 200000; reads++) {
+    uint32_t values[FRAME_VALUES], count, timestamp;
+    _read (&store, values, &count, &timestamp);
+    for (uint32_t c = 1; c < PRIMARY_CHANNELS; c++)
+      torn += values[c] != values[0];
+    for (uint32_t c = 1; c < PPM_AUX_CHANNELS; c++)
+      torn += values[PPM_MAX_CHANNELS + c] != values[PPM_MAX_CHANNELS];
+  }
+
+  running = false;
+  primaryTask.join();
+  auxTask.join();
+  return _check (! torn, "torn copies");
+}
+
+
+int main (void)
+{
+  bool passed = _checkAuxOnly();
+  printf ("additional input's frame without a primary frame: %s\n", passed ? "ok" : "failed");
+
+  bool concurrent = _checkConcurrent();
+  printf ("concurrent primary and additional inputs: %s\n", concurrent ? "ok" : "failed");
+  passed &= concurrent;
+
+  printf (passed ? "PASSED\n" : "FAILED\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+/*
+   --------- PPM frame timing test
+
+   Checks the prediction of the next PPM frame (FrameTiming, see GamepadCore.h), by which the
+   ChannelExtractor light-sleeps between the frames in power save mode, on a simulated signal
+   with a fixed frame period and some jitter, across the micros() wraparound:
+
+    - there is no prediction before SLEEP_LOCK_FRAMES frame periods agree, nor after a missing
+      frame or a change of the frame period
+    - once predicted, the sleep ends the guard time before the next frame, within the jitter
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -I. extras/frame_timing_test.cpp GamepadCore.cpp -o frame_timing_test
+
+   Returns 0 if all checks pass.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "GamepadCore.h"
+
+// The sketch's default parameters (see JR_BLE_Gamepad.ino and ChannelExtractor.ino)
+#define PPM_SYNC_MINIMUM              2500
+#define PPM_MAX_FRAMESIZE             50000
+#define POWER_SAVE_SLEEP_GUARD_MICROS 2000
+#define SLEEP_LOCK_FRAMES             4
+#define SLEEP_PERIOD_TOLERANCE        250
+
+#define JITTER 40                           // frame start jitter (us)
+
+
+static uint32_t _seed = 1;
+
+static int32_t _jitter (void)
+{
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return (int32_t) (_seed % (2 * JITTER + 1)) - JITTER;
+}
+
+
+static bool _check (bool condition, const char *what, uint32_t frame)
+{
+  if (! condition)
+    printf ("  ERROR: %s at frame %u\n", what, frame);
+  return condition;
+}
+
+
+// Feeds frameCount frames of the given period, starting at start, and checks the predictions,
+// which must start at frame lockFrame. Returns the start of the next frame.
+
+static uint32_t _feed (FrameTiming *timing, uint32_t start, uint32_t period, uint32_t frameCount,
+                       uint32_t lockFrame, bool *passed)
+{
+  for (uint32_t n = 0; n < frameCount; n++, start += period) {
+    uint32_t frameStart = start + _jitter();
+    timing->frame (frameStart);
+
+    // the frame is decoded once it has ended
+    uint32_t now = frameStart + 12000;
+    uint32_t sleep = timing->sleepMicros (now, POWER_SAVE_SLEEP_GUARD_MICROS);
+    if (n < lockFrame) {
+      *passed &= _check (! sleep, "prediction before the frame periods agree", n);
+      continue;
+    }
+    int32_t early = (int32_t) (start + period - (now + sleep));
+    *passed &= _check (sleep && early >= POWER_SAVE_SLEEP_GUARD_MICROS - SLEEP_PERIOD_TOLERANCE
+                             && early <= POWER_SAVE_SLEEP_GUARD_MICROS + SLEEP_PERIOD_TOLERANCE,
+                       "wrong prediction", n);
+  }
+  return start;
+}
+
+
+int main (void)
+{
+  bool passed = true;
+  FrameTiming timing;
+  timing.begin (PPM_SYNC_MINIMUM, PPM_MAX_FRAMESIZE, SLEEP_PERIOD_TOLERANCE, SLEEP_LOCK_FRAMES);
+
+  // across the micros() wraparound
+  uint32_t start = 0xFFFFFFFF - 100 * 22500;
+  start = _feed (&timing, start, 22500, 200, SLEEP_LOCK_FRAMES, &passed);
+
+  // a missing frame drops the prediction until the periods agree again
+  timing.miss();
+  passed &= _check (! timing.sleepMicros (start, POWER_SAVE_SLEEP_GUARD_MICROS), "prediction after a missing frame", 0);
+  start = _feed (&timing, start + 22500, 22500, 20, SLEEP_LOCK_FRAMES, &passed);
+
+  // so does a new frame period, from the first frame after it
+  start = _feed (&timing, start - 2500, 20000, 20, SLEEP_LOCK_FRAMES - 1, &passed);
+
+  // a late wake-up doesn't sleep through the next frame
+  passed &= _check (! timing.sleepMicros (start, POWER_SAVE_SLEEP_GUARD_MICROS), "sleep past the next frame", 0);
+
+  printf (passed ? "PASSED\n" : "FAILED\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,641 @@
+/*
+   --------- HID report timing analyzer (Linux)
+
+   Measures what actually arrives at the computer, after the Bluetooth link and the operating
+   system's HID stack:
+
+    - hidraw mode reads the gamepad's HID reports from a /dev/hidrawN node. The report layout
+      is identified from the report map (any layout generated by JRGamepad: 1 or 2 gamepads,
+      6 or 12 axes, 8 or 9 to 16 bits per axis, with or without the Unity bug workaround),
+      and the reports are decoded into axis values
+    - evdev mode reads the axis events of a /dev/input/eventN node, ie. what games get to see.
+      The input layer drops unchanged axis values, so duplicate reports are invisible there
+    - virtual mode (-V) creates a virtual gamepad with the module's report map through uhid
+      (the HID counterpart of uinput, which BlueZ uses for Bluetooth LE gamepads as well),
+      replays synthetic reports into it the way the GamepadRefresh task would send them,
+      and analyzes what arrives on the virtual gamepad's hidraw node, including the delay
+      through the kernel. No Bluetooth and no module needed.
+
+   The statistics: report rate, histogram of the intervals between reports and their jitter
+   (standard deviation), duplicate reports (the keep-alive refreshes sent while the noise
+   thresholds suppress the still sticks), and for every axis its update rate, range, number
+   of distinct values, smallest step and the resulting effective resolution.
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -I. extras/hid_analyzer.cpp GamepadCore.cpp -o hid_analyzer
+
+   Usage:
+
+     hid_analyzer [-s seconds] /dev/hidrawN
+     hid_analyzer [-s seconds] /dev/input/eventN
+     hid_analyzer -V [-s seconds] [-R report rate] [-8 | -b bits] [-2 | -c] [-z]
+
+   The gamepad's hidraw & event nodes are listed in /proc/bus/input/devices. Reading them and
+   creating a virtual gamepad through /dev/uhid usually requires root. The analysis stops
+   after the given number of seconds (10 by default), or on Ctrl-C.
+
+   -8 or -b sets the bits per axis of the virtual gamepad (16 by default, see AXIS_BITS),
+   -2 selects two gamepads (12 axes), -c a single gamepad with 12 axes (DUAL_GAMEPAD_COMPOSITE),
+   and -z symmetrical axis values (UNITY_BUG_WORKAROUND 0).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <math.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <vector>
+
+#include "GamepadCore.h"
+
+// The sketch's default parameters (see JR_BLE_Gamepad.ino)
+#define REFRESH_INACTIVITY_MILLIS 1000
+#define GAMEPAD_MAX_AXES     12
+
+// Interval & latency histogram: bucket 0 counts 0 us, bucket n counts 2^(n-1) to 2^n - 1 us,
+// and the last bucket counts everything above (as in PipelineStats.h)
+#define HISTOGRAM_BUCKETS    24
+
+// Maximum number of axes tracked: 2 gamepads with 12 axes, or every evdev axis
+#define MAX_AXES             ABS_CNT
+
+static volatile bool _stop = false;
+
+static void _interrupted (int /* signal */)
+{
+  _stop = true;
+}
+
+static uint64_t _micros (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+// ----- Statistics
+
+struct Histogram {
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+  std::vector<uint32_t> samples;           // every sample, for the percentiles & the jitter
+
+  Histogram() { memset (this->buckets, 0, sizeof (this->buckets)); }
+
+  void add (uint32_t micros) {
+    uint32_t bucket = 0;
+    while (micros >> bucket && bucket < HISTOGRAM_BUCKETS - 1)
+      bucket++;
+    this->buckets[bucket]++;
+    this->samples.push_back (micros);
+  }
+
+  void print (const char *title);
+};
+
+void Histogram::print (const char *title)
+{
+  size_t count = this->samples.size();
+  if (! count)
+    return;
+
+  std::vector<uint32_t> sorted (this->samples);
+  std::sort (sorted.begin(), sorted.end());
+  double mean = 0, variance = 0;
+  for (size_t i = 0; i < count; i++)
+    mean += sorted[i];
+  mean /= count;
+  for (size_t i = 0; i < count; i++)
+    variance += (sorted[i] - mean) * (sorted[i] - mean);
+
+  printf ("  %s: mean %.2f ms, jitter (std dev) %.2f ms, min %.2f, median %.2f, 99%% %.2f, max %.2f ms\n",
+          title, mean / 1000, sqrt (variance / count) / 1000, sorted[0] / 1000.0, sorted[count / 2] / 1000.0,
+          sorted[count * 99 / 100] / 1000.0, sorted[count - 1] / 1000.0);
+
+  uint64_t peak = *std::max_element (this->buckets, this->buckets + HISTOGRAM_BUCKETS);
+  for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    if (! this->buckets[b])
+      continue;
+    uint32_t low = b ? 1 << (b - 1) : 0, high = (1 << b) - 1;
+    int bar = (int) (this->buckets[b] * 40 / peak);
+    if (b == HISTOGRAM_BUCKETS - 1)
+      printf ("    %8u us ..           %-40.*s %llu\n", low, bar, "########################################",
+              (unsigned long long) this->buckets[b]);
+    else
+      printf ("    %8u .. %8u us  %-40.*s %llu\n", low, high, bar, "########################################",
+              (unsigned long long) this->buckets[b]);
+  }
+}
+
+
+struct AxisStats {
+  bool     seen;
+  int32_t  logicalMin, logicalMax;         // the axis' logical range
+  int32_t  minimum, maximum, last;
+  uint32_t minStep;                        // smallest change between two reports
+  uint64_t updates;                        // reports changing the axis
+  std::set<int32_t> values;                // distinct values
+
+  AxisStats() : seen(false), logicalMin(0), logicalMax(0), minimum(0), maximum(0), last(0), minStep(0), updates(0) { }
+
+  void add (int32_t value) {
+    if (! this->seen) {
+      this->seen = true;
+      this->minimum = this->maximum = value;
+    }
+    else if (value != this->last) {
+      uint32_t step = abs (value - this->last);
+      if (! this->minStep || step < this->minStep)
+        this->minStep = step;
+      this->updates++;
+    }
+    this->minimum = std::min (this->minimum, value);
+    this->maximum = std::max (this->maximum, value);
+    this->last = value;
+    this->values.insert (value);
+  }
+};
+
+
+struct Analyzer {
+  const char *streamNames[2];
+  Histogram intervals[2];                  // per gamepad (report ID), or per evdev device
+  uint64_t lastReport[2];
+  uint64_t reports[2], duplicates[2];
+  AxisStats axes[MAX_AXES];
+  const char *axisNames[MAX_AXES];
+  Histogram latency;                       // virtual mode only
+  uint64_t start, end;
+
+  Analyzer() : start(0), end(0) {
+    memset (this->lastReport, 0, sizeof (this->lastReport));
+    memset (this->reports, 0, sizeof (this->reports));
+    memset (this->duplicates, 0, sizeof (this->duplicates));
+    memset (this->axisNames, 0, sizeof (this->axisNames));
+    this->streamNames[0] = "gamepad 1";
+    this->streamNames[1] = "gamepad 2";
+  }
+
+  void report (uint32_t stream, uint64_t now, bool duplicate) {
+    if (! this->start)
+      this->start = now;
+    this->end = now;
+    if (this->lastReport[stream])
+      this->intervals[stream].add (now - this->lastReport[stream]);
+    this->lastReport[stream] = now;
+    this->reports[stream]++;
+    if (duplicate)
+      this->duplicates[stream]++;
+  }
+
+  void print (bool showDuplicates);
+};
+
+void Analyzer::print (bool showDuplicates)
+{
+  double seconds = (this->end - this->start) / 1e6;
+
+  for (uint32_t s = 0; s < 2; s++) {
+    if (! this->reports[s])
+      continue;
+    printf ("%s: %llu reports in %.1f s (%.1f/s)", this->streamNames[s], (unsigned long long) this->reports[s],
+            seconds, seconds > 0 ? this->reports[s] / seconds : 0);
+    if (showDuplicates)
+      printf (", duplicates %llu (%.1f%%)", (unsigned long long) this->duplicates[s],
+              100.0 * this->duplicates[s] / this->reports[s]);
+    printf ("\n");
+    this->intervals[s].print ("intervals");
+  }
+  if (this->latency.samples.size()) {
+    printf ("kernel path (uhid write to hidraw read):\n");
+    this->latency.print ("latency");
+  }
+
+  printf ("axis        updates/s   range                 distinct   step   effective bits\n");
+  for (uint32_t a = 0; a < MAX_AXES; a++) {
+    AxisStats *axis = &this->axes[a];
+    if (! axis->seen)
+      continue;
+    // the number of steps of the smallest change that fit into the logical range
+    uint32_t span = axis->logicalMax - axis->logicalMin;
+    double bits = axis->minStep ? log2 ((double) span / axis->minStep + 1) : 0;
+    printf ("%-10s  %9.1f   %6d .. %-6d (%6d .. %-6d)  %8zu  %5u   %5.1f\n", this->axisNames[a],
+            seconds > 0 ? axis->updates / seconds : 0, axis->minimum, axis->maximum,
+            axis->logicalMin, axis->logicalMax, axis->values.size(), axis->minStep, bits);
+  }
+}
+
+
+// ----- HID report layouts
+
+static const char *_axisNames[GAMEPAD_MAX_AXES] = {
+  "X", "Y", "Z", "rX", "rY", "rZ", "Slider", "Dial", "Wheel", "vX", "vY", "vZ"
+};
+
+// Identify the layout generated by JRGamepad for a report map, returns false if none matches
+static bool _identifyLayout (const uint8_t map[], size_t length, HidLayout *layout)
+{
+  uint8_t candidate[CORE_MAX_REPORT_MAP];
+
+  for (uint32_t gamepads = 1; gamepads <= 2; gamepads++)
+    for (uint32_t axes = 6; axes <= 12; axes += 6)
+      for (uint32_t bits = 2; bits <= 16; bits++)
+        for (uint32_t positive = 0; positive <= 1; positive++) {
+          HidLayout l = { (uint8_t) gamepads, (uint8_t) axes, (uint8_t) bits, (uint8_t) (axes > 6 ? 16 : 8), positive != 0 };
+          if (coreBuildReportMap (candidate, &l) == length && ! memcmp (candidate, map, length)) {
+            *layout = l;
+            return true;
+          }
+        }
+  return false;
+}
+
+// Decode a report (without report ID) into axis values, in the layout's logical range
+static void _decodeReport (const uint8_t report[], const HidLayout *layout, int32_t axes[])
+{
+  uint32_t position = layout->buttons;
+
+  for (uint32_t a = 0; a < layout->axes; a++) {
+    uint32_t value = 0;
+    for (uint32_t b = 0; b < layout->bits; b++, position++)
+      value |= (uint32_t) (report[position >> 3] >> (position & 7) & 1) << b;
+    // sign extension
+    if (! layout->positive && value >> (layout->bits - 1))
+      value |= ~0U << layout->bits;
+    axes[a] = (int32_t) value;
+  }
+}
+
+static void _printLayout (const HidLayout *layout)
+{
+  printf ("report layout: %u gamepad%s, %u axes with %u bits (%s), %u buttons, %zu bytes per report\n",
+          layout->gamepads, layout->gamepads > 1 ? "s" : "", layout->axes, layout->bits,
+          layout->positive ? "positive values only" : "symmetrical", layout->buttons, coreReportLength (layout));
+}
+
+
+// ----- hidraw mode
+
+static int _openHidraw (const char *path, HidLayout *layout, Analyzer *analyzer)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) {
+    perror (path);
+    return -1;
+  }
+
+  int size = 0;
+  struct hidraw_report_descriptor descriptor;
+  if (ioctl (fd, HIDIOCGRDESCSIZE, &size) < 0 || size <= 0 || size > HID_MAX_DESCRIPTOR_SIZE) {
+    perror ("HIDIOCGRDESCSIZE");
+    close (fd);
+    return -1;
+  }
+  descriptor.size = size;
+  if (ioctl (fd, HIDIOCGRDESC, &descriptor) < 0) {
+    perror ("HIDIOCGRDESC");
+    close (fd);
+    return -1;
+  }
+  if (! _identifyLayout (descriptor.value, descriptor.size, layout)) {
+    fprintf (stderr, "%s: the report map (%d bytes) doesn't match any JR BLE Gamepad layout\n", path, size);
+    close (fd);
+    return -1;
+  }
+  _printLayout (layout);
+
+  for (uint32_t a = 0; a < layout->gamepads * layout->axes; a++) {
+    AxisStats *axis = &analyzer->axes[a];
+    axis->logicalMax = (1 << (layout->bits - 1)) - 1;
+    axis->logicalMin = layout->positive ? 0 : -axis->logicalMax;
+    analyzer->axisNames[a] = _axisNames[a % layout->axes];
+  }
+  return fd;
+}
+
+// Read & analyze a report, returns false on errors
+static bool _readHidraw (int fd, const HidLayout *layout, Analyzer *analyzer, uint64_t *now)
+{
+  static uint8_t previous[2][32];
+  uint8_t report[64];
+  int32_t axes[GAMEPAD_MAX_AXES];
+  size_t length = coreReportLength (layout);
+
+  ssize_t size = read (fd, report, sizeof (report));
+  *now = _micros();
+  if (size < 0) {
+    perror ("read");
+    return false;
+  }
+  // report ID, followed by the report
+  if ((size_t) size != length + 1 || report[0] < 1 || report[0] > layout->gamepads)
+    return true;
+
+  uint32_t g = report[0] - 1;
+  bool duplicate = analyzer->reports[g] && ! memcmp (previous[g], report + 1, length);
+  memcpy (previous[g], report + 1, length);
+  analyzer->report (g, *now, duplicate);
+
+  _decodeReport (report + 1, layout, axes);
+  for (uint32_t a = 0; a < layout->axes; a++)
+    analyzer->axes[g * layout->axes + a].add (axes[a]);
+  return true;
+}
+
+static int _analyzeHidraw (const char *path, uint32_t seconds)
+{
+  Analyzer analyzer;
+  HidLayout layout;
+  int fd = _openHidraw (path, &layout, &analyzer);
+  if (fd < 0)
+    return 1;
+
+  uint64_t until = _micros() + seconds * 1000000ULL;
+  while (! _stop && _micros() < until) {
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll (&p, 1, 100) <= 0)
+      continue;
+    uint64_t now;
+    if (! _readHidraw (fd, &layout, &analyzer, &now))
+      break;
+  }
+  close (fd);
+  analyzer.print (true);
+  return 0;
+}
+
+
+// ----- evdev mode
+
+static const char *_absNames[ABS_MISC] = {
+  "X", "Y", "Z", "rX", "rY", "rZ", "Throttle", "Rudder", "Wheel", "Gas", "Brake"
+};
+
+static int _analyzeEvdev (const char *path, uint32_t seconds)
+{
+  static char names[MAX_AXES][16];
+  Analyzer analyzer;
+  analyzer.streamNames[0] = "events";
+
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) {
+    perror (path);
+    return 1;
+  }
+  char name[256] = "";
+  ioctl (fd, EVIOCGNAME (sizeof (name)), name);
+  int clock = CLOCK_MONOTONIC;
+  ioctl (fd, EVIOCSCLOCKID, &clock);
+  printf ("device: %s\n", name);
+
+  for (uint32_t a = 0; a < MAX_AXES; a++) {
+    struct input_absinfo info;
+    if (ioctl (fd, EVIOCGABS (a), &info) < 0)
+      continue;
+    analyzer.axes[a].logicalMin = info.minimum;
+    analyzer.axes[a].logicalMax = info.maximum;
+    if (a < ABS_MISC && _absNames[a])
+      analyzer.axisNames[a] = _absNames[a];
+    else {
+      snprintf (names[a], sizeof (names[a]), "ABS 0x%02x", a);
+      analyzer.axisNames[a] = names[a];
+    }
+  }
+
+  // the axis events of a report are followed by a SYN_REPORT event
+  uint64_t until = _micros() + seconds * 1000000ULL;
+  while (! _stop && _micros() < until) {
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll (&p, 1, 100) <= 0)
+      continue;
+    struct input_event events[64];
+    ssize_t size = read (fd, events, sizeof (events));
+    if (size < 0) {
+      perror ("read");
+      break;
+    }
+    for (size_t i = 0; i < size / sizeof (events[0]); i++) {
+      struct input_event *e = &events[i];
+      if (e->type == EV_ABS && e->code < MAX_AXES)
+        analyzer.axes[e->code].add (e->value);
+      else if (e->type == EV_SYN && e->code == SYN_REPORT)
+        analyzer.report (0, e->time.tv_sec * 1000000ULL + e->time.tv_usec, false);
+    }
+  }
+  close (fd);
+  analyzer.print (false);
+  return 0;
+}
+
+
+// ----- Virtual mode
+
+static bool _uhidWrite (int fd, const struct uhid_event *event)
+{
+  if (write (fd, event, sizeof (*event)) != sizeof (*event)) {
+    perror ("uhid write");
+    return false;
+  }
+  return true;
+}
+
+// Find the hidraw node of the virtual gamepad, by its unique ID
+static bool _findHidraw (const char *uniq, char *path, size_t size)
+{
+  char line[256], match[128];
+  bool found = false;
+  snprintf (match, sizeof (match), "HID_UNIQ=%s\n", uniq);
+
+  DIR *dir = opendir ("/sys/class/hidraw");
+  struct dirent *entry;
+  while (dir && ! found && (entry = readdir (dir))) {
+    char uevent[512];
+    snprintf (uevent, sizeof (uevent), "/sys/class/hidraw/%s/device/uevent", entry->d_name);
+    FILE *f = fopen (uevent, "r");
+    while (f && ! found && fgets (line, sizeof (line), f))
+      if (! strcmp (line, match)) {
+        snprintf (path, size, "/dev/%s", entry->d_name);
+        found = true;
+      }
+    if (f)
+      fclose (f);
+  }
+  if (dir)
+    closedir (dir);
+  return found;
+}
+
+// Synthetic stick movements: the axes move during 2 seconds and rest during 2 seconds, as in
+// pipeline_bench. Returns the axis values (16-bit, see AxisScale).
+static void _syntheticAxes (uint64_t now, bool positive, int16_t axes[])
+{
+  double t = now / 1e6;
+  bool moving = ((uint64_t) t / 2) % 2;
+
+  for (uint32_t a = 0; a < GAMEPAD_MAX_AXES; a++) {
+    double value = moving ? 0.8 * sin (2 * M_PI * t * (0.3 + 0.2 * (a % 4))) : 0;
+    axes[a] = positive ? (int16_t) ((value + 1) * 16383) : (int16_t) (value * 32767);
+  }
+}
+
+static int _virtualGamepad (uint32_t seconds, uint32_t reportRate, const HidLayout *layout)
+{
+  int uhid = open ("/dev/uhid", O_RDWR | O_CLOEXEC);
+  if (uhid < 0) {
+    perror ("/dev/uhid");
+    return 1;
+  }
+
+  // create the virtual gamepad, with the vendor & product IDs of the module
+  struct uhid_event event;
+  memset (&event, 0, sizeof (event));
+  event.type = UHID_CREATE2;
+  snprintf ((char*) event.u.create2.name, sizeof (event.u.create2.name), "JR BLE Gamepad (virtual)");
+  snprintf ((char*) event.u.create2.uniq, sizeof (event.u.create2.uniq), "hid_analyzer-%d", (int) getpid());
+  event.u.create2.rd_size = coreBuildReportMap (event.u.create2.rd_data, layout);
+  event.u.create2.bus = BUS_BLUETOOTH;
+  event.u.create2.vendor = 0x02e5;
+  event.u.create2.product = 0xabcd;
+  event.u.create2.version = 0x0110;
+  char uniq[sizeof (event.u.create2.uniq)];
+  memcpy (uniq, event.u.create2.uniq, sizeof (uniq));
+  if (! _uhidWrite (uhid, &event))
+    return 1;
+
+  // wait for the kernel to start the device, and for its hidraw node to show up
+  char path[300];
+  int fd = -1;
+  Analyzer analyzer;
+  HidLayout identified;
+  for (int retries = 0; retries < 50 && fd < 0; retries++) {
+    usleep (100000);
+    if (_findHidraw (uniq, path, sizeof (path)) && access (path, R_OK) == 0) {
+      printf ("virtual gamepad: %s\n", path);
+      fd = _openHidraw (path, &identified, &analyzer);
+      break;
+    }
+  }
+  if (fd < 0) {
+    fprintf (stderr, "the virtual gamepad's hidraw node didn't show up\n");
+    close (uhid);
+    return 1;
+  }
+
+  // Replay the reports the way the GamepadRefresh task would: a gamepad's report is sent if
+  // it has changed, or after REFRESH_INACTIVITY_MILLIS
+  uint8_t previous[2][32];
+  uint64_t lastSent[2] = { 0, 0 };
+  std::deque<uint64_t> inFlight;            // send times of the reports not read back yet
+  uint64_t sent = 0, received = 0;
+  uint64_t start = _micros(), until = start + seconds * 1000000ULL, next = start;
+
+  while (! _stop && _micros() < until) {
+    uint64_t now = _micros();
+    if (now >= next) {
+      int16_t axes[GAMEPAD_MAX_AXES];
+      _syntheticAxes (now - start, layout->positive, axes);
+
+      for (uint32_t g = 0; g < layout->gamepads; g++) {
+        memset (&event, 0, sizeof (event));
+        event.type = UHID_INPUT2;
+        event.u.input2.data[0] = g + 1;      // report ID
+        event.u.input2.size = 1 + coreEncodeReport (event.u.input2.data + 1, &axes[g * layout->axes], 0, layout);
+
+        bool changed = ! lastSent[g] || memcmp (previous[g], event.u.input2.data + 1, event.u.input2.size - 1);
+        if (! changed && now - lastSent[g] < REFRESH_INACTIVITY_MILLIS * 1000ULL)
+          continue;
+        memcpy (previous[g], event.u.input2.data + 1, event.u.input2.size - 1);
+        lastSent[g] = now;
+        inFlight.push_back (_micros());
+        if (! _uhidWrite (uhid, &event))
+          _stop = true;
+        sent++;
+      }
+      next += 1000000 / reportRate;
+    }
+
+    // read the reports back, and drain the uhid events (start, open, close...)
+    struct pollfd p[2] = { { fd, POLLIN, 0 }, { uhid, POLLIN, 0 } };
+    int timeout = next > now ? (int) ((next - now) / 1000) : 0;
+    if (poll (p, 2, timeout) <= 0)
+      continue;
+    if (p[0].revents & POLLIN) {
+      uint64_t readTime;
+      if (! _readHidraw (fd, &identified, &analyzer, &readTime))
+        break;
+      if (! inFlight.empty()) {
+        analyzer.latency.add (readTime - inFlight.front());
+        inFlight.pop_front();
+      }
+      received++;
+    }
+    if (p[1].revents & POLLIN) {
+      struct uhid_event ignored;
+      if (read (uhid, &ignored, sizeof (ignored)) < 0)
+        break;
+    }
+  }
+
+  memset (&event, 0, sizeof (event));
+  event.type = UHID_DESTROY;
+  _uhidWrite (uhid, &event);
+  close (fd);
+  close (uhid);
+
+  printf ("virtual gamepad: %llu reports sent, %llu received\n", (unsigned long long) sent, (unsigned long long) received);
+  analyzer.print (true);
+  return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+  uint32_t seconds = 10, reportRate = 100, axisBits = 16;
+  bool virtualGamepad = false, dual = false, composite = false, symmetrical = false;
+  int option;
+
+  while ((option = getopt (argc, argv, "s:VR:8b:2cz")) != -1) {
+    switch (option) {
+      case 's': seconds = atoi (optarg); break;
+      case 'V': virtualGamepad = true; break;
+      case 'R': reportRate = atoi (optarg); break;
+      case '8': axisBits = 8; break;
+      case 'b': axisBits = atoi (optarg); break;
+      case '2': dual = true; break;
+      case 'c': composite = true; break;
+      case 'z': symmetrical = true; break;
+      default:
+        fprintf (stderr, "usage: %s [-s seconds] /dev/hidrawN | /dev/input/eventN\n"
+                         "       %s -V [-s seconds] [-R report rate] [-8 | -b bits] [-2 | -c] [-z]\n", argv[0], argv[0]);
+        return 1;
+    }
+  }
+  if (! seconds || reportRate < 1 || reportRate > 1000 || axisBits < 2 || axisBits > 16 || (dual && composite)
+      || (! virtualGamepad && optind != argc - 1)) {
+    fprintf (stderr, "invalid parameters\n");
+    return 1;
+  }
+
+  signal (SIGINT, _interrupted);
+
+  if (virtualGamepad) {
+    HidLayout layout = { (uint8_t) (dual ? 2 : 1), (uint8_t) (composite ? 12 : 6), (uint8_t) axisBits, (uint8_t) (composite ? 16 : 8), ! symmetrical };
+    return _virtualGamepad (seconds, reportRate, &layout);
+  }
+  if (strstr (argv[optind], "hidraw"))
+    return _analyzeHidraw (argv[optind], seconds);
+  return _analyzeEvdev (argv[optind], seconds);
+}
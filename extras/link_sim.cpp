@@ -0,0 +1,295 @@
+/*
+   --------- Bluetooth link simulation
+
+   Simulates the notification path from the PPM (or SBUS/CRSF) frames to the Bluetooth
+   connection events, to check the notify pacing logic (NOTIFY_PACING, see GamepadCore.h) on the
+   computer, and to show what its heuristic costs when the predicted connection events are off:
+
+    - the frames arrive every frame period, and are notified right away (REFRESH_ON_FRAME), or
+      with pacing, held back until the guard time before the next predicted connection event, by
+      a task delay with a 1 ms resolution, and then notified with the newest frame
+    - the Bluetooth controller transmits the queued notifications at its connection events,
+      which need a notification some lead time in advance. Its clock drifts against micros(),
+      and the anchor of the prediction is the time at which the stack reported the connection
+      interval, some time after the connection event.
+    - the stack holds a few notifications: when they are all queued, the newest report is held
+      back and replaced, and sent when a buffer becomes free (as JRGamepad does on congestion)
+
+   For every scenario, it reports the age of the transmitted frames at their connection event
+   (mean, 95th percentile and maximum), and how many paced notifications missed the connection
+   event that they would have made without pacing.
+
+   As a test, it checks the connection event prediction across the micros() wraparound, and that
+   with an exact anchor, pacing misses no connection event and doesn't increase the mean age.
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -I. extras/link_sim.cpp GamepadCore.cpp -o link_sim
+
+   Usage:
+
+     link_sim [-i interval] [-g guard] [-l lead] [-b buffers] [-e reports per event] [-f frame period] [-s seconds]
+
+   Times are in microseconds. Without -f, a PPM frame period (22500 us) and a CRSF one (4000 us)
+   are simulated. Returns 0 if all checks pass.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "GamepadCore.h"
+
+// The sketch's default parameters (see JR_BLE_Gamepad.ino)
+#define BLE_CONNECTION_INTERVAL    7500
+#define NOTIFY_PACING_GUARD_MICROS 1500
+
+static uint32_t _interval = BLE_CONNECTION_INTERVAL;
+static uint32_t _guard = NOTIFY_PACING_GUARD_MICROS;
+static uint32_t _lead = 500;               // time the controller needs a notification before the connection event
+static uint32_t _buffers = 4;              // notifications held by the stack
+static uint32_t _perEvent = 2;             // notifications transmitted per connection event
+
+
+struct Scenario {
+  const char *name;
+  bool pacing;
+  int32_t anchorError;                      // delay of the reported anchor after the connection event (us)
+  double drift;                             // controller clock vs micros() (ppm)
+};
+
+struct Result {
+  uint32_t sent, replaced, missed;
+  double mean, p95, max;                    // age of the transmitted frames (us)
+};
+
+struct Report {
+  uint64_t frame;                           // reception time of the frame
+  uint64_t queued;                          // time the notification was queued
+  uint64_t unpaced;                         // connection event it would have made without pacing
+};
+
+
+static uint32_t _seed = 1;
+
+static uint32_t _random (void)
+{
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return _seed;
+}
+
+
+// Times are kept in 64 bits, starting shortly before the 32-bit micros() wraps
+
+#define SIM_START 0xFFF00000ULL
+
+static uint64_t _eventTime (uint64_t k, double drift)
+{
+  // the first connection event is at a random phase within the first interval
+  static const uint64_t phase = 3217;
+  return SIM_START + phase + (uint64_t) llround (k * (double) _interval * (1 + drift * 1e-6));
+}
+
+
+static Result _simulate (const Scenario *scenario, uint32_t framePeriod, uint32_t seconds)
+{
+  Result result = { 0, 0, 0, 0, 0, 0 };
+  std::vector<double> ages;
+  std::deque<Report> queue;
+  Report pending = { 0, 0, 0 };
+  bool isPending = false;
+
+  uint32_t anchor = (uint32_t) (_eventTime (0, scenario->drift) + scenario->anchorError);
+  uint64_t end = SIM_START + (uint64_t) seconds * 1000000;
+  uint64_t nextFrame = SIM_START + framePeriod;
+  uint64_t lastFrame = 0, wake = 0, decided = 0;
+  uint64_t k = 1;
+  _seed = 1;
+
+  // first connection event at or after t that a notification queued at t makes
+  auto unpacedEvent = [&] (uint64_t t) {
+    uint64_t e = k;
+    while (_eventTime (e, scenario->drift) < t + _lead)
+      e++;
+    return _eventTime (e, scenario->drift);
+  };
+
+  auto submit = [&] (uint64_t now, uint64_t unpaced) {
+    Report report = { lastFrame, now, unpaced };
+    if (queue.size() < _buffers)
+      queue.push_back (report);
+    else {
+      result.replaced += isPending;
+      pending = report;
+      isPending = true;
+    }
+  };
+
+  while (true) {
+    uint64_t event = _eventTime (k, scenario->drift);
+    uint64_t now = std::min (nextFrame, event);
+    if (wake)
+      now = std::min (now, wake);
+    if (now >= end)
+      break;
+
+    if (wake && now == wake) {
+      // the paced notification is sent with the newest frame
+      wake = 0;
+      submit (now, unpacedEvent (decided));
+    }
+    else if (now == nextFrame) {
+      lastFrame = now;
+      nextFrame += framePeriod + _random() % 101 - 50;
+
+      // a frame arriving while the refresh task waits is picked up when it wakes
+      if (! wake) {
+        uint32_t hold = scenario->pacing
+                      ? corePacingDelay (coreMicrosToConnectionEvent ((uint32_t) now, anchor, _interval), _guard)
+                      : 0;
+        if (hold) {
+          // vTaskDelay wakes up at a 1 ms tick
+          wake = (now / 1000 + hold) * 1000;
+          decided = now;
+        }
+        else
+          submit (now, unpacedEvent (now));
+      }
+    }
+    else {
+      // connection event: transmit the notifications that were queued in time
+      for (uint32_t n = 0; n < _perEvent && ! queue.empty() && queue.front().queued + _lead <= now; n++) {
+        ages.push_back ((double) (now - queue.front().frame));
+        result.missed += now > queue.front().unpaced;
+        queue.pop_front();
+      }
+      // a held back report is flushed when a buffer is free again
+      if (isPending && queue.size() < _buffers) {
+        pending.queued = now + 1;
+        queue.push_back (pending);
+        isPending = false;
+      }
+      k++;
+    }
+  }
+
+  result.sent = ages.size();
+  if (ages.size()) {
+    std::sort (ages.begin(), ages.end());
+    double sum = 0;
+    for (double age : ages)
+      sum += age;
+    result.mean = sum / ages.size();
+    result.p95 = ages[ages.size() * 95 / 100];
+    result.max = ages.back();
+  }
+  return result;
+}
+
+
+// Connection event prediction across the micros() wraparound
+
+static bool _checkPrediction (void)
+{
+  bool passed = true;
+  uint32_t anchor = 0xFFFFF000;
+
+  for (uint32_t step = 0; step < 1000; step++) {
+    uint32_t now = anchor + step * 997;
+    uint32_t wait = coreMicrosToConnectionEvent (now, anchor, _interval);
+    uint64_t elapsed = (uint64_t) step * 997;
+    uint64_t expected = _interval - elapsed % _interval;
+    if (wait != expected) {
+      printf ("  ERROR: %u us to the next connection event at %u us after the anchor, expected %u\n",
+              wait, (uint32_t) elapsed, (uint32_t) expected);
+      passed = false;
+      break;
+    }
+    uint32_t hold = corePacingDelay (wait, _guard);
+    if ((hold && hold * 1000 + _guard > wait) || (! hold && wait > _guard + 1000)) {
+      printf ("  ERROR: holding %u ms, %u us before the connection event\n", hold, wait);
+      passed = false;
+      break;
+    }
+  }
+  if (coreMicrosToConnectionEvent (1234, 0, 0) || corePacingDelay (0, _guard)) {
+    printf ("  ERROR: pacing without a connection interval\n");
+    passed = false;
+  }
+  return passed;
+}
+
+
+int main (int argc, char *argv[])
+{
+  uint32_t framePeriod = 0, seconds = 60;
+  int option;
+
+  while ((option = getopt (argc, argv, "i:g:l:b:e:f:s:")) != -1) {
+    switch (option) {
+      case 'i': _interval = atoi (optarg); break;
+      case 'g': _guard = atoi (optarg); break;
+      case 'l': _lead = atoi (optarg); break;
+      case 'b': _buffers = atoi (optarg); break;
+      case 'e': _perEvent = atoi (optarg); break;
+      case 'f': framePeriod = atoi (optarg); break;
+      case 's': seconds = atoi (optarg); break;
+      default:
+        fprintf (stderr, "usage: %s [-i interval] [-g guard] [-l lead] [-b buffers] [-e reports per event] [-f frame period] [-s seconds]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (_interval < 1250 || _buffers < 1 || _perEvent < 1 || seconds < 1 || seconds > 4000) {
+    fprintf (stderr, "invalid parameters\n");
+    return 1;
+  }
+
+  bool passed = _checkPrediction();
+  printf ("connection event prediction: %s\n", passed ? "ok" : "failed");
+
+  static const Scenario scenarios[] = {
+    { "no pacing",                false, 0,    0 },
+    { "pacing, exact anchor",     true,  0,    0 },
+    { "pacing, anchor 1 ms late", true,  1000, 0 },
+    { "pacing, anchor 2 ms late", true,  2000, 0 },
+    { "pacing, 20 ppm drift",     true,  0,    20 },
+    { "pacing, 200 ppm drift",    true,  0,    200 },
+  };
+  uint32_t periods[] = { 22500, 4000 };
+  uint32_t periodCount = 2;
+  if (framePeriod) {
+    periods[0] = framePeriod;
+    periodCount = 1;
+  }
+
+  for (uint32_t p = 0; p < periodCount; p++) {
+    printf ("\n%u us connection interval, %u us frame period, %u us guard, %u us lead, %u buffers, %u reports per event, %u s\n",
+            _interval, periods[p], _guard, _lead, _buffers, _perEvent, seconds);
+    printf ("%-26s %7s %8s %7s | %9s %9s %9s\n", "", "sent", "replaced", "missed", "mean (us)", "95% (us)", "max (us)");
+
+    Result unpaced = { 0, 0, 0, 0, 0, 0 };
+    for (const Scenario &scenario : scenarios) {
+      Result result = _simulate (&scenario, periods[p], seconds);
+      printf ("%-26s %7u %8u %7u | %9.0f %9.0f %9.0f\n", scenario.name, result.sent, result.replaced, result.missed,
+              result.mean, result.p95, result.max);
+
+      if (! scenario.pacing)
+        unpaced = result;
+      else if (! scenario.anchorError && ! scenario.drift && (result.missed || result.mean > unpaced.mean)) {
+        printf ("  ERROR: pacing with an exact anchor missed %u connection events, mean age %.0f us vs %.0f us\n",
+                result.missed, result.mean, unpaced.mean);
+        passed = false;
+      }
+    }
+  }
+
+  printf (passed ? "\nPASSED\n" : "\nFAILED\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,420 @@
+/*
+   --------- PPM-to-HID pipeline benchmark & capture replay
+
+   Runs the sketch's portable core (GamepadCore.cpp) on the computer, with the sketch's
+   default parameters and the GamepadRefresh task's scheduling emulated in simulated time:
+
+    - benchmark mode feeds synthetic PPM frames (2 to 16 channels, 50 to 500 Hz frame rate,
+      configurable noise, sticks alternating between movement and rest) through the
+      pipeline, and reports the processing time per frame, the resulting HID report rate
+      and the ratio of frames suppressed by the noise threshold
+    - replay mode (-p) feeds a capture recorded with CAPTURE_RMT_FRAMES (see RmtCapture.h)
+      through the pipeline, and prints the HID reports that the sketch would notify, with
+      their timestamps. The output is deterministic, so that captures of real transmitters
+      can be used to compare firmware revisions.
+
+   The reports match the sketch's only with CHANNEL_CALIBRATION, INPUT_FILTER and
+   SWITCH_BUTTON_CHANNELS set to 0 (the defaults): the calibrated axis curves, the input filter
+   and the switch buttons are not emulated. Neither is the Bluetooth side of JRGamepad: every
+   changed report counts as notified, where the sketch holds it back while the stack is
+   congested, and then notifies only the newest one.
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -I. extras/pipeline_bench.cpp GamepadCore.cpp RmtCapture.cpp -o pipeline_bench
+
+   Usage:
+
+     pipeline_bench [-c channels] [-r frame rate] [-n noise] [-s seconds] [-R refresh rate] [-8 | -b bits] [-a] [-S seed] [-t ticks]
+     pipeline_bench -p capture.bin [-R refresh rate] [-8 | -b bits] [-a] [-t ticks]
+
+   -8 or -b sets the bits per axis (16 by default, see AXIS_BITS).
+   -a enables the adaptive refresh rate (ADAPTIVE_REFRESH), with the refresh rate as ceiling.
+   -t sets the RMT clock ticks per microsecond: 10 by default, 16 for captures recorded with
+   RMT_HIGH_RESOLUTION.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+ #include <x86intrin.h>
+#endif
+
+#include "GamepadCore.h"
+#include "RmtCapture.h"
+
+// The sketch's default parameters (see JR_BLE_Gamepad.ino)
+#define PPM_PULSE_CENTER     1500
+#define PPM_PULSE_DELTA      500
+#define PPM_SYNC_MINIMUM     2500
+#define PPM_MAX_FRAMESIZE    50000
+#define PPM_SEPARATOR        300
+#define PPM_PULSE_MIN        800
+#define PPM_PULSE_MAX        2200
+#define PPM_MAX_SLEW         600
+#define PPM_BRIDGE_FRAMES    2
+#define NOISE_SCALE          1.2f
+#define NOISE_HYSTERESIS     2
+#define NOISE_HOLD_MILLIS    250
+#define REFRESH_INACTIVITY_MILLIS 1000
+#define GAMEPAD_MAX_AXES     12
+#define LOCK_FRAMES          10
+#define NOISE_SAMPLE_MICROS  1000000
+#define NOISE_UPDATE_MICROS  10000
+#define ADAPTIVE_RATE_MIN    10
+#define ADAPTIVE_FULL_SPEED  2000
+#define ADAPTIVE_RATE_RECOVERY 20
+
+// RMT clock ticks per microsecond
+static uint32_t _tickRate = 10;
+
+
+// ----- Emulated pipeline
+
+struct Pipeline {
+  FrameValidator validator;
+  NoiseEstimator noise;
+  AxisScale axisScale;
+  RefreshController controller;
+
+  uint32_t frame[CORE_MAX_CHANNELS];        // most recently published frame
+  uint32_t channelCount;
+  uint32_t axisCount;
+  uint32_t receivedFrames;
+  bool pending;                             // a published frame is waiting for the GamepadRefresh task
+
+  uint64_t lockTime, lastNoiseUpdate;
+  bool sampling;
+  uint64_t nextRefresh, lastRefresh;        // GamepadRefresh scheduling (us)
+  uint32_t refreshRate;
+  bool adaptive;                            // adaptive refresh rate, with refreshRate as the ceiling
+  HidLayout layout;                         // HID report layout of a gamepad
+
+  int16_t axes[GAMEPAD_MAX_AXES];
+  uint8_t reports[2][32];
+  uint32_t reportLength[2];
+
+  FILE *output;                             // HID report output, or NULL
+
+  uint64_t framesReceived, framesRejected, framesBridged, glitchesHeld;
+  uint64_t framesChecked, reportsSuppressed, reportsSent, reportsUnchanged;
+  uint64_t nanos, ticks;
+
+  Pipeline (uint32_t refreshRate, bool adaptive, uint32_t axisBits, FILE *output);
+  void receive (uint64_t now, const uint32_t items[], uint32_t count);
+  void refresh (uint64_t now, bool newFrame);
+};
+
+
+Pipeline::Pipeline (uint32_t refreshRate, bool adaptive, uint32_t axisBits, FILE *output) :
+  axisScale(_tickRate, PPM_PULSE_CENTER, PPM_PULSE_DELTA, true), channelCount(0), axisCount(0), receivedFrames(0), pending(false), lockTime(0), lastNoiseUpdate(0),
+  sampling(false), nextRefresh(0), lastRefresh(0), framesReceived(0), framesRejected(0), framesBridged(0),
+  glitchesHeld(0), framesChecked(0), reportsSuppressed(0), reportsSent(0), reportsUnchanged(0), nanos(0), ticks(0)
+{
+  memset (this->frame, 0, sizeof (this->frame));
+  memset (this->axes, 0, sizeof (this->axes));
+  memset (this->reportLength, 0, sizeof (this->reportLength));
+  this->validator.begin (PPM_PULSE_MIN * _tickRate, PPM_PULSE_MAX * _tickRate,
+                         (PPM_MAX_FRAMESIZE - PPM_SYNC_MINIMUM) * _tickRate,
+                         PPM_MAX_SLEW * _tickRate, PPM_BRIDGE_FRAMES);
+  this->refreshRate = refreshRate;
+  this->adaptive = adaptive;
+  this->layout.gamepads = 1;
+  this->layout.axes = 6;
+  this->layout.bits = axisBits;
+  this->layout.buttons = 8;
+  this->layout.positive = true;
+  this->output = output;
+}
+
+
+static inline uint64_t _ticks (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+
+// ChannelExtractor: decode, validate & publish a frame, then let the NoiseEstimator and
+// GamepadRefresh tasks run. A NULL items pointer is a frame timeout.
+
+void Pipeline::receive (uint64_t now, const uint32_t items[], uint32_t count)
+{
+  auto start = std::chrono::steady_clock::now();
+  uint64_t startTicks = _ticks();
+  bool published = false;
+
+  // a frame published while the GamepadRefresh task sleeps is picked up when it wakes up
+  if (this->pending && this->nextRefresh <= now)
+    this->refresh (this->nextRefresh, true);
+
+  if (items) {
+    uint32_t frame[CORE_MAX_CHANNELS];
+    uint32_t glitches = 0;
+    uint32_t frameChannels = coreDecodeFrame (items, count, frame);
+
+    bool valid = true;
+    if (! this->validator.validate (frame, frameChannels, count - 1, &glitches)) {
+      this->framesRejected++;
+      valid = this->validator.bridge (frame, &frameChannels);
+      this->framesBridged += valid;
+    }
+    this->glitchesHeld += glitches;
+
+    if (valid) {
+      this->validator.accept (frame, frameChannels);
+      memcpy (this->frame, frame, sizeof (frame));
+      this->channelCount = frameChannels;
+      this->receivedFrames++;
+      this->framesReceived++;
+      published = true;
+    }
+  }
+
+  // lock the channels, then sample the noise for one second
+  if (this->receivedFrames >= LOCK_FRAMES && ! this->axisCount) {
+    this->axisCount = this->channelCount > GAMEPAD_MAX_AXES ? GAMEPAD_MAX_AXES : this->channelCount;
+    this->validator.lockedChannels = this->channelCount;
+    this->noise.begin (this->axisCount, PPM_PULSE_MIN * _tickRate, PPM_PULSE_MAX * _tickRate,
+                       NOISE_SCALE, NOISE_HYSTERESIS, NOISE_HOLD_MILLIS);
+    this->sampling = true;
+    this->lockTime = now;
+  }
+  else if (this->sampling && published) {
+    if (now - this->lockTime < NOISE_SAMPLE_MICROS)
+      this->noise.sample (this->frame);
+    else {
+      this->noise.finishSampling();
+      this->sampling = false;
+      this->controller.begin (this->axisCount, ADAPTIVE_RATE_MIN, ADAPTIVE_FULL_SPEED * _tickRate, ADAPTIVE_RATE_RECOVERY);
+    }
+  }
+  else if (this->axisCount && published && now - this->lastNoiseUpdate >= NOISE_UPDATE_MICROS) {
+    this->noise.update (this->frame, now / 1000);
+    this->lastNoiseUpdate = now;
+  }
+
+  // the GamepadRefresh task starts once the initial noise thresholds are known
+  if (this->axisCount && ! this->sampling) {
+    if (published && this->adaptive)
+      this->controller.update (this->frame, now, this->noise.threshold);
+    this->pending |= published;
+    if (now >= this->nextRefresh)
+      this->refresh (now, this->pending);
+  }
+
+  this->ticks += _ticks() - startTicks;
+  this->nanos += std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now() - start).count();
+}
+
+
+// GamepadRefresh: check the newest frame for user activity, and notify the changed reports
+// (uncalibrated & unfiltered, without buttons, and without congestion)
+
+void Pipeline::refresh (uint64_t now, bool newFrame)
+{
+  bool keepAlive = now - this->lastRefresh > REFRESH_INACTIVITY_MILLIS * 1000ULL;
+  bool changed = false;
+  this->pending = false;
+
+  if (newFrame) {
+    this->framesChecked++;
+    changed = this->noise.changeDetected (this->frame, now / 1000);
+    if (! changed)
+      this->reportsSuppressed++;
+  }
+  if (! changed && ! keepAlive)
+    return;
+
+  for (uint32_t i = 0; i < this->axisCount; i++)
+    this->axes[i] = this->axisScale.convert (this->frame[i]);
+
+  uint32_t gamepads = this->axisCount > 6 ? 2 : 1;
+  for (uint32_t g = 0; g < gamepads; g++) {
+    uint8_t report[32];
+    size_t length = coreEncodeReport (report, &this->axes[g * 6], 0, &this->layout);
+
+    if (! keepAlive && this->reportLength[g] && memcmp (report, this->reports[g], length) == 0) {
+      this->reportsUnchanged++;
+      continue;
+    }
+    memcpy (this->reports[g], report, length);
+    this->reportLength[g] = length;
+    this->reportsSent++;
+
+    if (this->output) {
+      fprintf (this->output, "%10llu %u", (unsigned long long) now, g);
+      for (size_t i = 0; i < length; i++)
+        fprintf (this->output, " %02x", report[i]);
+      fprintf (this->output, "\n");
+    }
+  }
+
+  uint32_t rate = this->adaptive ? this->controller.rate (this->refreshRate, now / 1000) : this->refreshRate;
+  this->lastRefresh = now;
+  this->nextRefresh = now + 1000000 / rate;
+}
+
+
+// ----- Synthetic PPM signal
+
+static uint32_t _seed = 1;
+
+static uint32_t _random (void)
+{
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return _seed;
+}
+
+// Encode a PPM frame (channel pulses in ticks) as RMT items: the separator pulse (low), then
+// the rest of the channel pulse (high), and finally the sync pulse
+static uint32_t _encodeFrame (const uint32_t pulses[], uint32_t channels, uint32_t items[])
+{
+  for (uint32_t i = 0; i < channels; i++)
+    items[i] = (PPM_SEPARATOR * _tickRate) | ((pulses[i] - PPM_SEPARATOR * _tickRate) << 16) | 0x80000000;
+  items[channels] = PPM_SEPARATOR * _tickRate;
+  return channels + 1;
+}
+
+// The first four channels are sticks, moving during 2 seconds and resting during 2 seconds,
+// the remaining ones are switches. The pulses are sampled at the RMT tick rate.
+static void _syntheticFrame (uint64_t now, uint32_t channels, uint32_t noise, uint32_t pulses[])
+{
+  double t = now / 1e6;
+  bool moving = ((uint64_t) t / 2) % 2;
+
+  for (uint32_t i = 0; i < channels; i++) {
+    double value = PPM_PULSE_CENTER;
+    if (i < 4 && moving)
+      value += PPM_PULSE_DELTA * 0.8 * sin (2 * M_PI * t * (0.3 + 0.2 * i));
+    else if (i >= 4)
+      value += (i % 2) ? PPM_PULSE_DELTA : -PPM_PULSE_DELTA;
+
+    // triangular noise distribution, from -noise to +noise us
+    if (noise)
+      value += (int32_t) (_random() % (noise + 1) + _random() % (noise + 1)) - (int32_t) noise;
+    pulses[i] = (uint32_t) (value * _tickRate);
+  }
+}
+
+
+static void _printResults (FILE *out, Pipeline *p, double seconds)
+{
+  fprintf (out, "frames received    %llu (rejected %llu, bridged %llu, glitches held %llu)\n",
+          (unsigned long long) p->framesReceived, (unsigned long long) p->framesRejected,
+          (unsigned long long) p->framesBridged, (unsigned long long) p->glitchesHeld);
+  fprintf (out, "time per frame     %.1f ns", p->framesReceived ? (double) p->nanos / p->framesReceived : 0);
+  if (p->ticks)
+    fprintf (out, ", %.0f TSC cycles", (double) p->ticks / p->framesReceived);
+  fprintf (out, "\n");
+  fprintf (out, "reports sent       %llu (%.1f/s), unchanged %llu\n",
+          (unsigned long long) p->reportsSent, seconds ? p->reportsSent / seconds : 0,
+          (unsigned long long) p->reportsUnchanged);
+  fprintf (out, "suppression ratio  %.3f (%llu of %llu checked frames)\n",
+          p->framesChecked ? (double) p->reportsSuppressed / p->framesChecked : 0,
+          (unsigned long long) p->reportsSuppressed, (unsigned long long) p->framesChecked);
+}
+
+
+static int _replay (const char *path, Pipeline *p)
+{
+  FILE *capture = fopen (path, "rb");
+  if (! capture) {
+    perror (path);
+    return 1;
+  }
+
+  RmtCaptureDecoder decoder;
+  uint64_t first = 0, now = 0;
+  uint32_t last = 0;
+  bool started = false;
+  int c;
+
+  while ((c = fgetc (capture)) != EOF) {
+    if (! decoder.feed (c))
+      continue;
+
+    // unwrap the 32-bit microsecond timestamps
+    if (! started) {
+      first = decoder.timestamp;
+      started = true;
+    }
+    else
+      now += (uint32_t) (decoder.timestamp - last);
+    last = decoder.timestamp;
+
+    // frames skipped or truncated on the board are skipped here as well
+    if (decoder.flags & RMT_CAPTURE_DROPPED || decoder.count >= RMT_CAPTURE_MAX_ITEMS)
+      continue;
+    p->receive (first + now, decoder.count ? decoder.items : NULL, decoder.count);
+  }
+  fclose (capture);
+
+  fprintf (stderr, "capture: %u bad records, %.1f s\n", decoder.errors, now / 1e6);
+  _printResults (stderr, p, now / 1e6);
+  return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+  uint32_t channels = 8, frameRate = 50, noise = 2, seconds = 60, refreshRate = 25;
+  uint32_t axisBits = 16;
+  bool adaptive = false;
+  const char *capture = NULL;
+  int option;
+
+  while ((option = getopt (argc, argv, "c:r:n:s:R:8b:aS:p:t:")) != -1) {
+    switch (option) {
+      case 'c': channels = atoi (optarg); break;
+      case 'r': frameRate = atoi (optarg); break;
+      case 'n': noise = atoi (optarg); break;
+      case 's': seconds = atoi (optarg); break;
+      case 'R': refreshRate = atoi (optarg); break;
+      case '8': axisBits = 8; break;
+      case 'b': axisBits = atoi (optarg); break;
+      case 'a': adaptive = true; break;
+      case 'S': _seed = atoi (optarg) | 1; break;
+      case 'p': capture = optarg; break;
+      case 't': _tickRate = atoi (optarg); break;
+      default:
+        fprintf (stderr, "usage: %s [-c channels] [-r frame rate] [-n noise] [-s seconds] [-R refresh rate] [-8 | -b bits] [-a] [-S seed] [-t ticks]\n"
+                         "       %s -p capture.bin [-R refresh rate] [-8 | -b bits] [-a] [-t ticks]\n", argv[0], argv[0]);
+        return 1;
+    }
+  }
+  if (channels < 2 || channels > CORE_MAX_CHANNELS || frameRate < 1 || ! refreshRate
+      || _tickRate < 1 || _tickRate > 16 || axisBits < 2 || axisBits > 16) {
+    fprintf (stderr, "invalid parameters\n");
+    return 1;
+  }
+
+  if (capture) {
+    Pipeline p (refreshRate, adaptive, axisBits, stdout);
+    return _replay (capture, &p);
+  }
+
+  Pipeline p (refreshRate, adaptive, axisBits, NULL);
+  uint32_t pulses[CORE_MAX_CHANNELS], items[CORE_MAX_CHANNELS + 1];
+  uint64_t frames = (uint64_t) seconds * frameRate;
+
+  printf ("%u channels @ %u Hz, noise +/-%u us, refresh rate %u Hz, %u ticks/us, %u s\n",
+          channels, frameRate, noise, refreshRate, _tickRate, seconds);
+  for (uint64_t f = 0; f < frames; f++) {
+    uint64_t now = f * 1000000 / frameRate;
+    _syntheticFrame (now, channels, noise, pulses);
+    uint32_t count = _encodeFrame (pulses, channels, items);
+    p.receive (now, items, count);
+  }
+  _printResults (stdout, &p, seconds);
+  return 0;
+}
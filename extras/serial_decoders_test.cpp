@@ -0,0 +1,329 @@
+/*
+   --------- SBUS & CRSF decoder test
+
+   Feeds byte streams to the sketch's SBUS and CRSF decoders (see SerialDecoders.h), byte by
+   byte as the UART delivers them, and checks the decoded channel values:
+
+    - reference frames with all channels centered (992), as receivers output them, and frames
+      packed by this test with extreme and distinct values on every channel
+    - the SBUS failsafe flag and SBUS2 end bytes, CRSF telemetry frames between the RC channels
+      frames, which must be skipped
+    - streams joined at every offset within a frame, as when the receiver is plugged in while
+      it outputs: the channel data of centered frames contains header bytes, on which the
+      decoders must not stay misaligned
+    - corrupted bytes, which must be counted as errors without losing the following frames
+
+   Build from the sketch folder with CMake (see CMakeLists.txt), or with:
+
+     g++ -O2 -std=gnu++11 -I. extras/serial_decoders_test.cpp SerialDecoders.cpp -o serial_decoders_test
+
+   Usage:
+
+     serial_decoders_test                       run the tests, returns 0 if all checks pass
+     serial_decoders_test -s|-c stream.bin      decode a stream recorded from an SBUS (-s) or CRSF (-c) receiver
+
+   Record a stream with a USB serial adapter, for example on Linux (CRSF, at the transmitter's
+   baud rate, see CRSF_BAUDRATE in the sketch):
+   stty -F /dev/ttyUSB0 400000 raw && cat /dev/ttyUSB0 > stream.bin
+   SBUS needs an inverter, and 100000 baud 8E2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "SerialDecoders.h"
+
+
+// Reference frames with all 16 channels at 992 (1500 us)
+
+static const uint8_t _sbusCentered[SBUS_FRAME_SIZE] = {
+  0x0F, 0xE0, 0x03, 0x1F, 0xF8, 0xC0, 0x07, 0x3E, 0xF0, 0x81, 0x0F, 0x7C, 0xE0,
+  0x03, 0x1F, 0xF8, 0xC0, 0x07, 0x3E, 0xF0, 0x81, 0x0F, 0x7C, 0x00, 0x00
+};
+
+static const uint8_t _crsfCentered[26] = {
+  0xC8, 0x18, 0x16, 0xE0, 0x03, 0x1F, 0xF8, 0xC0, 0x07, 0x3E, 0xF0, 0x81, 0x0F,
+  0x7C, 0xE0, 0x03, 0x1F, 0xF8, 0xC0, 0x07, 0x3E, 0xF0, 0x81, 0x0F, 0x7C, 0xAD
+};
+
+typedef std::vector<uint8_t> Stream;
+
+static uint32_t _errors = 0;
+
+#define CHECK(condition, ...) \
+  if (! (condition)) { \
+    if (_errors++ < 20) { printf ("  ERROR: "); printf (__VA_ARGS__); printf ("\n"); } \
+  }
+
+
+// Pack 16 11-bit channel values, least significant bit first, one bit at a time
+
+static void _packChannels (const uint16_t channels[], uint8_t data[])
+{
+  memset (data, 0, 22);
+  for (uint32_t bit = 0; bit < RC_SERIAL_CHANNELS * 11; bit++)
+    if (channels[bit / 11] >> (bit % 11) & 1)
+      data[bit / 8] |= 1 << (bit % 8);
+}
+
+static uint8_t _crc8 (const uint8_t *data, uint32_t length)
+{
+  uint8_t crc = 0;
+  for (uint32_t i = 0; i < length; i++)
+    for (int32_t b = 7; b >= 0; b--) {
+      bool carry = ((crc >> 7) ^ (data[i] >> b)) & 1;
+      crc = carry ? (crc << 1) ^ 0xD5 : crc << 1;
+    }
+  return crc;
+}
+
+static void _appendSbus (Stream *stream, const uint16_t channels[], uint8_t flags, uint8_t end)
+{
+  uint8_t frame[SBUS_FRAME_SIZE];
+  frame[0] = SBUS_HEADER;
+  _packChannels (channels, &frame[1]);
+  frame[23] = flags;
+  frame[24] = end;
+  stream->insert (stream->end(), frame, frame + SBUS_FRAME_SIZE);
+}
+
+static void _appendCrsf (Stream *stream, uint8_t type, const uint8_t payload[], uint32_t size)
+{
+  uint8_t frame[CRSF_MAX_FRAME];
+  frame[0] = 0xC8;
+  frame[1] = size + 2;
+  frame[2] = type;
+  memcpy (&frame[3], payload, size);
+  frame[3 + size] = _crc8 (&frame[2], size + 1);
+  stream->insert (stream->end(), frame, frame + size + 4);
+}
+
+static void _appendCrsfChannels (Stream *stream, const uint16_t channels[])
+{
+  uint8_t payload[22];
+  _packChannels (channels, payload);
+  _appendCrsf (stream, CRSF_TYPE_RC_CHANNELS_PACKED, payload, 22);
+}
+
+
+// Channel values of the n-th test frame: extremes, and distinct values on every channel
+
+static void _testChannels (uint32_t n, uint16_t channels[])
+{
+  for (uint32_t c = 0; c < RC_SERIAL_CHANNELS; c++)
+    channels[c] = n == 0 ? (c % 2 ? 172 : 1811)
+                : n == 1 ? (c % 2 ? 0 : 2047)
+                : (n * 131 + c * 97) % 2048;
+}
+
+static bool _sameChannels (const uint16_t a[], const uint16_t b[])
+{
+  return memcmp (a, b, RC_SERIAL_CHANNELS * sizeof (uint16_t)) == 0;
+}
+
+
+// Feed a stream, returning the number of decoded frames. Every decoded frame must match one
+// of the expected frames, in order
+
+template <class Decoder>
+static uint32_t _feed (Decoder *decoder, const Stream &stream, const std::vector<const uint16_t*> &expected, const char *name)
+{
+  uint32_t decoded = 0, next = 0;
+  for (uint8_t byte : stream) {
+    if (! decoder->feed (byte))
+      continue;
+    decoded++;
+    while (next < expected.size() && ! _sameChannels (decoder->channels, expected[next]))
+      next++;
+    CHECK (next < expected.size(), "%s: frame %u decoded with unexpected channel values", name, decoded);
+    next++;
+  }
+  return decoded;
+}
+
+
+static void _testSbus (void)
+{
+  static const uint16_t centered[RC_SERIAL_CHANNELS] = { 992, 992, 992, 992, 992, 992, 992, 992,
+                                                         992, 992, 992, 992, 992, 992, 992, 992 };
+  std::vector<const uint16_t*> expectCentered (1, centered);
+  uint16_t channels[8][RC_SERIAL_CHANNELS];
+
+  // reference frame
+  {
+    SbusDecoder decoder;
+    Stream stream (_sbusCentered, _sbusCentered + SBUS_FRAME_SIZE);
+    CHECK (_feed (&decoder, stream, expectCentered, "sbus reference") == 1, "sbus: reference frame not decoded");
+    CHECK (! decoder.failsafe && decoder.errors == 0, "sbus: reference frame flags");
+  }
+
+  // packed frames, SBUS2 end bytes, failsafe flag
+  {
+    SbusDecoder decoder;
+    Stream stream;
+    std::vector<const uint16_t*> expected;
+    static const uint8_t ends[] = { 0x00, 0x04, 0x14, 0x24, 0x34, 0x00, 0x00, 0x00 };
+    for (uint32_t n = 0; n < 8; n++) {
+      _testChannels (n, channels[n]);
+      _appendSbus (&stream, channels[n], 0, ends[n]);
+      expected.push_back (channels[n]);
+    }
+    CHECK (_feed (&decoder, stream, expected, "sbus packed") == 8, "sbus: packed frames not all decoded");
+    CHECK (decoder.errors == 0, "sbus: %u errors on packed frames", decoder.errors);
+
+    stream.clear();
+    _appendSbus (&stream, channels[0], 0x08, 0x00);
+    _feed (&decoder, stream, expected, "sbus failsafe");
+    CHECK (decoder.failsafe, "sbus: failsafe flag not decoded");
+  }
+
+  // joined at every offset of a centered frame: at most the first two frames may be lost
+  for (uint32_t offset = 0; offset < SBUS_FRAME_SIZE; offset++) {
+    SbusDecoder decoder;
+    Stream stream;
+    for (uint32_t n = 0; n < 10; n++)
+      stream.insert (stream.end(), _sbusCentered, _sbusCentered + SBUS_FRAME_SIZE);
+    stream.erase (stream.begin(), stream.begin() + offset);
+    uint32_t decoded = _feed (&decoder, stream, std::vector<const uint16_t*> (10, centered), "sbus joined");
+    CHECK (decoded >= 8, "sbus: joined at offset %u, only %u of 10 frames decoded", offset, decoded);
+  }
+
+  // a corrupted end byte loses that frame only (resynchronizing may count further errors)
+  {
+    SbusDecoder decoder;
+    Stream stream;
+    std::vector<const uint16_t*> expected;
+    for (uint32_t n = 0; n < 4; n++) {
+      _testChannels (n + 2, channels[n]);
+      _appendSbus (&stream, channels[n], 0, n == 1 ? 0x55 : 0x00);
+      expected.push_back (channels[n]);
+    }
+    uint32_t decoded = _feed (&decoder, stream, expected, "sbus corrupted");
+    CHECK (decoded == 3 && decoder.errors >= 1, "sbus: corrupted end byte, %u frames decoded, %u errors", decoded, decoder.errors);
+  }
+}
+
+
+static void _testCrsf (void)
+{
+  static const uint16_t centered[RC_SERIAL_CHANNELS] = { 992, 992, 992, 992, 992, 992, 992, 992,
+                                                         992, 992, 992, 992, 992, 992, 992, 992 };
+  std::vector<const uint16_t*> expectCentered (1, centered);
+  uint16_t channels[8][RC_SERIAL_CHANNELS];
+
+  // link statistics telemetry frame, between the RC channels frames
+  static const uint8_t linkStatistics[10] = { 0x3C, 0x00, 0x64, 0x0A, 0x00, 0x04, 0x02, 0x3C, 0x64, 0x0A };
+
+  // reference frame
+  {
+    CrsfDecoder decoder;
+    Stream stream (_crsfCentered, _crsfCentered + sizeof (_crsfCentered));
+    CHECK (_feed (&decoder, stream, expectCentered, "crsf reference") == 1, "crsf: reference frame not decoded");
+    CHECK (decoder.errors == 0, "crsf: reference frame errors");
+  }
+
+  // packed frames, with telemetry frames in between
+  {
+    CrsfDecoder decoder;
+    Stream stream;
+    std::vector<const uint16_t*> expected;
+    for (uint32_t n = 0; n < 8; n++) {
+      _testChannels (n, channels[n]);
+      _appendCrsfChannels (&stream, channels[n]);
+      if (n % 2)
+        _appendCrsf (&stream, 0x14, linkStatistics, sizeof (linkStatistics));
+      expected.push_back (channels[n]);
+    }
+    CHECK (_feed (&decoder, stream, expected, "crsf packed") == 8, "crsf: packed frames not all decoded");
+    CHECK (decoder.errors == 0, "crsf: %u errors on packed frames", decoder.errors);
+  }
+
+  // joined at every offset of a centered frame followed by a telemetry frame
+  Stream pair (_crsfCentered, _crsfCentered + sizeof (_crsfCentered));
+  _appendCrsf (&pair, 0x14, linkStatistics, sizeof (linkStatistics));
+  for (uint32_t offset = 0; offset < pair.size(); offset++) {
+    CrsfDecoder decoder;
+    Stream stream;
+    for (uint32_t n = 0; n < 10; n++)
+      stream.insert (stream.end(), pair.begin(), pair.end());
+    stream.erase (stream.begin(), stream.begin() + offset);
+    uint32_t decoded = _feed (&decoder, stream, std::vector<const uint16_t*> (10, centered), "crsf joined");
+    CHECK (decoded >= 9, "crsf: joined at offset %u, only %u of 10 frames decoded", offset, decoded);
+  }
+
+  // corrupted bytes (payload, length, CRC) lose their frame only
+  for (uint32_t position = 1; position < sizeof (_crsfCentered); position++) {
+    CrsfDecoder decoder;
+    Stream stream;
+    std::vector<const uint16_t*> expected;
+    for (uint32_t n = 0; n < 4; n++) {
+      _testChannels (n + 2, channels[n]);
+      _appendCrsfChannels (&stream, channels[n]);
+      expected.push_back (channels[n]);
+    }
+    stream[sizeof (_crsfCentered) + position] ^= 0x10;
+    uint32_t decoded = _feed (&decoder, stream, expected, "crsf corrupted");
+    CHECK (decoded == 3 && decoder.errors >= 1, "crsf: byte %u corrupted, %u frames decoded, %u errors", position, decoded, decoder.errors);
+  }
+}
+
+
+// Decode a recorded stream, printing the frame count, errors and the last channel values
+
+template <class Decoder>
+static int _decodeRecording (Decoder *decoder, const char *path)
+{
+  FILE *file = fopen (path, "rb");
+  if (! file) {
+    perror (path);
+    return 1;
+  }
+
+  uint32_t bytes = 0, frames = 0;
+  int c;
+  while ((c = fgetc (file)) != EOF) {
+    bytes++;
+    frames += decoder->feed (c);
+  }
+  fclose (file);
+
+  printf ("%u bytes, %u frames, %u errors\nlast frame:", bytes, frames, decoder->errors);
+  for (uint32_t i = 0; i < RC_SERIAL_CHANNELS; i++)
+    printf (" %u", decoder->channels[i]);
+  printf ("\n");
+  return frames == 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+  int option;
+  while ((option = getopt (argc, argv, "s:c:")) != -1) {
+    switch (option) {
+      case 's': {
+        SbusDecoder decoder;
+        return _decodeRecording (&decoder, optarg);
+      }
+      case 'c': {
+        CrsfDecoder decoder;
+        return _decodeRecording (&decoder, optarg);
+      }
+      default:
+        fprintf (stderr, "usage: %s [-s|-c stream.bin]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  _testSbus();
+  printf ("sbus: %s\n", _errors ? "failed" : "ok");
+  uint32_t sbusErrors = _errors;
+  _testCrsf();
+  printf ("crsf: %s\n", _errors > sbusErrors ? "failed" : "ok");
+
+  printf (_errors ? "FAILED\n" : "PASSED\n");
+  return _errors ? 1 : 0;
+}